@@ -0,0 +1,883 @@
+/*
+ * Copyright © 2021, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of ops-inject.
+ *
+ * ops-inject is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ops-inject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <argp.h>             /* argp_parse             */
+#include <stdio.h>            /* fprintf, fopen         */
+#include <stdint.h>           /* [u]int*_t              */
+#include <stdlib.h>           /* malloc                 */
+#include <string.h>           /* memset, strstr         */
+#include <time.h>             /* clock_gettime          */
+#include <sys/time.h>         /* gettimeofday           */
+#include <arpa/inet.h>        /* htons                  */
+#include <netinet/ip.h>       /* iphdr                  */
+#include <netinet/tcp.h>      /* tcphdr                 */
+#include <netinet/udp.h>      /* udphdr                 */
+#include <netinet/in.h>       /* IPPROTO_*              */
+#include <errno.h>            /* errno                  */
+#include <pthread.h>          /* pthread_create         */
+
+extern "C" {
+#include "csum.h"
+#include "ops_ip.h"           /* individual ip  options decoders */
+#include "ops_tcp.h"          /* individual tcp options decoders */
+#include "ops_udp.h"          /* individual udp options decoders */
+#include "clock.h"
+}
+#include "cli_args.h"
+#include "decoders.h"
+#include "reassemblers.h"
+#include "annotate.h"
+#include "worker.h"
+#include "pmtu.h"
+#include "perf.h"
+#include "util.h"
+
+#define BENCH_PKTS      48          /* packets per set (4 imix cycles)     */
+#define BENCH_REPS      5           /* repetitions; the fastest is kept    */
+#define BENCH_CASES     256         /* max number of benchmark cases       */
+#define BENCH_NAME      80          /* max benchmark case name length      */
+#define PKT_BUF_SZ      0x10000     /* max ip packet                       */
+
+/* one synthetic packet mix (ip total lengths, repeated to fill a set) */
+struct mix {
+    const char   *name;
+    const size_t *len;
+    size_t       n;
+};
+
+/* packets that a benchmark case iterates over */
+struct pkt_set {
+    uint8_t *pkt[BENCH_PKTS];           /* ip packets                      */
+    size_t  arg;                        /* case specific (length, op, ...) */
+    uint8_t *ops;                       /* decoded ops (reassemblers)      */
+    size_t  ops_len;
+    struct csum_impl *impl;             /* checksum kernel                 */
+};
+
+/* measurement (per packet) */
+struct result {
+    char   name[BENCH_NAME];
+    double ns;
+    double cycles;
+    double insns;
+    double cmiss;
+};
+
+/* benchmarked routine; returns something that must not be optimized out */
+typedef size_t (*bench_fn)(struct pkt_set *set, size_t i);
+
+/* synthetic packet mixes */
+static const size_t len_64[]   = { 64 };
+static const size_t len_576[]  = { 576 };
+static const size_t len_1500[] = { 1500 };
+static const size_t len_imix[] = { 64, 64, 64, 64, 64, 64, 64,
+                                   576, 576, 576, 576, 1500 };
+
+static const struct mix mixes[] = {
+    { "64",   len_64,   1  },
+    { "576",  len_576,  1  },
+    { "1500", len_1500, 1  },
+    { "imix", len_imix, 12 },
+};
+
+/* user ops injected by the full chain benchmarks (one set per protocol) */
+static uint8_t ip_ops[]  = { 0x44 };                /* timestamp           */
+static uint8_t tcp_ops[] = { 0x01, 0x01, 0xfe };    /* nop, nop, exp       */
+static uint8_t udp_ops[] = { 0x01, 0x01, 0xfe };    /* nop, nop, exp       */
+
+/* benchmark state */
+static struct result     results[BENCH_CASES];
+static size_t            n_results;
+static struct perf_group pg;
+static volatile size_t   sink;                      /* defeats dce         */
+static uint8_t           mod_buf[PKT_BUF_SZ + 64];  /* contiguous output   */
+static uint8_t           head[SG_HEAD_MAX];         /* sg output           */
+static struct burst      burst;                     /* burst annotation    */
+static uint8_t           changed[BURST_MAX];        /* burst output        */
+static struct ops_ctx    ctx;                       /* decoder context     */
+
+/* command line arguments */
+static const char *json_path = NULL;    /* results output              */
+static const char *base_path = NULL;    /* baseline to compare against */
+static const char *filter    = NULL;    /* only run matching cases     */
+static double     threshold  = 5.0;     /* regression threshold (%)    */
+static double     min_ms     = 20.0;    /* min duration of one rep     */
+
+static struct argp_option options[] = {
+    { "json",      'o', "FILE", 0,
+      "Write results as JSON" },
+    { "compare",   'c', "FILE", 0,
+      "Flag regressions against a saved JSON baseline" },
+    { "threshold", 't', "PCT", 0,
+      "Slowdown considered a regression (default: 5)" },
+    { "filter",    'f', "STR", 0,
+      "Only run cases whose name contains STR" },
+    { "duration",  'm', "MS", 0,
+      "Minimum duration of one repetition (default: 20)" },
+    { 0 }
+};
+
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* parse_opt - parses one argument
+ *  @key   : argument id
+ *  @arg   : pointer to the actual argument
+ *  @state : parsing state
+ *
+ *  @return : 0 if everything ok
+ */
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+    switch (key) {
+        case 'o':
+            json_path = arg;
+            break;
+        case 'c':
+            base_path = arg;
+            break;
+        case 't':
+            sscanf(arg, "%lf", &threshold);
+            break;
+        case 'f':
+            filter = arg;
+            break;
+        case 'm':
+            sscanf(arg, "%lf", &min_ms);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+/* now_ns - monotonic time
+ *  @return : nanoseconds
+ */
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* build_pkt - builds a synthetic packet w/ valid checksums
+ *  @buf   : output buffer (PKT_BUF_SZ)
+ *  @proto : IPPROTO_ICMP (for ip ops), IPPROTO_TCP or IPPROTO_UDP
+ *  @len   : ip total length
+ *  @ops   : !0 to include existing options at the layer under test
+ *
+ * Existing options are nop, nop, nop, eool (ip), nop, nop, timestamp (tcp)
+ * or nop, nop, nop, eool after the datagram (udp). They are kept short so
+ * that the user ops still fit w/o overwriting.
+ */
+static void build_pkt(uint8_t *buf, uint8_t proto, size_t len, uint8_t ops)
+{
+    static const uint8_t ip_nop[4]  = { 0x01, 0x01, 0x01, 0x00 };
+    static const uint8_t tcp_ts[12] = { 0x01, 0x01, 0x08, 10, 0, 0, 0, 1 };
+    static const uint8_t udp_tr[4]  = { 0x01, 0x01, 0x01, 0x00 };
+    struct iphdr  *iph = (struct iphdr *) buf;
+    struct tcphdr *tcph;
+    struct udphdr *udph;
+    uint8_t       *l4;
+
+    memset(buf, 0, len);
+
+    iph->version  = 4;
+    iph->ihl      = 5;
+    iph->ttl      = 64;
+    iph->protocol = proto;
+    iph->tot_len  = htons(len);
+    iph->saddr    = htonl(0x0a000001);
+    iph->daddr    = htonl(0x0a000002);
+
+    if (proto == IPPROTO_ICMP && ops) {
+        memcpy(buf + 20, ip_nop, sizeof(ip_nop));
+        iph->ihl += sizeof(ip_nop) / 4;
+    }
+
+    l4 = buf + iph->ihl * 4;
+    for (uint8_t *p = l4; p < buf + len; p++)
+        *p = (uint8_t) ((p - buf) * 7);
+
+    switch (proto) {
+        case IPPROTO_ICMP:
+            l4[0] = 8;
+            l4[1] = 0;
+            break;
+        case IPPROTO_TCP:
+            tcph = (struct tcphdr *) l4;
+            memset(tcph, 0, sizeof(*tcph));
+            tcph->source = htons(1234);
+            tcph->dest   = htons(80);
+            tcph->doff   = 5;
+            tcph->syn    = 1;               /* required by ts decoder */
+            tcph->ack    = 1;
+            tcph->window = htons(0xffff);
+            if (ops) {
+                memcpy(l4 + 20, tcp_ts, sizeof(tcp_ts));
+                tcph->doff += sizeof(tcp_ts) / 4;
+            }
+            break;
+        case IPPROTO_UDP:
+            udph = (struct udphdr *) l4;
+            udph->source = htons(1234);
+            udph->dest   = htons(53);
+            udph->len    = htons(buf + len - l4 - (ops ? sizeof(udp_tr) : 0));
+            udph->check  = 0;
+            if (ops)
+                memcpy(buf + len - sizeof(udp_tr), udp_tr, sizeof(udp_tr));
+            break;
+    }
+
+    layer4_csum[proto](iph);
+    ipv4_csum(iph);
+}
+
+/* build_set - fills a packet set according to a mix
+ *  @set   : packet set (buffers already allocated)
+ *  @proto : see build_pkt()
+ *  @m     : packet mix
+ *  @ops   : see build_pkt()
+ */
+static void build_set(struct pkt_set *set, uint8_t proto, const struct mix *m,
+                      uint8_t ops)
+{
+    for (size_t i = 0; i < BENCH_PKTS; i++)
+        build_pkt(set->pkt[i], proto, m->len[i % m->n], ops);
+}
+
+/* set_proto - points the global arguments at a protocol's routines
+ *  @proto : IPPROTO_ICMP (for ip ops), IPPROTO_TCP or IPPROTO_UDP
+ *  @ow    : overwrite existing options
+ */
+static void set_proto(uint8_t proto, uint8_t ow)
+{
+    const struct annotate_mode *mode;
+
+    args.overwrite = ow;
+
+    switch (proto) {
+        case IPPROTO_ICMP:
+            args.decoder    = decode_ip_ops;
+            args.reasmbl    = reassemble_ip;
+            args.reasmbl_sg = reassemble_ip_sg;
+            args.layers            = 1 << LAYER_IP;
+            args.ops[LAYER_IP]     = ip_ops;
+            args.ops_len[LAYER_IP] = sizeof(ip_ops);
+            break;
+        case IPPROTO_TCP:
+            args.decoder    = decode_tcp_ops;
+            args.reasmbl    = reassemble_tcp;
+            args.reasmbl_sg = reassemble_tcp_sg;
+            args.layers             = 1 << LAYER_TCP;
+            args.ops[LAYER_TCP]     = tcp_ops;
+            args.ops_len[LAYER_TCP] = sizeof(tcp_ops);
+            break;
+        case IPPROTO_UDP:
+            args.decoder    = decode_udp_ops;
+            args.reasmbl    = reassemble_udp;
+            args.reasmbl_sg = reassemble_udp_sg;
+            args.layers             = 1 << LAYER_UDP;
+            args.ops[LAYER_UDP]     = udp_ops;
+            args.ops_len[LAYER_UDP] = sizeof(udp_ops);
+            break;
+    }
+
+    mode = annotate_select(args.layers, ow, args.full_csum);
+    args.annotate       = mode->one;
+    args.annotate_burst = mode->burst;
+}
+
+/* run - measures one benchmark case & records the result
+ *  @name : case name
+ *  @fn   : routine to be measured
+ *  @set  : packet set passed to fn
+ *
+ * The number of passes over the set is calibrated so that one repetition
+ * takes at least min_ms. Out of BENCH_REPS repetitions, the fastest is kept
+ * (along w/ its counters); slower ones are mostly scheduling noise.
+ */
+static void run(const char *name, bench_fn fn, struct pkt_set *set)
+{
+    struct result *res;
+    uint64_t      val[PERF_CNT];
+    uint64_t      t0, t1, n;
+    size_t        passes = 1;
+    size_t        acc    = 0;
+    double        ns;
+
+    if (filter && !strstr(name, filter))
+        return;
+    if (n_results == BENCH_CASES) {
+        WAR("Too many benchmark cases; skipping %s", name);
+        return;
+    }
+
+    /* calibrate (also warms up caches & branch predictors) */
+    while (1) {
+        t0 = now_ns();
+        for (size_t p = 0; p < passes; p++)
+            for (size_t i = 0; i < BENCH_PKTS; i++)
+                acc += fn(set, i);
+        t1 = now_ns();
+
+        if (t1 - t0 >= min_ms * 1e6 / 8)
+            break;
+        passes *= 2;
+    }
+    passes = passes * 8 * (min_ms * 1e6 / 8) / (t1 - t0 + 1) + 1;
+    n      = passes * BENCH_PKTS;
+
+    res = &results[n_results++];
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    res->ns = -1;
+
+    for (size_t r = 0; r < BENCH_REPS; r++) {
+        perf_start(&pg);
+        t0 = now_ns();
+        for (size_t p = 0; p < passes; p++)
+            for (size_t i = 0; i < BENCH_PKTS; i++)
+                acc += fn(set, i);
+        t1 = now_ns();
+        perf_stop(&pg, val);
+
+        ns = (double) (t1 - t0) / n;
+        if (res->ns >= 0 && ns >= res->ns)
+            continue;
+
+        res->ns     = ns;
+        res->cycles = (double) val[PERF_CYCLES] / n;
+        res->insns  = (double) val[PERF_INSNS]  / n;
+        res->cmiss  = (double) val[PERF_CMISS]  / n;
+    }
+
+    sink = acc;
+    if (pg.ok)
+        fprintf(stderr, "%-40s %10.1f ns %10.1f cyc %10.1f ins %8.3f "
+            "llc-miss\n", res->name, res->ns, res->cycles, res->insns,
+            res->cmiss);
+    else
+        fprintf(stderr, "%-40s %10.1f ns\n", res->name, res->ns);
+}
+
+/* benchmarked routines */
+static size_t b_csum(struct pkt_set *set, size_t i)
+{
+    return csum_16b1c(0, (uint16_t *) set->pkt[i], set->arg);
+}
+
+static size_t b_csum_impl(struct pkt_set *set, size_t i)
+{
+    return csum_fold(set->impl->add(0, set->pkt[i], set->arg));
+}
+
+static size_t b_layer4_csum(struct pkt_set *set, size_t i)
+{
+    struct iphdr *iph = (struct iphdr *) set->pkt[i];
+
+    return layer4_csum[iph->protocol](iph);
+}
+
+static size_t b_gettimeofday(struct pkt_set *set, size_t i)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_usec;
+}
+
+static size_t b_clk_burst(struct pkt_set *set, size_t i)
+{
+    struct timespec now;
+
+    clk_burst(&now);
+    return now.tv_nsec;
+}
+
+static size_t b_decoder(struct pkt_set *set, size_t i)
+{
+    static uint8_t ops[40];
+    uint8_t        op = set->arg & 0xff;
+    uint8_t        *it = &op;
+    struct iphdr   *iph = (struct iphdr *) set->pkt[i];
+
+    switch (set->arg >> 8) {
+        case IPPROTO_ICMP:
+            return ip_decoders[op & 0x7f](ops, sizeof(ops), &it, iph, ops,
+                    &ctx);
+        case IPPROTO_TCP:
+            return tcp_decoders[op](ops, sizeof(ops), &it, iph, ops, &ctx);
+        default:
+            return udp_decoders[op](ops, sizeof(ops), &it, iph, ops, &ctx);
+    }
+}
+
+static size_t b_csum_copy(struct pkt_set *set, size_t i)
+{
+    return csum_fold(set->impl->copy(0, mod_buf, set->pkt[i], set->arg));
+}
+
+static size_t b_reasmbl(struct pkt_set *set, size_t i)
+{
+    return args.reasmbl((struct iphdr *) set->pkt[i], mod_buf, set->ops,
+            set->ops_len, args.overwrite, NULL);
+}
+
+static size_t b_reasmbl_csum(struct pkt_set *set, size_t i)
+{
+    struct iphdr     *iph = (struct iphdr *) mod_buf;
+    struct csum_part part;
+    int              ans;
+
+    ans = args.reasmbl((struct iphdr *) set->pkt[i], mod_buf, set->ops,
+            set->ops_len, args.overwrite, &part);
+    if (ans)
+        return ans;
+
+    return layer4_csum_part[iph->protocol](iph, &part) + ipv4_csum(iph);
+}
+
+static size_t b_reasmbl_sg(struct pkt_set *set, size_t i)
+{
+    struct pkt_sg sg;
+
+    return args.reasmbl_sg((struct iphdr *) set->pkt[i], 0, 0, head, set->ops,
+            set->ops_len, args.overwrite, &sg) + sg.head_len;
+}
+
+static size_t b_annotate(struct pkt_set *set, size_t i)
+{
+    struct pkt_sg sg;
+
+    return args.annotate((struct iphdr *) set->pkt[i], 0, 0, 0, &ctx, head,
+            &sg);
+}
+
+/* the whole set is annotated at i=0; the cost is spread over the set */
+static size_t b_annotate_burst(struct pkt_set *set, size_t i)
+{
+    if (i)
+        return 0;
+
+    for (size_t j = 0; j < BENCH_PKTS; j++) {
+        burst.iph[j] = (struct iphdr *) set->pkt[j];
+        burst.ctx[j] = ctx;
+    }
+
+    return args.annotate_burst(&burst, BENCH_PKTS, changed);
+}
+
+/* csum_verify - checks every usable checksum kernel against the original one
+ *
+ *  @return : number of mismatches
+ *
+ * Covers all lengths up to 2K at every alignment within a cache line, w/
+ * random contents, all-zero and all-ones buffers and random initial sums.
+ * The copying kernels are also checked on lengths that use streaming stores.
+ */
+static int csum_verify(void)
+{
+    static uint8_t buf[PKT_BUF_SZ + 64];
+    static size_t  big[] = { CSUM_NT_MIN - 1, CSUM_NT_MIN, CSUM_NT_MIN + 1,
+                             CSUM_NT_MIN + 126, 0xffff };
+    uint64_t       sum;
+    uint16_t       ref, val;
+    size_t         len;
+    int            bad = 0;
+
+    srand(42);
+
+    for (size_t fill = 0; fill < 3; fill++) {
+        for (size_t i = 0; i < sizeof(buf); i++)
+            buf[i] = fill == 0 ? rand() : fill == 1 ? 0x00 : 0xff;
+
+        for (size_t off = 0; off < 64; off++) {
+            for (size_t l = 0; l <= 2048 + sizeof(big) / sizeof(*big); l++) {
+                len = l <= 2048 ? l : big[l - 2049];
+                sum = fill == 1 ? 0 : (uint64_t) rand() << 16 | rand();
+                ref = csum_fold(csum_impls[0].add(sum, buf + off, len));
+
+                for (struct csum_impl *it = csum_impls + 1; it->name; it++) {
+                    if (!it->usable)
+                        continue;
+
+                    val = csum_fold(it->add(sum, buf + off, len));
+                    if (val != ref && bad++ < 10)
+                        WAR("csum %s: len=%zu off=%zu: %04hx != %04hx",
+                            it->name, len, off, val, ref);
+                }
+
+                /* copies go to a destination misaligned by (off * 3) */
+                for (struct csum_impl *it = csum_impls; it->name; it++) {
+                    if (!it->usable)
+                        continue;
+
+                    val = csum_fold(it->copy(sum, mod_buf + (off * 3) % 64,
+                                             buf + off, len));
+                    if ((val != ref || memcmp(mod_buf + (off * 3) % 64,
+                            buf + off, len)) && bad++ < 10)
+                        WAR("csum copy %s: len=%zu off=%zu: %04hx != %04hx",
+                            it->name, len, off, val, ref);
+                }
+            }
+        }
+    }
+
+    return bad;
+}
+
+/* pmtu_verify - checks that a path mtu the packets fit in changes nothing
+ *  @data : packet set
+ *
+ *  @return : number of mismatches (cast to a pointer)
+ *
+ * Every packet is annotated w/o a path mtu & w/ one that it fits in, for
+ * each protocol, mix & mode; the udp ops include a checksum correction (it
+ * covers the whole options area). Meant to run in a thread of its own, so
+ * that its decoder plans (per thread) don't replace the benchmarked ones.
+ */
+static void *pmtu_verify(void *data)
+{
+    static const uint8_t protos[]  = { IPPROTO_ICMP, IPPROTO_TCP,
+                                       IPPROTO_UDP };
+    static uint8_t       udp_cco[] = { 0x01, 0xfe, 0x4c };
+    static uint8_t       out[2][2 * PKT_BUF_SZ];
+    struct pkt_set       *set = (struct pkt_set *) data;
+    struct ops_ctx       vctx = ctx;
+    struct iphdr         *iph;
+    struct pkt_sg        sg;
+    size_t               len[2];
+    intptr_t             bad = 0;
+
+    args.pmtu = PMTU_SKIP;
+
+    for (size_t p = 0; p < 3; p++) {
+        for (size_t m = 0; m < sizeof(mixes) / sizeof(*mixes); m++) {
+            for (uint8_t existing = 0; existing < 2; existing++) {
+                for (uint8_t ow = 0; ow < 2; ow++) {
+                    set_proto(protos[p], ow);
+                    if (protos[p] == IPPROTO_UDP) {
+                        args.ops[LAYER_UDP]     = udp_cco;
+                        args.ops_len[LAYER_UDP] = sizeof(udp_cco);
+                    }
+                    build_set(set, protos[p], &mixes[m], existing);
+
+                    for (size_t i = 0; i < BENCH_PKTS; i++) {
+                        iph = (struct iphdr *) set->pkt[i];
+
+                        for (size_t k = 0; k < 2; k++) {
+                            vctx.mtu = k ? 9000 : 0;
+                            len[k]   = 0;
+                            if (args.annotate(iph, 0, 0, 0, &vctx, head, &sg))
+                                continue;
+
+                            memcpy(out[k], sg.head, sg.head_len);
+                            memcpy(out[k] + sg.head_len, sg.body,
+                                sg.body_len);
+                            memcpy(out[k] + sg.head_len + sg.body_len,
+                                sg.tail, sg.tail_len);
+                            len[k] = sg.head_len + sg.body_len + sg.tail_len;
+                        }
+
+                        if ((len[0] != len[1] || !len[0]
+                             || memcmp(out[0], out[1], len[0])) && bad++ < 10)
+                            WAR("pmtu %hhu/%s/%hhu/%hhu: packet %zu differs",
+                                protos[p], mixes[m].name, existing, ow, i);
+                    }
+                }
+            }
+        }
+    }
+
+    args.pmtu = PMTU_OFF;
+    return (void *) bad;
+}
+
+/* bench_decoders - measures every implemented entry of a decoder table
+ *  @set   : packet set
+ *  @proto : IPPROTO_ICMP (for ip ops), IPPROTO_TCP or IPPROTO_UDP
+ *  @tab   : decoder table
+ *  @n     : table size
+ *
+ * Unimplemented entries all point to the same dummy decoder, i.e.: the most
+ * common one in the table; those are skipped.
+ */
+static void bench_decoders(struct pkt_set *set, uint8_t proto,
+    size_t (**tab)(uint8_t *, size_t, uint8_t **, struct iphdr *, uint8_t *,
+    struct ops_ctx *), size_t n)
+{
+    char   name[BENCH_NAME];
+    size_t dummy = 0, cnt, best = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        cnt = 0;
+        for (size_t j = 0; j < n; j++)
+            cnt += tab[j] == tab[i];
+        if (cnt > best) {
+            best  = cnt;
+            dummy = i;
+        }
+    }
+
+    build_set(set, proto, &mixes[0], 0);
+
+    for (size_t i = 0; i < n; i++) {
+        if (tab[i] == tab[dummy])
+            continue;
+
+        set->arg = (proto << 8) | i;
+        snprintf(name, sizeof(name), "%s_decoders[0x%02zx]",
+            proto == IPPROTO_ICMP ? "ip" : proto == IPPROTO_TCP ? "tcp"
+            : "udp", i);
+        run(name, b_decoder, set);
+    }
+}
+
+/* write_json - writes the results (one case per line)
+ *  @path : output file
+ *
+ *  @return : 0 if everything went ok
+ */
+static int write_json(const char *path)
+{
+    FILE *f;
+
+    f = fopen(path, "w");
+    RET(!f, 1, "Unable to open %s (%s)", path, strerror(errno));
+
+    fprintf(f, "{\n  \"counters\": %s,\n  \"results\": [\n",
+        pg.ok ? "true" : "false");
+
+    for (size_t i = 0; i < n_results; i++) {
+        fprintf(f, "    { \"name\": \"%s\", \"ns\": %.2f", results[i].name,
+            results[i].ns);
+        if (pg.ok)
+            fprintf(f, ", \"cycles\": %.2f, \"instructions\": %.2f, "
+                "\"cache_misses\": %.4f", results[i].cycles,
+                results[i].insns, results[i].cmiss);
+        else
+            fprintf(f, ", \"cycles\": null, \"instructions\": null, "
+                "\"cache_misses\": null");
+        fprintf(f, " }%s\n", i + 1 < n_results ? "," : "");
+    }
+
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+
+    return 0;
+}
+
+/* compare - checks the results against a baseline written by write_json()
+ *  @path : baseline file
+ *
+ *  @return : number of regressions (or -1 on error)
+ *
+ * Only ns/packet is compared; counters vary between machines & kernels.
+ * Cases missing from either side are ignored.
+ */
+static int compare(const char *path)
+{
+    char   line[256];
+    char   name[BENCH_NAME];
+    double base, delta;
+    int    regressions = 0;
+    FILE   *f;
+
+    f = fopen(path, "r");
+    RET(!f, -1, "Unable to open %s (%s)", path, strerror(errno));
+
+    fprintf(stderr, "\n%-40s %10s %10s %8s\n", "case", "base ns", "ns",
+        "delta");
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, " { \"name\": \"%79[^\"]\", \"ns\": %lf", name,
+                &base) != 2)
+            continue;
+
+        for (size_t i = 0; i < n_results; i++) {
+            if (strcmp(results[i].name, name))
+                continue;
+
+            delta = (results[i].ns - base) * 100 / base;
+            fprintf(stderr, "%-40s %10.1f %10.1f %+7.1f%%%s\n", name, base,
+                results[i].ns, delta, delta > threshold ? "  REGRESSION" : "");
+            regressions += delta > threshold;
+        }
+    }
+
+    fclose(f);
+    return regressions;
+}
+
+/******************************************************************************
+ **************************** PROGRAM ENTRY POINT *****************************
+ ******************************************************************************/
+
+int32_t main(int argc, char **argv)
+{
+    static const uint8_t protos[]   = { IPPROTO_ICMP, IPPROTO_TCP,
+                                        IPPROTO_UDP };
+    static const char    *pnames[]  = { "ip", "tcp", "udp" };
+    static struct argp   bench_argp = { options, parse_opt, NULL,
+        "ops-bench -- microbenchmarks for decoders, reassemblers & checksums" };
+    struct pkt_set       set;
+    char                 name[BENCH_NAME];
+    size_t               sizes[] = { 20, 64, 576, 1500, 0xffff };
+    void                 *ops;
+    void                 *bad;
+    pthread_t            tid;
+    int                  ans;
+
+    argp_parse(&bench_argp, argc, argv, 0, 0, NULL);
+
+#ifndef __OPTIMIZE__
+    WAR("Built w/o optimizations; results won't match a release build");
+#endif
+
+    for (size_t i = 0; i < BENCH_PKTS; i++) {
+        set.pkt[i] = (uint8_t *) malloc(PKT_BUF_SZ);
+        DIE(!set.pkt[i], "Unable to allocate packet buffer");
+    }
+
+    perf_open(&pg);
+
+    /* checksum primitives (every kernel must be bit-exact) */
+    ans = csum_verify();
+    DIE(ans, "%d checksum kernel mismatches", ans);
+    INFO("Checksum kernels verified; using %s", csum_impl->name);
+
+    /* a path mtu that the packets fit in must not change them */
+    ans = pthread_create(&tid, NULL, pmtu_verify, &set);
+    DIE(ans, "Unable to start path mtu check (%s)", strerror(ans));
+    pthread_join(tid, &bad);
+    DIE(bad, "%ld path mtu mismatches", (long) (intptr_t) bad);
+    INFO("Path mtu checks verified");
+
+    build_set(&set, IPPROTO_ICMP, &mixes[2], 0);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+        set.arg = sizes[i];
+        snprintf(name, sizeof(name), "csum_16b1c/%zu", sizes[i]);
+        run(name, b_csum, &set);
+
+        for (set.impl = csum_impls; set.impl->name; set.impl++) {
+            if (!set.impl->usable)
+                continue;
+
+            snprintf(name, sizeof(name), "csum/%s/%zu", set.impl->name,
+                sizes[i]);
+            run(name, b_csum_impl, &set);
+
+            snprintf(name, sizeof(name), "csum_copy/%s/%zu", set.impl->name,
+                sizes[i]);
+            run(name, b_csum_copy, &set);
+        }
+    }
+
+    for (size_t p = 1; p < 3; p++) {
+        for (size_t m = 0; m < sizeof(mixes) / sizeof(*mixes); m++) {
+            build_set(&set, protos[p], &mixes[m], 0);
+            snprintf(name, sizeof(name), "%s_csum/%s", pnames[p],
+                mixes[m].name);
+            run(name, b_layer4_csum, &set);
+        }
+    }
+
+    /* timestamp sources (per call; the burst clocks are paid per burst) */
+    run("gettimeofday", b_gettimeofday, &set);
+    clk_init(CLK_TSC);
+    run("clk_burst/tsc", b_clk_burst, &set);
+    clk_init(CLK_COARSE);
+    run("clk_burst/coarse", b_clk_burst, &set);
+    clk_burst(&ctx.now);
+
+    /* individual option decoders */
+    bench_decoders(&set, IPPROTO_ICMP, ip_decoders, 0x7f);
+    bench_decoders(&set, IPPROTO_TCP,  tcp_decoders, 0xff);
+    bench_decoders(&set, IPPROTO_UDP,  udp_decoders, 0xff);
+
+    /* reassemblers (w/ the options that the decoder would generate) */
+    for (size_t p = 0; p < 3; p++) {
+        set_proto(protos[p], 0);
+
+        for (size_t m = 0; m < sizeof(mixes) / sizeof(*mixes); m++) {
+            build_set(&set, protos[p], &mixes[m], 0);
+            set.ops_len = args.decoder((struct iphdr *) set.pkt[0], &ops, 0,
+                              &ctx);
+            set.ops     = (uint8_t *) ops;
+            CONT(!set.ops_len, "Unable to decode %s ops", pnames[p]);
+
+            snprintf(name, sizeof(name), "reassemble_%s/%s", pnames[p],
+                mixes[m].name);
+            run(name, b_reasmbl, &set);
+
+            snprintf(name, sizeof(name), "reassemble_%s/%s/csum", pnames[p],
+                mixes[m].name);
+            run(name, b_reasmbl_csum, &set);
+
+            snprintf(name, sizeof(name), "reassemble_%s_sg/%s", pnames[p],
+                mixes[m].name);
+            run(name, b_reasmbl_sg, &set);
+        }
+    }
+
+    /* full chain: decode, reassemble & checksum */
+    for (size_t p = 0; p < 3; p++) {
+        for (size_t m = 0; m < sizeof(mixes) / sizeof(*mixes); m++) {
+            for (uint8_t existing = 0; existing < 2; existing++) {
+                for (uint8_t ow = 0; ow < 2; ow++) {
+                    set_proto(protos[p], ow);
+                    build_set(&set, protos[p], &mixes[m], existing);
+
+                    snprintf(name, sizeof(name), "annotate/%s/%s/%s%s",
+                        pnames[p], mixes[m].name, existing ? "ops" : "no-ops",
+                        ow ? "/w" : "");
+                    run(name, b_annotate, &set);
+
+                    snprintf(name, sizeof(name), "annotate_burst/%s/%s/%s%s",
+                        pnames[p], mixes[m].name, existing ? "ops" : "no-ops",
+                        ow ? "/w" : "");
+                    run(name, b_annotate_burst, &set);
+                }
+            }
+        }
+    }
+
+    perf_close(&pg);
+
+    if (json_path) {
+        ans = write_json(json_path);
+        DIE(ans, "Unable to write results");
+    }
+
+    if (base_path) {
+        ans = compare(base_path);
+        DIE(ans < 0, "Unable to compare against baseline");
+
+        if (ans) {
+            WAR("%d regression(s) over %.1f%%", ans, threshold);
+            return 1;
+        }
+    }
+
+    return 0;
+}
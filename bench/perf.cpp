@@ -0,0 +1,135 @@
+/*
+ * Copyright © 2021, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of ops-inject.
+ *
+ * ops-inject is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ops-inject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>                 /* [u]int*_t       */
+#include <string.h>                 /* memset          */
+#include <unistd.h>                 /* syscall, close  */
+#include <sys/ioctl.h>              /* ioctl           */
+#include <sys/syscall.h>            /* SYS_*           */
+#include <linux/perf_event.h>       /* perf_event_attr */
+
+#include "perf.h"
+#include "util.h"
+
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* perf_open_one - opens one hardware counter for the calling thread
+ *  @config : PERF_COUNT_HW_*
+ *  @leader : group leader fd or -1 to create a new group
+ *
+ *  @return : counter fd or -1 on error
+ */
+static int32_t perf_open_one(uint64_t config, int32_t leader)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = config;
+    attr.disabled       = leader == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_GROUP;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+/******************************************************************************
+ ****************************** PUBLIC FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* perf_open - opens the counter group
+ *  @pg : counter group
+ *
+ *  @return : 0 if the counters are available
+ *
+ * Fails in VMs w/o a virtual PMU or if kernel.perf_event_paranoid > 2; the
+ * benchmarks still run but only report time.
+ */
+int perf_open(struct perf_group *pg)
+{
+    static const uint64_t config[PERF_CNT] = {
+        [PERF_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+        [PERF_INSNS]  = PERF_COUNT_HW_INSTRUCTIONS,
+        [PERF_CMISS]  = PERF_COUNT_HW_CACHE_MISSES,
+    };
+
+    memset(pg, 0, sizeof(*pg));
+
+    for (size_t i = 0; i < PERF_CNT; i++) {
+        pg->fd[i] = perf_open_one(config[i], i ? pg->fd[0] : -1);
+        if (pg->fd[i] == -1) {
+            WAR("Hardware counters unavailable (%s)", strerror(errno));
+            for (size_t j = 0; j < i; j++)
+                close(pg->fd[j]);
+            return 1;
+        }
+    }
+
+    pg->ok = 1;
+    return 0;
+}
+
+/* perf_start - resets & enables all counters in the group
+ *  @pg : counter group
+ */
+void perf_start(struct perf_group *pg)
+{
+    if (!pg->ok)
+        return;
+
+    ioctl(pg->fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(pg->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/* perf_stop - disables & reads all counters in the group
+ *  @pg  : counter group
+ *  @val : PERF_CNT counter values (zeroed if unavailable)
+ */
+void perf_stop(struct perf_group *pg, uint64_t *val)
+{
+    uint64_t buf[1 + PERF_CNT];     /* nr, values... */
+
+    memset(val, 0, PERF_CNT * sizeof(*val));
+    if (!pg->ok)
+        return;
+
+    ioctl(pg->fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (read(pg->fd[0], buf, sizeof(buf)) != sizeof(buf))
+        return;
+
+    for (size_t i = 0; i < PERF_CNT; i++)
+        val[i] = buf[1 + i];
+}
+
+/* perf_close - closes the counter group
+ *  @pg : counter group
+ */
+void perf_close(struct perf_group *pg)
+{
+    if (!pg->ok)
+        return;
+
+    for (size_t i = 0; i < PERF_CNT; i++)
+        close(pg->fd[i]);
+    pg->ok = 0;
+}
@@ -0,0 +1,24 @@
+#include <stdint.h>         /* [u]int*_t */
+
+#ifndef _PERF_H
+#define _PERF_H
+
+/* hardware counters read as one group */
+enum {
+    PERF_CYCLES,            /* cpu cycles (user space)     */
+    PERF_INSNS,             /* retired instructions        */
+    PERF_CMISS,             /* last level cache misses     */
+    PERF_CNT
+};
+
+struct perf_group {
+    int32_t fd[PERF_CNT];   /* counter fds (fd[0] is leader) */
+    uint8_t ok;             /* !0 if counters are available  */
+};
+
+int  perf_open(struct perf_group *pg);
+void perf_start(struct perf_group *pg);
+void perf_stop(struct perf_group *pg, uint64_t *val);
+void perf_close(struct perf_group *pg);
+
+#endif
@@ -0,0 +1,68 @@
+#include <stdio.h>          /* size_t    */
+#include <stdint.h>         /* [u]int*_t */
+#include <netinet/ip.h>     /* iphdr     */
+
+#include "reassemblers.h"
+#include "flow.h"
+#include "budget.h"
+#include "pmtu.h"
+extern "C" {
+#include "clock.h"          /* ops_ctx (C linkage) */
+}
+
+#ifndef _ANNOTATE_H
+#define _ANNOTATE_H
+
+#define BURST_MAX       64          /* max packets per annotate_burst()   */
+#define BURST_TAIL_SZ   0x10000     /* udp option trailers (whole burst)  */
+#define BURST_PREFETCH  8           /* packets parsed ahead of the cursor */
+
+/* packets annotated together                                              *
+ * NOTE: the caller fills in the input; the parsed headers are kept in one *
+ *       array per field so that the fit checks can run over all of them   */
+struct burst {
+    /* input */
+    struct iphdr      *iph[BURST_MAX];          /* packets (NULL to skip)  */
+    size_t            tailroom[BURST_MAX];      /* writable bytes after it */
+    uint32_t          skbinfo[BURST_MAX];       /* nfq skb flags           */
+    struct ops_ctx    ctx[BURST_MAX];           /* decoder contexts        */
+    size_t            room;                     /* writable bytes before   */
+    struct flow_table *ft;                      /* flows (or NULL)         */
+    struct budget     *bg;                      /* budget (or NULL)        */
+    struct pmtu       *pm;                      /* path mtus (or NULL)     */
+
+    /* parsed headers */
+    uint8_t           ver_ihl[BURST_MAX];       /* ip version & ihl        */
+    uint8_t           proto[BURST_MAX];         /* ip protocol             */
+    uint16_t          tot_len[BURST_MAX];       /* ip total length         */
+    uint16_t          l4_len[BURST_MAX];        /* tcp hdr / udp length    */
+    uint8_t           fit[BURST_MAX];           /* !0 if worth decoding    */
+    struct flow_key   key[BURST_MAX];           /* flow keys (if ft)       */
+    uint64_t          hash[BURST_MAX];          /* flow key hashes         */
+    uint8_t           fdir[BURST_MAX];          /* flow directions         */
+
+    /* output */
+    struct pkt_sg     sg[BURST_MAX];            /* modified packets        */
+    uint8_t           spent[BURST_MAX];         /* !0 if its flow is spent */
+    uint8_t           head[BURST_MAX][SG_HEAD_MAX]; /* rewritten headers  */
+    uint8_t           tail[BURST_TAIL_SZ];      /* copied udp trailers     */
+};
+
+/* annotation routine for one (protocol, overwrite, checksum) mode */
+typedef int (*annotate_t)(struct iphdr *iph, size_t room, size_t tailroom,
+    uint32_t skbinfo, struct ops_ctx *ctx, uint8_t *head, struct pkt_sg *sg);
+
+/* the same, for a whole burst */
+typedef uint32_t (*annotate_burst_t)(struct burst *b, uint32_t n,
+    uint8_t *changed);
+
+/* annotation routines of one mode */
+struct annotate_mode {
+    annotate_t       one;           /* one packet at a time */
+    annotate_burst_t burst;         /* whole bursts         */
+};
+
+const struct annotate_mode *annotate_select(uint8_t layers, uint8_t ow,
+                                            uint8_t full_csum);
+
+#endif
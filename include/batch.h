@@ -0,0 +1,81 @@
+#include <stdio.h>          /* size_t      */
+#include <stdint.h>         /* [u]int*_t   */
+#include <sys/socket.h>     /* mmsghdr     */
+#include <sys/uio.h>        /* iovec       */
+#include <linux/netlink.h>  /* sockaddr_nl */
+
+#include "reassemblers.h"
+#include "pool.h"
+
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#define BATCH_MAX   64                  /* max netlink msgs per burst      */
+#define RX_HEADROOM 64                  /* free bytes before each message  */
+#define RX_SLOT_SZ  (0xffff + 0x1000)   /* max ip packet + nfq metadata    */
+#define RX_MTU_SZ   0x840               /* slot: 1500B packet + metadata   */
+#define RX_JUMBO_SZ 0x11040             /* slot: headroom + RX_SLOT_SZ     */
+#define TX_ARENA_SZ 0x40000             /* verdict batch (bytes)           */
+#define TX_IOV_MAX  1024                /* UIO_MAXIOV                      */
+
+static_assert(RX_JUMBO_SZ >= RX_HEADROOM + RX_SLOT_SZ, "jumbo slot too small");
+static_assert(RX_JUMBO_SZ % POOL_ALIGN == 0 && RX_MTU_SZ % POOL_ALIGN == 0,
+              "unaligned slot size");
+
+/* receive side: one recvmmsg() drains up to BATCH_MAX netlink messages   *
+ * NOTE: each message is received RX_HEADROOM bytes into its slot; along  *
+ *       w/ the (already parsed) nfq metadata, this leaves room for ip &  *
+ *       tcp headers to grow in place (see reassemble_ip_sg())            *
+ * NOTE: messages land in an mtu slot and spill over into a jumbo slot;   *
+ *       the (rare) spilled ones are then moved to the jumbo slot whole.  *
+ *       The mtu slot size is an odd number of cache lines, so that the   *
+ *       headers of consecutive packets don't compete for the same sets   */
+struct rx_batch {
+    struct mmsghdr msgs[BATCH_MAX];             /* per-message headers    */
+    struct iovec   iov[BATCH_MAX][2];           /* mtu slot, jumbo spill  */
+    uint8_t        *mtu[BATCH_MAX];             /* POOL_MTU slots         */
+    uint8_t        *jumbo[BATCH_MAX];           /* POOL_JUMBO slots       */
+    uint8_t        *slot[BATCH_MAX];            /* slot holding message i */
+    uint8_t        *end[BATCH_MAX];             /* end of that slot       */
+};
+
+/* transmit side: verdict messages are described by an iovec chain and  *
+ * sent to the kernel as a single multi-message netlink datagram; netlink *
+ * headers and short-lived packet fragments are placed in the arena while *
+ * packet bodies are referenced where they are (i.e.: receive buffers)    */
+struct tx_batch {
+    int32_t            fd;                 /* nfq netlink socket              */
+    uint16_t           q_num;              /* queue the verdicts are for      */
+    uint32_t           seq;                /* netlink sequence number         */
+    uint32_t           run_id;             /* last id in run of plain accepts */
+    uint32_t           run_len;            /* number of packets in that run   */
+    uint8_t            ooo;                /* !0 if ids arrive out of order   */
+    size_t             len;                /* bytes used in arena             */
+    size_t             bytes;              /* total datagram length           */
+    size_t             iovcnt;             /* number of datagram fragments    */
+    struct sockaddr_nl snl;                /* datagram destination (kernel)   */
+    struct msghdr      msg;                /* sealed datagram                 */
+    struct iovec       iov[TX_IOV_MAX];    /* datagram fragments              */
+    uint8_t            arena[TX_ARENA_SZ]; /* headers & copied fragments      */
+};
+
+void     rx_slot_iov(struct iovec *iov, uint8_t *mtu, uint8_t *jumbo);
+uint8_t *rx_slot_join(uint8_t *mtu, uint8_t *jumbo, size_t len,
+             uint8_t **end);
+
+int  rx_batch_init(struct rx_batch *rxb, struct pool *pool);
+int  rx_batch_recv(struct rx_batch *rxb, int32_t fd, uint32_t n);
+
+int  tx_batch_init(struct tx_batch *txb, int32_t fd, uint16_t q_num);
+int  tx_batch_accept(struct tx_batch *txb, uint32_t id);
+int  tx_batch_accept_ct(struct tx_batch *txb, uint32_t id, uint32_t mark,
+         uint32_t mask);
+int  tx_batch_verdict(struct tx_batch *txb, uint32_t id, uint32_t verdict,
+         uint8_t *pkt, size_t pkt_len);
+int  tx_batch_verdict_sg(struct tx_batch *txb, uint32_t id, uint32_t verdict,
+         struct pkt_sg *sg);
+int  tx_batch_flush(struct tx_batch *txb);
+int  tx_batch_seal(struct tx_batch *txb, struct msghdr **msg);
+void tx_batch_reset(struct tx_batch *txb);
+
+#endif
@@ -0,0 +1,69 @@
+#include <stdint.h>           /* [u]int*_t */
+#include <time.h>             /* timespec  */
+#include <netinet/ip.h>       /* iphdr     */
+
+#include "flow.h"
+
+#ifndef _BUDGET_H
+#define _BUDGET_H
+
+#define BUDGET_TB_SLOTS 4096        /* token buckets per thread (power of 2) */
+#define BUDGET_SPEC_MAX 256         /* max length of a budget spec           */
+
+/* annotation budget; a packet is annotated only if every policy admits it *
+ * NOTE: 0 disables a policy                                               */
+struct budget_cfg {
+    uint32_t first;                 /* first N packets of each flow         */
+    uint32_t sample;                /* 1 in K packets (of each flow)        */
+    uint32_t rate;                  /* packets / s per destination prefix   */
+    uint32_t burst;                 /* ... w/ bursts of up to this many     */
+    uint8_t  prefix;                /* destination prefix length (bits)     */
+};
+
+/* token bucket of one destination prefix (GCRA: a single deadline) */
+struct budget_tb {
+    uint32_t net;                   /* destination prefix (host order)      */
+    uint8_t  used;                  /* !0 if net is set                     */
+    uint64_t tat;                   /* theoretical arrival time (ns)        */
+};
+
+/* per-thread budget state                                                  *
+ * NOTE: the config is shared & may change at any time (see budget_load()); *
+ *       each thread works on a copy that budget_sync() refreshes. Token    *
+ *       buckets are per thread, so a prefix served by several threads gets *
+ *       the rate from each of them                                         */
+struct budget {
+    struct budget_cfg cfg;          /* config in use                        */
+    uint32_t          seq;          /* its version                          */
+    uint32_t          reports;      /* report requests handled              */
+    uint64_t          interval;     /* ns per token                         */
+    uint64_t          tolerance;    /* ns worth of burst                    */
+    uint32_t          mask;         /* destination prefix mask (host order) */
+    uint32_t          n;            /* packets seen (sampling w/o flows)    */
+    const char        *name;        /* owner (for display)                  */
+    uint32_t          idx;          /* owner index (for display)            */
+
+    uint64_t          admitted;     /* packets within budget                */
+    uint64_t          over_first;   /* past the first N of their flow       */
+    uint64_t          over_sample;  /* not sampled                          */
+    uint64_t          over_rate;    /* over their prefix's rate             */
+    uint64_t          spent;        /* flows past their first N for good    */
+
+    struct budget_tb  tb[BUDGET_TB_SLOTS];
+};
+
+int     budget_parse(const char *spec, struct budget_cfg *cfg);
+void    budget_publish(const struct budget_cfg *cfg);
+int     budget_load(const char *path);
+uint8_t budget_flows(void);
+void    budget_request_report(void);
+
+struct budget *budget_create(const char *name, uint32_t idx);
+void          budget_destroy(struct budget *bg);
+void          budget_sync(struct budget *bg);
+void          budget_report(struct budget *bg);
+uint8_t       budget_admit(struct budget *bg, struct iphdr *iph,
+                  struct flow *f, const struct timespec *now);
+uint8_t       budget_spent(struct budget *bg, struct flow *f);
+
+#endif
@@ -4,20 +4,62 @@
 #ifndef _CLI_ARGS_H
 #define _CLI_ARGS_H
 
+/* headers that take user ops (see -p); args.layers has a bit for each */
+enum {
+    LAYER_IP,               /* ip options                         */
+    LAYER_TCP,              /* tcp options                        */
+    LAYER_UDP,              /* udp options (trailer)              */
+    LAYER_MAX,
+};
+
 /* structure holding arguments information */
 struct arguments
 {
     uint16_t q_num;         /* queue number             */
+    uint16_t q_last;        /* last queue number        */
     uint16_t nq_num;        /* next queue number        */
     uint8_t  redirect;      /* queue redirection        */
     uint8_t  overwrite;     /* !0 to overwrite ops      */
-    uint8_t  *ops;          /* user specified options   */
-    size_t   ops_len;       /* length in bytes of ops   */
+    uint8_t  pin_cpu;       /* !0 to pin workers        */
+    uint8_t  gso;           /* !0 to accept gso packets */
+    uint32_t batch;         /* max packets per burst    */
+    uint32_t rcvbuf;        /* socket rcvbuf (bytes)    */
+    uint32_t maxlen;        /* kernel queue length      */
+    uint8_t  fail_open;     /* !0 to accept on overflow */
+    uint8_t  hwm;           /* shedding threshold (%)   */
+    uint8_t  uring;         /* !0 to use io_uring loop  */
+    uint32_t pipeline;      /* annotator threads (or 0) */
+    char     *offline;      /* input pcap (offline)     */
+    char     *out;          /* output pcap (offline)    */
+    uint8_t  full_csum;     /* !0 to recompute csums    */
+    uint8_t  proto;         /* target protocol (-p one) */
+    uint8_t  layers;        /* target layers (LAYER_*)  */
+    uint8_t  clock;         /* timestamp source (CLK_*) */
+    uint32_t flows;         /* max flows per thread     */
+    uint32_t flow_timeout;  /* flow idle timeout (s)    */
+    uint8_t  budget;        /* !0 to budget annotations */
+    char     *budget_file;  /* budget spec (re-read)    */
+    uint8_t  pmtu;          /* path mtu policy (PMTU_*) */
+    uint16_t mtu;           /* mtu if route has none    */
+    uint32_t ct_mark;       /* connmark of spent flows  */
+    uint32_t ct_mask;       /* its bits (0 if disabled) */
+    uint8_t  *ops[LAYER_MAX];     /* user specified options, per layer */
+    size_t   ops_len[LAYER_MAX];  /* length in bytes of ops            */
     
     /* protocol specific options decoder & packet reassembler */
-    size_t (*decoder)(struct iphdr *iph, void **ops_buffer, uint8_t ow);
+    size_t (*decoder)(struct iphdr *iph, void **ops_buffer, uint8_t ow,
+        struct ops_ctx *ctx);
     int (*reasmbl)(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
-        size_t ops_len, uint8_t ow);
+        size_t ops_len, uint8_t ow, struct csum_part *part);
+    int (*reasmbl_sg)(struct iphdr *iph, size_t room, size_t tailroom,
+        uint8_t *head, uint8_t *ops, size_t ops_len, uint8_t ow,
+        struct pkt_sg *sg);
+
+    /* all of the above (& checksums), specialized for the selected mode */
+    int (*annotate)(struct iphdr *iph, size_t room, size_t tailroom,
+        uint32_t skbinfo, struct ops_ctx *ctx, uint8_t *head,
+        struct pkt_sg *sg);
+    uint32_t (*annotate_burst)(struct burst *b, uint32_t n, uint8_t *changed);
 };
 
 extern struct argp      argp;
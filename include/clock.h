@@ -0,0 +1,32 @@
+#include <stdint.h>         /* [u]int*_t */
+#include <time.h>           /* timespec  */
+
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+/* time sources for time dependent options                               *
+ * NOTE: burst clocks are sampled once per receive burst, so all packets *
+ *       in a burst share a timestamp                                    */
+enum {
+    CLK_COARSE,             /* CLOCK_REALTIME_COARSE per burst (~1-10ms)  */
+    CLK_TSC,                /* calibrated TSC per burst (~ns, no syscall) */
+    CLK_PACKET,             /* kernel's NFQA_TIMESTAMP, else CLK_COARSE   */
+};
+
+struct flow;                /* see flow.h */
+
+/* per-packet context handed to the option decoders                   *
+ * NOTE: decoders read the time from here instead of making syscalls *
+ * NOTE: flow is NULL unless flows are tracked (see --flows)         *
+ * NOTE: mtu is 0 unless path mtus are checked (see --pmtu)          */
+struct ops_ctx {
+    struct timespec now;    /* time of processing (wall clock)  */
+    struct flow     *flow;  /* packet's flow (or NULL)          */
+    uint8_t         dir;    /* packet's direction in its flow   */
+    uint16_t        mtu;    /* path mtu of its destination      */
+};
+
+int  clk_init(uint8_t src);
+void clk_burst(struct timespec *now);
+
+#endif
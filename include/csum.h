@@ -1,14 +1,75 @@
 #include <stdint.h>         /* [u]int*_t */
+#include <sys/uio.h>        /* iovec     */
 #include <netinet/ip.h>     /* iphdr     */
 
 #ifndef _CSUM_H
 #define _CSUM_H
 
+/* copies at least this large bypass the cache (see csum_partial_copy()) */
+#define CSUM_NT_MIN 16384
+
+/* checksum kernel (see csum.c) */
+struct csum_impl {
+    const char *name;
+    uint64_t   (*add)(uint64_t sum, const uint8_t *buf, size_t nbytes);
+    uint64_t   (*copy)(uint64_t sum, uint8_t *dst, const uint8_t *src,
+                       size_t nbytes);
+    uint8_t    usable;          /* supported by this cpu */
+};
+
+extern struct csum_impl csum_impls[];
+extern struct csum_impl *csum_impl;
+
+/* words replaced by a reassembler, for incremental (RFC 1624) updates    *
+ * NOTE: *_old and *_new are unfolded partial sums; any word that is     *
+ *       present in both (e.g.: the old checksum field) simply cancels out */
+struct csum_delta {
+    uint64_t l3_old;            /* ip header, before reassembly       */
+    uint64_t l3_new;            /* ip header, after reassembly        */
+    uint64_t l4_old;            /* l4 & pseudo header, before         */
+    uint64_t l4_new;            /* l4 & pseudo header, after          */
+};
+
+/* layer 4 region that was summed while a reassembler copied it            *
+ * NOTE: off is relative to the layer 4 header and even; the region may   *
+ *       only end before the checksummed data does if its length is even  */
+struct csum_part {
+    size_t   off;               /* start of the region                */
+    size_t   len;               /* length of the region               */
+    uint64_t sum;               /* unfolded partial sum of the region */
+};
+
+uint64_t csum_partial(uint64_t sum, uint16_t *buffer, size_t nbytes);
+uint64_t csum_partial_copy(uint64_t sum, uint8_t *dst, const uint8_t *src,
+                           size_t nbytes);
+uint16_t csum_fold(uint64_t sum);
 uint16_t csum_16b1c(uint64_t sum, uint16_t *buffer, size_t nbytes);
+uint16_t csum_update(uint16_t check, uint64_t old_sum, uint64_t new_sum);
 int ipv4_csum(struct iphdr *iph);
+int ipv4_csum_inc(struct iphdr *iph, struct csum_delta *delta);
+
+/* same as the tcp & udp entries of the arrays below; for callers that *
+ * know the protocol at compile time (see annotate.cpp)                */
+int tcp_csum_sg(struct iphdr *iph, struct iovec *iov, size_t cnt);
+int tcp_csum_inc(struct iphdr *iph, struct iovec *iov,
+                 struct csum_delta *delta);
+int udp_csum_sg(struct iphdr *iph, struct iovec *iov, size_t cnt);
 
 /* protocol specific checksum calculatiors array */
 extern int (*layer4_csum[0x100])(struct iphdr *);
 
-#endif
+/* protocol specific scatter-gather checksum calculators array *
+ * NOTE: iov[0] must start w/ the complete layer 4 header      */
+extern int (*layer4_csum_sg[0x100])(struct iphdr *, struct iovec *, size_t);
+
+/* protocol specific incremental checksum updaters array   *
+ * NOTE: the old layer 4 checksum must be valid (i.e.: not *
+ *       NFQA_SKB_CSUMNOTREADY); iov must be as above      */
+extern int (*layer4_csum_inc[0x100])(struct iphdr *, struct iovec *,
+                                     struct csum_delta *);
 
+/* protocol specific checksum calculators array, for contiguous packets *
+ * whose (copied) payload was already summed by the reassembler         */
+extern int (*layer4_csum_part[0x100])(struct iphdr *, struct csum_part *);
+
+#endif
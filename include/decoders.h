@@ -2,12 +2,25 @@
 #include <stdint.h>         /* [u]int*_t */
 #include <netinet/ip.h>     /* iphdr     */
 
+extern "C" {
+#include "clock.h"          /* ops_ctx (C linkage) */
+}
+
 #ifndef _DECODERS_H
 #define _DECODERS_H
 
-size_t decode_ip_ops(struct iphdr *iph, void **ops_buffer, uint8_t ow);
-size_t decode_tcp_ops(struct iphdr *iph, void **ops_buffer, uint8_t ow);
-size_t decode_udp_ops(struct iphdr *iph, void **ops_buffer, uint8_t ow);
+/* per-mode decoder; instantiated for IPPROTO_{IP,TCP,UDP} (see decoders.cpp) */
+template <uint8_t P, bool OW>
+size_t decode_ops(struct iphdr *iph, void **ops_buffer, struct ops_ctx *ctx);
+
+size_t decode_ip_ops(struct iphdr *iph, void **ops_buffer, uint8_t ow,
+                     struct ops_ctx *ctx);
+size_t decode_tcp_ops(struct iphdr *iph, void **ops_buffer, uint8_t ow,
+                      struct ops_ctx *ctx);
+size_t decode_udp_ops(struct iphdr *iph, void **ops_buffer, uint8_t ow,
+                      struct ops_ctx *ctx);
+
+uint8_t decode_flow_ops(uint8_t layers);
 
 #endif
 
@@ -0,0 +1,101 @@
+#include <stdio.h>          /* size_t    */
+#include <stdint.h>         /* [u]int*_t */
+#include <time.h>           /* timespec  */
+#include <netinet/ip.h>     /* iphdr     */
+
+#ifndef _FLOW_H
+#define _FLOW_H
+
+#define FLOW_WAYS       8           /* flows per bucket (one cache line)   */
+#define FLOW_TICK_MS    128         /* timer wheel resolution              */
+#define FLOW_L0_SLOTS   256         /* level 0 wheel: 1 tick per slot      */
+#define FLOW_L1_SLOTS   64          /* level 1 wheel: 256 ticks per slot   */
+#define FLOW_EXPIRE_MAX 256         /* flows reclaimed per wheel advance   */
+#define FLOW_DEF_MAX    (1 << 16)   /* default flows per table             */
+#define FLOW_DEF_TMO    120         /* default idle timeout (seconds)      */
+#define FLOW_AUTO       UINT32_MAX  /* track flows only if an op needs it  */
+
+/* canonical 5-tuple: endpoint 0 is the lower (address, port) pair, so *
+ * that both directions of a flow share one key                       */
+struct flow_key {
+    uint32_t addr[2];               /* ip addresses (network order)  */
+    uint16_t port[2];               /* l4 ports (network order)      */
+    uint8_t  proto;                 /* ip protocol                   */
+};
+
+/* option state of one direction (i.e.: packets sent by one endpoint) */
+struct flow_dir {
+    uint32_t ts_val;                /* last tcp TSval sent           */
+    uint32_t echo;                  /* last tcp echo info sent       */
+    uint8_t  ts_syn;                /* !0 if the SYN had a timestamp */
+    uint8_t  has_ts;                /* !0 if ts_val is set           */
+    uint8_t  has_echo;              /* !0 if echo is set             */
+    uint8_t  seen;                  /* !0 once a packet went by      */
+};
+
+/* tracked flow; one cache line                                          *
+ * NOTE: dir[] is the only part meant for the option decoders; a packet *
+ *       going from endpoint d to endpoint !d is in direction d          */
+struct flow {
+    struct flow_key key;            /* canonical 5-tuple               */
+    struct flow_dir dir[2];         /* per direction option state      */
+    uint32_t        pkts;           /* packets seen                    */
+    uint32_t        expires;        /* tick at which it goes stale     */
+    uint32_t        next;           /* wheel / free list (index + 1)   */
+    uint32_t        prev;           /* wheel list (index + 1)          */
+    uint32_t        pos;            /* bucket * FLOW_WAYS + way        */
+    uint32_t        wheel;          /* wheel slot it is linked in      */
+};
+
+/* hash table bucket; one cache line */
+struct flow_bucket {
+    uint16_t sig[FLOW_WAYS];        /* hash signatures                 */
+    uint32_t idx[FLOW_WAYS];        /* flows (index + 1; 0 if free)    */
+    uint8_t  pad[64 - 6 * FLOW_WAYS];
+};
+
+/* per-thread flow table                                                   *
+ * NOTE: open addressing over cache line buckets; a flow lives in its home *
+ *       bucket or the one after it, so a lookup reads at most two lines.  *
+ *       Expiry is lazy: packets only move a flow's deadline and the wheel *
+ *       re-files flows whose deadline moved once their slot comes up      */
+struct flow_table {
+    struct flow_bucket *buckets;    /* 2 * max / FLOW_WAYS (power of 2) */
+    struct flow        *flows;      /* flow entries                     */
+    uint32_t           mask;        /* bucket index mask                */
+    uint32_t           max;         /* number of flow entries           */
+    uint32_t           timeout;     /* idle timeout (ticks)             */
+    size_t             len;         /* mapping length                   */
+
+    uint32_t           free;        /* free list (index + 1)            */
+    uint32_t           used;        /* flows in table                   */
+    uint32_t           now;         /* current tick                     */
+    uint32_t           cur;         /* next tick the wheel processes    */
+    uint8_t            started;     /* !0 once now & cur are set        */
+    uint32_t           wheel[FLOW_L0_SLOTS + FLOW_L1_SLOTS];
+
+    uint64_t           created;     /* flows inserted                   */
+    uint64_t           expired;     /* flows reclaimed after timeout    */
+    uint64_t           evicted;     /* flows reclaimed early (full)     */
+};
+
+struct flow_table *flow_create(uint32_t max, uint32_t timeout_s);
+void              flow_destroy(struct flow_table *ft);
+void              flow_report(struct flow_table *ft, const char *name,
+                      uint32_t idx);
+
+uint64_t    flow_key(struct iphdr *iph, struct flow_key *key, uint8_t *dir);
+struct flow *flow_find(struct flow_table *ft, struct flow_key *key,
+                 uint64_t hash, const struct timespec *now);
+void        flow_learn(struct flow *f, uint8_t dir, struct iphdr *iph);
+
+/* flow_prefetch - starts loading the bucket(s) of a flow
+ *  @ft   : flow table
+ *  @hash : flow_key() hash
+ */
+static inline void flow_prefetch(struct flow_table *ft, uint64_t hash)
+{
+    __builtin_prefetch(&ft->buckets[hash & ft->mask]);
+}
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef _OFFLINE_H
+#define _OFFLINE_H
+
+#define PCAP_OUT_BUF    (1 << 20)   /* output stream buffer size */
+
+int offline_run(const char *in_path, const char *out_path);
+
+#endif
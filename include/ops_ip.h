@@ -2,16 +2,24 @@
 #include <stdint.h>         /* [u]int*_t */
 #include <netinet/ip.h>     /* iphdr     */
 
+#include "clock.h"
+
 #ifndef _OPS_IP_H
 #define _OPS_IP_H
 
 /* individual option decoder callback array *
  * NOTE: apply 0x7f mask when calling       */
 extern size_t (*ip_decoders[0x7f])(uint8_t *, size_t, uint8_t **,
-    struct iphdr *, uint8_t *);
+    struct iphdr *, uint8_t *, struct ops_ctx *);
 
 /* option processing priority */
 extern uint64_t ip_ops_prio[0x7f];
 
+/* packet dependent options (rendered per packet) */
+extern uint8_t ip_ops_dyn[0x7f];
+
+/* shrink variable length options to the space left (e.g.: record route) */
+extern uint8_t ip_ops_shrink;
+
 #endif
 
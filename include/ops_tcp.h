@@ -3,16 +3,24 @@
 #include <netinet/ip.h>     /* iphdr     */
 #include <netinet/tcp.h>    /* tcphdr    */
 
+#include "clock.h"
+
 #ifndef _OPS_TCP_H
 #define _OPS_TCP_H
 
 /* individual option decoder callback array *
  * NOTE: apply 0x7f mask when calling       */
 extern size_t (*tcp_decoders[0xff])(uint8_t *, size_t, uint8_t **,
-    struct iphdr *, uint8_t *);
+    struct iphdr *, uint8_t *, struct ops_ctx *);
 
 /* option processing priority */
 extern uint64_t tcp_ops_prio[0xff];
 
+/* packet dependent options (rendered per packet) */
+extern uint8_t tcp_ops_dyn[0xff];
+
+/* options that use per-flow state */
+extern uint8_t tcp_ops_flow[0xff];
+
 #endif
 
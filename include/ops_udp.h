@@ -3,16 +3,21 @@
 #include <netinet/ip.h>     /* iphdr     */
 #include <netinet/udp.h>    /* udphdr    */
 
+#include "clock.h"
+
 #ifndef _OPS_UDP_H
 #define _OPS_UDP_H
 
 /* individual options decoder callback array *
  * NOTE: apply 0x7f mask when calling        */
 extern size_t (*udp_decoders[0xff])(uint8_t *, size_t, uint8_t **,
-    struct iphdr *, uint8_t *);
+    struct iphdr *, uint8_t *, struct ops_ctx *);
 
 /* option processing priority */
 extern uint64_t udp_ops_prio[0xff];
 
+/* packet dependent options (rendered per packet) */
+extern uint8_t udp_ops_dyn[0xff];
+
 #endif
 
@@ -0,0 +1,38 @@
+#include <stdio.h>            /* size_t    */
+#include <stdint.h>           /* [u]int*_t */
+#include <time.h>             /* timespec  */
+
+#ifndef _OVERLOAD_H
+#define _OVERLOAD_H
+
+#define OVL_RCVBUF_GROWTH   8       /* max rcvbuf as multiple of initial  */
+#define OVL_MAXLEN_CAP      0x10000 /* max kernel queue length            */
+#define OVL_DRAIN_MS        100     /* queue should drain in this time    */
+#define OVL_ADAPT_MS        1000    /* drain rate measurement interval    */
+#define OVL_BACKLOG_BURSTS  16      /* backlog sampling interval (bursts) */
+
+/* per-worker overload control state */
+struct overload {
+    struct nfq_q_handle *qh;            /* nfq queue                      */
+    int32_t             fd;             /* nfq netlink socket             */
+
+    uint32_t            rcvbuf;         /* requested socket rcvbuf        */
+    uint32_t            maxlen;         /* current kernel queue length    */
+    uint8_t             shedding;       /* !0 while over high-water mark  */
+
+    uint64_t            processed;      /* packets received               */
+    uint64_t            shed;           /* packets accepted w/o decoding  */
+    uint64_t            enobufs;        /* socket overruns (lost msgs)    */
+    uint32_t            bursts;         /* bursts w/o a backlog check     */
+
+    struct timespec     last;           /* start of measurement interval  */
+    uint64_t            last_processed; /* processed at start of interval */
+    uint64_t            rate;           /* measured drain rate (pkts/s)   */
+};
+
+int  ovl_init(struct overload *ovl, struct nfq_q_handle *qh, int32_t fd);
+void ovl_enobufs(struct overload *ovl);
+void ovl_burst(struct overload *ovl, size_t n);
+void ovl_report(struct overload *ovl, uint16_t q_num);
+
+#endif
@@ -0,0 +1,83 @@
+#include <stdint.h>             /* [u]int*_t  */
+#include <pthread.h>            /* pthread_t  */
+#include <netinet/ip.h>         /* iphdr      */
+
+#include "spsc.h"
+#include "worker.h"
+#include "flow.h"
+#include "budget.h"
+#include "pmtu.h"
+
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#define PIPE_SLOTS      SPSC_DEPTH  /* packets in flight per queue       */
+#define PIPE_JUMBO      128         /* jumbo packets in flight per queue */
+#define PIPE_STAGES_MAX 16          /* max annotator threads per queue   */
+#define PIPE_REPORT_MS  10000       /* ring occupancy reporting interval */
+
+/* one packet in flight; indexed by the receive slot holding the packet */
+struct pipe_desc {
+    uint32_t       id;                  /* nfq packet id                  */
+    uint32_t       skbinfo;             /* nfq skb flags                  */
+    struct iphdr   *iph;                /* packet (in slot) or NULL       */
+    uint8_t        *end;                /* end of the packet's buffer     */
+    uint8_t        shed;                /* !0 to pass w/o decoding        */
+    uint8_t        changed;             /* !0 if sg describes the verdict */
+    uint8_t        spent;               /* !0 if its flow is spent        */
+    struct ops_ctx ctx;                 /* decoder context                */
+    struct flow_key key;                /* flow key (if tracked)          */
+    uint64_t       hash;                /* flow key hash                  */
+    uint8_t        tracked;             /* !0 if key & hash are set       */
+    struct pkt_sg  sg;                  /* modified packet                */
+    uint8_t        head[SG_HEAD_MAX];   /* rewritten packet headers       */
+};
+
+/* annotator thread */
+struct pipe_stage {
+    struct pipeline   *pl;              /* owning pipeline          */
+    uint32_t          idx;              /* ring index               */
+    pthread_t         tid;              /* thread id                */
+    struct flow_table *flows;           /* its flows (or NULL)      */
+    struct budget     *budget;          /* its budget (or NULL)     */
+    struct pmtu       *pmtu;            /* its path mtus (or NULL)  */
+};
+
+/* per-queue pipeline: rx (worker thread) -> annotators -> tx thread
+ * NOTE: packets stay in their receive slot; only slot indices travel
+ *       through the rings. Slots are returned to rx once their verdict
+ *       has been sent.
+ * NOTE: w/ flow tracking, each annotator owns the flows that hash to it
+ *       and rx dispatches packets by flow instead of round robin.
+ * NOTE: each slot has an mtu buffer of its own; larger packets also take
+ *       a jumbo buffer from the worker's pool, which rx (the only thread
+ *       touching the pool) takes back when the slot is returned.
+ */
+struct pipeline {
+    struct worker     *wk;                          /* queue & socket      */
+    uint32_t          n_stages;                     /* annotator threads   */
+    uint32_t          n_started;                    /* ... that started    */
+    struct pipe_stage stages[PIPE_STAGES_MAX];
+    pthread_t         tx_tid;                       /* verdict thread      */
+    uint8_t           tx_started;                   /* !0 if running       */
+    volatile bool     stop;                         /* stop stage threads  */
+
+    struct spsc       to_annot[PIPE_STAGES_MAX];    /* rx -> annotator i   */
+    struct spsc       to_tx[PIPE_STAGES_MAX];       /* annotator i -> tx   */
+    struct spsc       to_rx;                        /* tx -> rx (free)     */
+
+    uint32_t          next;                         /* rr annotator        */
+    uint16_t          cur;                          /* slot in dispatch    */
+    uint8_t           dispatched;                   /* cur was dispatched  */
+    uint64_t          rx_starved;                   /* no free slot for rx */
+
+    struct pipe_desc  desc[PIPE_SLOTS];
+    uint8_t           *mtu[PIPE_SLOTS];             /* POOL_MTU buffers    */
+    uint8_t           *jumbo[PIPE_SLOTS];           /* POOL_JUMBO or NULL  */
+};
+
+int32_t pipe_dispatch(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
+            struct nfq_data *nfd, void *data);
+int     pipe_loop(struct worker *wk);
+
+#endif
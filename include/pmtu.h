@@ -0,0 +1,56 @@
+#include <stdint.h>           /* [u]int*_t */
+#include <time.h>             /* timespec  */
+#include <netinet/ip.h>       /* iphdr     */
+
+#ifndef _PMTU_H
+#define _PMTU_H
+
+#define PMTU_SLOTS      4096        /* cached destinations per thread        */
+#define PMTU_TTL        600         /* s until the kernel is asked again     */
+#define PMTU_LOOKUPS    64          /* kernel lookups per second per thread  */
+#define PMTU_DEF        1500        /* mtu assumed when the kernel can't say */
+#define PMTU_MIN        68          /* smallest mtu an ipv4 link may have    */
+
+/* what to do w/ packets that the options would push past the path mtu */
+enum {
+    PMTU_OFF,               /* no mtu checks (default)                   */
+    PMTU_SKIP,              /* pass them unchanged                       */
+    PMTU_SHRINK,            /* shrink variable length options to fit     */
+    PMTU_FRAG,              /* clear DF; the kernel fragments them       */
+};
+
+/* path mtu of one destination */
+struct pmtu_entry {
+    uint32_t daddr;                 /* destination (network order)     */
+    uint16_t mtu;                   /* its path mtu                    */
+    uint8_t  used;                  /* !0 if daddr is set              */
+    uint32_t expires;               /* s (time of processing clock)    */
+};
+
+/* per-thread path mtu cache                                             *
+ * NOTE: entries are direct mapped by destination & seeded by the kernel *
+ *       (route mtu, or its own pmtu if it has one); frag-needed errors  *
+ *       that pass through the same thread lower them right away        */
+struct pmtu {
+    int32_t           fd;           /* lookup socket (-1 if offline)   */
+    uint16_t          def;          /* mtu if the kernel can't say     */
+    uint32_t          sec;          /* current lookup second           */
+    uint32_t          lookups;      /* lookups made in it              */
+
+    uint64_t          hits;         /* answered from the cache         */
+    uint64_t          misses;       /* answered by the kernel          */
+    uint64_t          limited;      /* answered w/ def (rate limited)  */
+    uint64_t          learned;      /* frag-needed errors applied      */
+
+    struct pmtu_entry e[PMTU_SLOTS];
+};
+
+struct pmtu *pmtu_create(uint16_t def, uint8_t kernel);
+void        pmtu_destroy(struct pmtu *pm);
+void        pmtu_report(struct pmtu *pm, const char *name, uint32_t idx);
+uint16_t    pmtu_get(struct pmtu *pm, uint32_t daddr,
+                const struct timespec *now);
+void        pmtu_learn(struct pmtu *pm, struct iphdr *iph,
+                const struct timespec *now);
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdio.h>            /* size_t    */
+#include <stdint.h>           /* [u]int*_t */
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#define POOL_PAGE_SZ    (2UL << 20)     /* huge page size                  */
+#define POOL_ALIGN      64              /* slot alignment (cache line)     */
+
+/* buffer size classes */
+enum {
+    POOL_MTU,           /* packets that fit a (1500B) mtu */
+    POOL_JUMBO,         /* overflow for anything larger   */
+    POOL_CLS
+};
+
+/* fixed size slots of one class; free slots are kept on a LIFO stack so *
+ * that the most recently used (i.e.: cache hot) slot is handed out next  */
+struct pool_class {
+    uint8_t  *base;                 /* first slot          */
+    size_t   sz;                    /* slot size (bytes)   */
+    uint32_t n;                     /* number of slots     */
+    uint32_t top;                   /* free slots on stack */
+    uint8_t  **stack;               /* free slots          */
+};
+
+/* per-worker buffer pool                                                 *
+ * NOTE: backed by huge pages (if any are reserved; transparent huge pages *
+ *       otherwise), placed on the numa node of the thread that creates it *
+ *       and prefaulted; owned by that thread alone, so no locking         */
+struct pool {
+    uint8_t           *base;        /* mapping             */
+    size_t            len;          /* mapping length      */
+    int32_t           node;         /* numa node (or -1)   */
+    uint8_t           huge;         /* !0 if hugetlb pages */
+    struct pool_class cls[POOL_CLS];
+};
+
+void *pool_map(size_t len, int32_t *node, uint8_t *huge);
+void pool_unmap(void *addr, size_t len);
+
+int  pool_init(struct pool *p, size_t mtu_sz, uint32_t n_mtu,
+         size_t jumbo_sz, uint32_t n_jumbo);
+void pool_fini(struct pool *p);
+
+/* pool_get - takes a free slot
+ *  @p   : pool
+ *  @cls : POOL_*
+ *
+ *  @return : slot or NULL if the class ran out
+ */
+static inline uint8_t *pool_get(struct pool *p, uint8_t cls)
+{
+    struct pool_class *c = &p->cls[cls];
+
+    return c->top ? c->stack[--c->top] : NULL;
+}
+
+/* pool_put - gives a slot back
+ *  @p   : pool
+ *  @cls : POOL_* (class the slot was taken from)
+ *  @buf : slot
+ */
+static inline void pool_put(struct pool *p, uint8_t cls, uint8_t *buf)
+{
+    struct pool_class *c = &p->cls[cls];
+
+    c->stack[c->top++] = buf;
+}
+
+#endif
@@ -1,15 +1,70 @@
 #include <stdio.h>      /* size_t    */
 #include <stdint.h>     /* [u]int*_t */
 #include <netinet/ip.h> /* iphdr     */
+#include <sys/uio.h>    /* iovec     */
+
+extern "C" {
+#include "csum.h"           /* csum_delta (C linkage, see worker.cpp) */
+}
 
 #ifndef _REASSEMBLERS_H
 #define _REASSEMBLERS_H
 
+#define SG_HEAD_MAX 120 /* ip & tcp headers w/ maximum options */
+
+/* scatter-gather packet: [head][body][tail]
+ *  head : rewritten headers & new options (caller's scratch buffer or, if
+ *         they were grown in place, right before body)
+ *  body : untouched bytes, still in the original packet buffer
+ *  tail : new options appended after the body (udp only) or NULL; if they
+ *         were appended in place, they are part of the body instead
+ *
+ * delta holds the checksummed words that were replaced, so that the old
+ * checksums can be updated instead of recomputed (see csum_update()).
+ */
+struct pkt_sg {
+    uint8_t           *head;
+    size_t            head_len;
+    uint8_t           *body;
+    size_t            body_len;
+    uint8_t           *tail;
+    size_t            tail_len;
+    struct csum_delta delta;
+};
+
 int reassemble_ip(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
-    size_t ops_len, uint8_t ow);
+    size_t ops_len, uint8_t ow, struct csum_part *part);
 int reassemble_tcp(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
-    size_t ops_len, uint8_t ow);
+    size_t ops_len, uint8_t ow, struct csum_part *part);
 int reassemble_udp(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
-    size_t ops_len, uint8_t ow);
+    size_t ops_len, uint8_t ow, struct csum_part *part);
+
+
+/* per-mode variants; instantiated for both values of OW */
+template <bool OW>
+int reassemble_ip_sg(struct iphdr *iph, size_t room, size_t tailroom,
+    uint8_t *head, uint8_t *ops, size_t ops_len, struct pkt_sg *sg);
+template <bool OW>
+int reassemble_tcp_sg(struct iphdr *iph, size_t room, size_t tailroom,
+    uint8_t *head, uint8_t *ops, size_t ops_len, struct pkt_sg *sg);
+template <bool OW>
+int reassemble_udp_sg(struct iphdr *iph, size_t room, size_t tailroom,
+    uint8_t *head, uint8_t *ops, size_t ops_len, struct pkt_sg *sg);
+template <bool OW>
+int reassemble_multi_sg(struct iphdr *iph, size_t room, size_t tailroom,
+    uint8_t *head, uint8_t *ip_ops, size_t ip_ops_len, uint8_t *l4_ops,
+    size_t l4_ops_len, struct pkt_sg *sg);
+
+int reassemble_ip_sg(struct iphdr *iph, size_t room, size_t tailroom,
+    uint8_t *head, uint8_t *ops, size_t ops_len, uint8_t ow,
+    struct pkt_sg *sg);
+int reassemble_tcp_sg(struct iphdr *iph, size_t room, size_t tailroom,
+    uint8_t *head, uint8_t *ops, size_t ops_len, uint8_t ow,
+    struct pkt_sg *sg);
+int reassemble_udp_sg(struct iphdr *iph, size_t room, size_t tailroom,
+    uint8_t *head, uint8_t *ops, size_t ops_len, uint8_t ow,
+    struct pkt_sg *sg);
+
+size_t pkt_sg_l4(struct pkt_sg *sg, struct iovec *iov);
 
 #endif
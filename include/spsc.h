@@ -0,0 +1,97 @@
+#include <stdint.h>           /* [u]int*_t */
+
+#ifndef _SPSC_H
+#define _SPSC_H
+
+#define SPSC_DEPTH  256     /* ring capacity (power of 2) */
+#define CACHELINE   64      /* avoid false sharing        */
+
+/* lock-free single-producer / single-consumer ring of packet slot indices
+ * NOTE: each side caches the other's index and only reloads it when the
+ *       ring looks full (or empty); the statistics are written only by the
+ *       producer and may be read (relaxed) by anyone. Occupancy at push is
+ *       measured against the cached consumer index (i.e.: an upper bound)
+ */
+struct spsc {
+    /* producer side */
+    alignas(CACHELINE) uint32_t head;       /* next entry to be written  */
+    uint32_t                    tail_cache; /* last seen consumer index  */
+    uint64_t                    pushes;     /* number of entries pushed  */
+    uint64_t                    occ_sum;    /* sum of occupancy at push  */
+    uint32_t                    occ_max;    /* highest occupancy at push */
+    uint64_t                    full;       /* pushes refused (full)     */
+
+    /* consumer side */
+    alignas(CACHELINE) uint32_t tail;       /* next entry to be read     */
+    uint32_t                    head_cache; /* last seen producer index  */
+
+    alignas(CACHELINE) uint16_t ring[SPSC_DEPTH];
+};
+
+/* spsc_push - appends one entry (producer only)
+ *  @q : ring
+ *  @v : value
+ *
+ *  @return : 0 if everything went ok, 1 if the ring is full
+ */
+static inline int spsc_push(struct spsc *q, uint16_t v)
+{
+    uint32_t head = q->head;
+    uint32_t occ  = head - q->tail_cache;
+
+    if (occ == SPSC_DEPTH) {
+        q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        occ = head - q->tail_cache;
+
+        if (occ == SPSC_DEPTH) {
+            __atomic_store_n(&q->full, q->full + 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+
+    q->ring[head & (SPSC_DEPTH - 1)] = v;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&q->pushes, q->pushes + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->occ_sum, q->occ_sum + occ, __ATOMIC_RELAXED);
+    if (occ > q->occ_max)
+        __atomic_store_n(&q->occ_max, occ, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/* spsc_pop - removes the oldest entry (consumer only)
+ *  @q : ring
+ *  @v : value (output)
+ *
+ *  @return : 0 if everything went ok, 1 if the ring is empty
+ */
+static inline int spsc_pop(struct spsc *q, uint16_t *v)
+{
+    uint32_t tail = q->tail;
+
+    if (tail == q->head_cache) {
+        q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+        if (tail == q->head_cache)
+            return 1;
+    }
+
+    *v = q->ring[tail & (SPSC_DEPTH - 1)];
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* spsc_occupancy - number of entries currently in the ring (any thread)
+ *  @q : ring
+ *
+ *  @return : approximate occupancy
+ */
+static inline uint32_t spsc_occupancy(struct spsc *q)
+{
+    return __atomic_load_n(&q->head, __ATOMIC_RELAXED)
+         - __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+}
+
+#endif
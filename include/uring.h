@@ -0,0 +1,12 @@
+#include "worker.h"
+
+#ifndef _URING_H
+#define _URING_H
+
+#define UR_ENTRIES  64      /* submission queue size                 */
+#define UR_BUFS     128     /* provided receive buffers (power of 2) */
+#define UR_BGID     0       /* provided buffer group id              */
+
+int uring_loop(struct worker *wk);
+
+#endif
@@ -0,0 +1,51 @@
+#include <stdint.h>           /* [u]int*_t     */
+#include <pthread.h>          /* pthread_t     */
+#include <netinet/ip.h>       /* iphdr         */
+
+#include "batch.h"
+#include "overload.h"
+#include "annotate.h"
+#include "flow.h"
+#include "budget.h"
+#include "pmtu.h"
+
+#ifndef _WORKER_H
+#define _WORKER_H
+
+/* a receive burst is annotated as a whole */
+static_assert(BATCH_MAX <= BURST_MAX, "receive burst exceeds BURST_MAX");
+
+/* per-queue worker context                                           *
+ * NOTE: each worker owns its nfq handle, socket and scratch buffers; *
+ *       nothing in here is shared with other threads                 */
+struct worker {
+    pthread_t           tid;                /* worker thread id            */
+    uint16_t            q_num;              /* bound queue number          */
+    int32_t             cpu;                /* pinned cpu (-1 if unpinned) */
+    int32_t             fd;                 /* nfq netlink socket          */
+    struct nfq_handle   *h;                 /* nfq connection handle       */
+    struct nfq_q_handle *qh;                /* nfq queue                   */
+    struct overload     ovl;                /* overload control            */
+    struct tx_batch     txb;                /* pending verdicts            */
+    struct pool         pool;               /* receive buffers             */
+    struct rx_batch     rxb;                /* received netlink messages   */
+    uint8_t             *rx_end;            /* end of current rx buffer    */
+    struct timespec     now;                /* current burst's clock       */
+    struct burst        burst;              /* packets of current burst    */
+    uint32_t            ids[BURST_MAX];     /* their nfq packet ids        */
+    uint8_t             changed[BURST_MAX]; /* !0 if burst.sg[] is valid   */
+    uint32_t            n_burst;            /* packets in current burst    */
+    struct pipeline     *pipe;              /* pipeline mode stages        */
+    struct flow_table   *flows;             /* tracked flows (or NULL)     */
+    struct budget       *budget;            /* annotation budget (or NULL) */
+    struct pmtu         *pmtu;              /* path mtu cache (or NULL)    */
+};
+
+/* break main loop (set by signal handler) */
+extern volatile bool bml;
+
+void *worker_main(void *data);
+void worker_ctx(struct worker *wk, struct nfq_data *nfd, struct ops_ctx *ctx);
+int  worker_burst(struct worker *wk);
+
+#endif
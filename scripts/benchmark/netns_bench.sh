@@ -0,0 +1,350 @@
+#!/bin/bash
+
+# netns_bench.sh - local throughput / latency benchmark over a veth pair
+#   $OPS_BIN   : [optional] ops-inject binary                 (has default)
+#   $OUT_DIR   : [optional] output dir for logs and captures  (has default)
+#   $PROTOS    : [optional] protocol modes to test            (has default)
+#   $RATES     : [optional] offered loads, in packets / sec   (has default)
+#   $DURATION  : [optional] seconds of traffic per run        (has default)
+#   $DATA_LEN  : [optional] payload length of each packet     (has default)
+#   $INJ_ARGS  : [optional] extra ops-inject arguments        (has default)
+#   $OPS_IP    : [optional] ip  ops strings (space separated) (has default)
+#   $OPS_TCP   : [optional] tcp ops strings (space separated) (has default)
+#   $OPS_UDP   : [optional] udp ops strings (space separated) (has default)
+#
+# two network namespaces are joined by a veth pair. packets generated by nping
+# in the sender namespace are diverted to ops-inject by an NFQUEUE rule (w/
+# --queue-bypass, as in inject_ops.sh) and counted by iptables rules in the
+# receiver namespace. each (protocol, ops string, rate) tuple gets a fresh
+# ops-inject instance and reports:
+#   - offered and delivered packets / sec
+#   - annotated packets / sec; delivered packets that are not any longer than
+#     what nping generated have leaked through unmodified (fail-open, shedding)
+#   - drops, both end to end and as seen by the kernel queue
+#   - verdict latency percentiles, in microseconds; 1 in 64 packets (ip id
+#     based) is logged via NFLOG before the queue and captured again on the
+#     veth after the verdict
+#   - ops-inject cpu time (user + sys) per offered packet, in microseconds;
+#     softirq time spent in the kernel queue is not included
+#
+# results are also appended to ${OUT_DIR}/netns_bench.csv
+#
+# ops strings are printf formats, like the ones given to inject_ops.sh. the
+# default ones fit on top of the packets generated by nping (w/o -w).
+#
+# NOTE: must be run as root; needs nping (nmap), tcpdump and iptables w/ the
+#       u32, length, NFLOG and NFQUEUE extensions
+# NOTE: check util.sh for aditional environment arguments
+
+###############################################################################
+############################## CONFIG VARIABLES ###############################
+###############################################################################
+
+# import util functions / variables
+# NOTE: make sure there are no conflicts
+source $(realpath $(dirname ${BASH_SOURCE[0]}))/../utils/util.sh
+
+# set default values for environment arguments
+OPS_BIN=${OPS_BIN:-$(realpath \
+    $(dirname ${BASH_SOURCE[0]}))/../../bin/ops-inject}
+OUT_DIR=${OUT_DIR:-'logs'}
+PROTOS=${PROTOS:-'ip tcp udp'}
+RATES=${RATES:-'1000 10000 50000 100000'}
+DURATION=${DURATION:-10}
+DATA_LEN=${DATA_LEN:-64}
+INJ_ARGS=${INJ_ARGS:-''}
+OPS_IP=${OPS_IP:-'\x07 \x44'}
+OPS_TCP=${OPS_TCP:-'\x01\x01\xfe'}
+OPS_UDP=${OPS_UDP:-'\x01\x01\xfe'}
+
+OUT_DIR=${OUT_DIR%/}
+LOG_FILE=${OUT_DIR}/netns_bench.log
+CSV_FILE=${OUT_DIR}/netns_bench.csv
+
+# topology
+NS_TX='opsi-tx'
+NS_RX='opsi-rx'
+VETH_TX='opsi0'
+VETH_RX='opsi1'
+ADDR_TX='10.203.0.1'
+ADDR_RX='10.203.0.2'
+
+# latency sampling (ip id based, so that both captures pick the same packets)
+SAMPLE_MASK=0x3f
+NFLOG_GROUP=1
+
+# reserved variables
+INJ_PID=''
+CAP_PIDS=''
+
+###############################################################################
+############################## HELPER FUNCTIONS ###############################
+###############################################################################
+
+# cleanup - kills all started processes & deletes the namespaces
+#
+# deleting the namespaces also removes the veth pair and the iptables rules
+function cleanup {
+    kill ${INJ_PID} ${CAP_PIDS} &>/dev/null
+    pkill -f "nping.*${ADDR_RX}" &>/dev/null
+
+    ip netns del ${NS_TX} &>/dev/null
+    ip netns del ${NS_RX} &>/dev/null
+}
+
+# ns_tx / ns_rx - run a command in the sender / receiver namespace
+#   $@ : [required] command
+function ns_tx {
+    ip netns exec ${NS_TX} "$@"
+}
+
+function ns_rx {
+    ip netns exec ${NS_RX} "$@"
+}
+
+# l4_of - translates an ops-inject protocol mode into the generated l4 protocol
+#   $1 : [required] {ip|tcp|udp}
+function l4_of {
+    case $1 in
+        'ip')  echo 'icmp' ;;
+        *)     echo $1     ;;
+    esac
+}
+
+# pkt_len_of - length of the ip packets generated by nping (w/o options)
+#   $1 : [required] {ip|tcp|udp}
+function pkt_len_of {
+    case $1 in
+        'tcp') echo $((20 + 20 + DATA_LEN)) ;;
+        *)     echo $((20 +  8 + DATA_LEN)) ;;
+    esac
+}
+
+# nping_args_of - nping traffic mode arguments
+#   $1 : [required] {ip|tcp|udp}
+#
+# TCP packets carry SYN since some tcp ops (e.g.: timestamp) are only added to
+# the handshake
+function nping_args_of {
+    case $1 in
+        'ip')  echo '--icmp --icmp-type echo'  ;;
+        'tcp') echo '--tcp --flags syn -p 5201' ;;
+        'udp') echo '--udp -p 5201'             ;;
+    esac
+}
+
+# ipt_pkts - packet counter of the n-th rule in a chain
+#   $1 : [required] namespace
+#   $2 : [required] chain
+#   $3 : [required] rule number (1-based)
+function ipt_pkts {
+    ip netns exec $1 iptables -nvxL $2 \
+    | awk -v N=$3 'NR == N + 2 { print $1 }'
+}
+
+# cpu_ticks - user + sys clock ticks consumed by a process (all threads)
+#   $1 : [required] pid
+function cpu_ticks {
+    awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+# queue_drops - kernel side drops of nfqueue 0 (queue full + socket full)
+#
+# must be read while ops-inject is still bound to the queue
+function queue_drops {
+    ns_tx awk '$1 == 0 { print $6 + $7 }' /proc/net/netfilter/nfnetlink_queue
+}
+
+# latency - verdict latency percentiles in microseconds
+#   $1 : [required] capture before the queue (nflog)
+#   $2 : [required] capture after the verdict (veth)
+#
+# packets are matched by ip id, in order of appearance; ids that wrap around
+# during a run are paired w/ their oldest unmatched occurrence
+function latency {
+    {
+        tcpdump -r $1 -nn -tt -v --time-stamp-precision nano 2>/dev/null \
+        | sed -n 's/^\([0-9.]*\) IP .* id \([0-9]*\),.*/0 \1 \2/p'
+        tcpdump -r $2 -nn -tt -v --time-stamp-precision nano 2>/dev/null \
+        | sed -n 's/^\([0-9.]*\) IP .* id \([0-9]*\),.*/1 \1 \2/p'
+    }                                                                   \
+    | awk '$1 == 0 { pre[$3, n[$3]++] = $2; next }
+           m[$3] < n[$3] { printf "%.3f\n", ($2 - pre[$3, m[$3]++]) * 1e6 }' \
+    | sort -n                                                           \
+    | awk 'function at(p) { i = int(NR * p); return v[i + (i < NR * p)] }
+           { v[NR] = $1 }
+           END {
+               if (!NR) { print "- - - -"; exit }
+               print at(0.50), at(0.90), at(0.99), v[NR]
+           }'
+}
+
+# run_one - one benchmark run
+#   $1 : [required] {ip|tcp|udp}
+#   $2 : [required] ops string (printf format)
+#   $3 : [required] offered rate (packets / sec)
+function run_one {
+    local PROTO=$1
+    local OPS=$2
+    local RATE=$3
+    local L4=$(l4_of ${PROTO})
+    local PKT_LEN=$(pkt_len_of ${PROTO})
+    local TAG="${PROTO}-$(printf '%s' "${OPS}" | tr -d '\\' )-${RATE}"
+    local CLK_TCK=$(getconf CLK_TCK)
+
+    # sender: sampled nflog before the queue, then the queue itself
+    ns_tx iptables -F OUTPUT
+    ns_tx iptables -A OUTPUT -d ${ADDR_RX} -p ${L4}                  \
+        -m u32 --u32 "4>>16&${SAMPLE_MASK}=0"                         \
+        -j NFLOG --nflog-group ${NFLOG_GROUP}
+    ns_tx iptables -A OUTPUT -d ${ADDR_RX} -p ${L4}                  \
+        -j NFQUEUE --queue-num 0 --queue-bypass
+
+    # receiver: everything & only packets that grew (i.e.: annotated)
+    ns_rx iptables -F INPUT
+    ns_rx iptables -A INPUT -s ${ADDR_TX} -p ${L4}
+    ns_rx iptables -A INPUT -s ${ADDR_TX} -p ${L4}                   \
+        -m length --length $((PKT_LEN + 1)):65535
+
+    # start injector
+    TELL "starting ${YELLOW}%s${CLR} injector (ops ${YELLOW}%s${CLR})" \
+         ${PROTO} "${TAG#${PROTO}-}"
+    # NOTE: 'ip netns exec' execs the command, so $! is the injector's pid
+    ip netns exec ${NS_TX} ${OPS_BIN} -p ${PROTO} -q 0 ${INJ_ARGS}   \
+        <(printf "${OPS}") &>${OUT_DIR}/${TAG}-inject.log &
+    INJ_PID=$!
+    sleep 1s; kill -0 ${INJ_PID} 2>/dev/null
+    WAR $? "see ${OUT_DIR}/${TAG}-inject.log"
+    kill -0 ${INJ_PID} 2>/dev/null || return
+
+    # start latency captures
+    ip netns exec ${NS_TX} tcpdump -i nflog:${NFLOG_GROUP} -U              \
+        -w ${OUT_DIR}/${TAG}-pre.pcap --time-stamp-precision nano          \
+        &>>${LOG_FILE} &
+    CAP_PIDS="$!"
+    ip netns exec ${NS_TX} tcpdump -i ${VETH_TX} -U                        \
+        -w ${OUT_DIR}/${TAG}-post.pcap --time-stamp-precision nano -Q out  \
+        "dst ${ADDR_RX} and ${L4} and ip[4:2] & ${SAMPLE_MASK} = 0"        \
+        &>>${LOG_FILE} &
+    CAP_PIDS="${CAP_PIDS} $!"
+    sleep 1s
+
+    # generate traffic
+    TELL "offering ${YELLOW}%s${CLR} pps for ${YELLOW}%s${CLR}s" \
+         ${RATE} ${DURATION}
+    local CPU_START=$(cpu_ticks ${INJ_PID})
+    local T_START=$(date +%s.%N)
+
+    ns_tx nping --send-ip --privileged -H -c $((RATE * DURATION))       \
+        --rate ${RATE} --data-length ${DATA_LEN} $(nping_args_of ${PROTO}) \
+        ${ADDR_RX} &>>${LOG_FILE}
+    DIE $?
+
+    local T_END=$(date +%s.%N)
+    sleep 1s                                        # drain queue
+    local CPU_END=$(cpu_ticks ${INJ_PID})
+    local Q_DROPS=$(queue_drops)
+
+    # stop everything
+    kill -INT ${INJ_PID} &>/dev/null
+    wait ${INJ_PID} &>/dev/null
+    kill ${CAP_PIDS} &>/dev/null
+    wait ${CAP_PIDS} &>/dev/null
+    INJ_PID=''
+    CAP_PIDS=''
+
+    # gather results
+    local OFFERED=$(ipt_pkts ${NS_TX} OUTPUT 2)
+    local RX_ALL=$(ipt_pkts ${NS_RX} INPUT 1)
+    local RX_ANN=$(ipt_pkts ${NS_RX} INPUT 2)
+    local LAT=($(latency ${OUT_DIR}/${TAG}-pre.pcap                         \
+                         ${OUT_DIR}/${TAG}-post.pcap))
+
+    awk -v proto=${PROTO} -v ops="${TAG#${PROTO}-}" -v rate=${RATE}         \
+        -v t0=${T_START} -v t1=${T_END} -v off=${OFFERED}                   \
+        -v rx=${RX_ALL} -v ann=${RX_ANN} -v qd=${Q_DROPS:-0}                 \
+        -v cpu=$((CPU_END - CPU_START)) -v hz=${CLK_TCK}                     \
+        -v p50=${LAT[0]} -v p90=${LAT[1]} -v p99=${LAT[2]} -v pmax=${LAT[3]} \
+        -v csv=${CSV_FILE}                                                  \
+        'BEGIN {
+            dt = t1 - t0
+            row = sprintf("%s,%s,%d,%.0f,%.0f,%.0f,%d,%d,%d,%s,%s,%s,%s,%.3f",
+                          proto, ops, rate, off / dt, rx / dt, ann / dt,
+                          rx - ann, off - rx, qd, p50, p90, p99, pmax,
+                          off ? cpu / hz * 1e6 / off : 0)
+            print row >> csv
+            gsub(",", "\t", row)
+            print row
+        }'
+}
+
+###############################################################################
+################################# ENTRY POINT #################################
+###############################################################################
+
+# check environment
+TELL "checking privileges"
+[[ $(id -u) -eq 0 ]]
+DIE $? "must be run as root"
+
+TELL "checking dependencies"
+command -v nping &>/dev/null       \
+&& command -v tcpdump &>/dev/null  \
+&& command -v iptables &>/dev/null
+DIE $? "need nping, tcpdump and iptables"
+
+TELL "checking presence of ${YELLOW}%s${CLR}" ${OPS_BIN}
+[[ -x ${OPS_BIN} ]]
+DIE $? "run make first"
+
+# clean up & prep
+mkdir -p ${OUT_DIR}
+rm -f ${LOG_FILE}
+cleanup
+trap cleanup EXIT
+
+# create topology
+TELL "creating namespaces ${YELLOW}%s${CLR} and ${YELLOW}%s${CLR}" \
+     ${NS_TX} ${NS_RX}
+ip netns add ${NS_TX} && ip netns add ${NS_RX}
+DIE $?
+
+TELL "creating veth pair"
+ip link add ${VETH_TX} netns ${NS_TX} type veth \
+    peer name ${VETH_RX} netns ${NS_RX}         \
+&& ip -n ${NS_TX} addr add ${ADDR_TX}/24 dev ${VETH_TX} \
+&& ip -n ${NS_RX} addr add ${ADDR_RX}/24 dev ${VETH_RX} \
+&& ip -n ${NS_TX} link set ${VETH_TX} up \
+&& ip -n ${NS_RX} link set ${VETH_RX} up \
+&& ip -n ${NS_TX} link set lo up         \
+&& ip -n ${NS_RX} link set lo up
+DIE $?
+
+TELL "checking connectivity"
+ns_tx ping -c 1 -W 1 ${ADDR_RX} &>>${LOG_FILE}
+DIE $?
+
+# run benchmarks
+[[ -f ${CSV_FILE} ]] ||
+    echo 'proto,ops,rate,offered_pps,delivered_pps,annotated_pps,leaked,'`
+         `'dropped,queue_dropped,lat_p50_us,lat_p90_us,lat_p99_us,'`
+         `'lat_max_us,cpu_us_per_pkt' > ${CSV_FILE}
+
+for PROTO in ${PROTOS}; do
+    case ${PROTO} in
+        'ip')  OPS_LIST=${OPS_IP}  ;;
+        'tcp') OPS_LIST=${OPS_TCP} ;;
+        'udp') OPS_LIST=${OPS_UDP} ;;
+        *)     TELL "unknown protocol ${YELLOW}%s${CLR}" ${PROTO}; DIE 1 ;;
+    esac
+
+    for OPS in ${OPS_LIST}; do
+        printf "${BLUE}proto\tops\trate\toffered\tdelivrd\tannotd\t"`
+               `"leaked\tdropped\tq_drop\tp50_us\tp90_us\tp99_us\tmax_us\t"`
+               `"cpu_us${CLR}\n"
+
+        for RATE in ${RATES}; do
+            run_one ${PROTO} "${OPS}" ${RATE}
+        done
+    done
+done
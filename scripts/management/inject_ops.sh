@@ -14,6 +14,9 @@
 #
 #   if "disable" - kills remote injection tools and flushes iptables rules
 #
+#   $BUDGET   : [optional] annotation budget for "enable" (e.g.: first=3);
+#               connections past it are connmarked & bypass the queue
+#   $CT_MARK  : [optional] connmark bit for those connections (has default)
 #   $LOG_FILE : [optional] log file for gcloud outputs (has default)
 #   $API_VERS : [optional] gcloud cli api version      (has default)
 #   $PROJECT  : [required] gcloud project name
@@ -40,6 +43,7 @@ shift 1
 
 # set default values for environment arguments
 LOG_FILE=${LOG_FILE:-'api.log'}
+CT_MARK=${CT_MARK:-'0x100'}
 API_VERS=${API_VERS:-'beta'}
 
 # disable interactive mode (defaults will be used on prompt)
@@ -74,8 +78,7 @@ case ${COMMAND} in
             # install dependencies
             SSH ${EXT_IP}                                                 \
                 "sudo apt update && sudo apt install -y                   \
-                 make gcc g++ libnetfilter-queue1 libnetfilter-queue-dev  \
-                 ethtool"                                                 \
+                 make gcc g++ libnetfilter-queue1 libnetfilter-queue-dev" \
                 "installing dependencies on ${YELLOW}%s${CLR}" ${EXT_IP}
 
             # clean up files from any previous run
@@ -90,13 +93,16 @@ case ${COMMAND} in
                 "cd $(basename ${TOOL_DIR}) && make -j \$(nproc)" \
                 "installing tool"
 
-            # disable checksum offloading on active interface
-            # just to be safe
-            SSH ${EXT_IP}                                        \
-                "sudo ethtool --offload                          \
-                    \$(ip route get 8.8.8.8 | awk '{print \$5}') \
-                    rx off tx off"                               \
-                "disabling rx and tx checksum offloading"
+            # offloads stay on; the injector runs in GSO mode (-g) and
+            # the kernel replicates our headers in every segment. each
+            # segment grows by the option size though, so reserve the
+            # maximum (40 bytes) in the default route's MTU
+            SSH ${EXT_IP}                                                   \
+                "IFACE=\$(ip route get 8.8.8.8 | awk '{print \$5}')     &&  \
+                 MTU=\$(cat /sys/class/net/\${IFACE}/mtu)               &&  \
+                 sudo ip route change \$(ip route show default | head -n 1) \
+                    mtu lock \$((MTU - 40))"                                \
+                "reserving option headroom in route MTU"
         done
 
         ;;
@@ -127,6 +133,18 @@ case ${COMMAND} in
                     -j ACCEPT"  \
                 "inserting outgoing ssh ACCEPT all rule"
 
+            # insert queue bypass rule for connections that are past the
+            # budget (ops-inject marks them)
+            if [[ -n "${BUDGET}" ]]; then
+                SSH ${EXT_IP}                               \
+                    "sudo iptables                          \
+                        -I OUTPUT                           \
+                        -m connmark                         \
+                        --mark ${CT_MARK}/${CT_MARK}        \
+                        -j ACCEPT"                          \
+                    "inserting connmark queue bypass rule"
+            fi
+
             # insert interception rules for all other hosts
             SSH ${EXT_IP}                                                 \
                 "sudo iptables                                            \
@@ -151,7 +169,9 @@ case ${COMMAND} in
                 "nohup sudo bash -c './ops-inject/bin/ops-inject \
                     -p ${OPS_PROTO}                              \
                     -q 0                                         \
+                    -g                                           \
                     -w                                           \
+                    ${BUDGET:+--budget=$BUDGET --ct-mark=$CT_MARK/$CT_MARK} \
                     <(printf $(printf '%q' ${OPS_BYTES}))'       \
                  &>injector.log &                                \
                  ${BG_PROCESS_CHECK}"                            \
@@ -0,0 +1,527 @@
+/*
+ * Copyright © 2021, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of ops-inject.
+ *
+ * ops-inject is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ops-inject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>            /* size_t                 */
+#include <stdint.h>           /* [u]int*_t              */
+#include <string.h>           /* memcpy                 */
+#include <arpa/inet.h>        /* ntohs                  */
+#include <netinet/ip.h>       /* iphdr                  */
+#include <netinet/in.h>       /* IPPROTO_*              */
+#include <netinet/tcp.h>      /* tcphdr                 */
+#include <netinet/udp.h>      /* udphdr                 */
+
+#include <stdbool.h>          /* fixes pktbuff.h error  */
+#include <libnetfilter_queue/libnetfilter_queue.h>
+
+/* prefer writing these in C due to Designated Initializers      *
+ * makes the usage of callback arrays more pleasant              *
+ *                                                               *
+ * TODO: clang has support for designated initializers in c++    *
+ *       maybe make the switch at some point; dont' care for now */
+extern "C" {
+#include "str_proto.h"
+#include "csum.h"
+}
+#include "cli_args.h"
+#include "decoders.h"
+#include "reassemblers.h"
+#include "annotate.h"
+#include "flow.h"
+#include "pmtu.h"
+#include "budget.h"
+#include "util.h"
+
+/* target "protocol" of the multi-layer modes (see decode_layers()) */
+#define ANNOTATE_MULTI 0xff
+
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* decode_layers - decodes the ops of every target layer that a packet has
+ *  @OW      : overwrite existing options
+ *  @iph     : original packet
+ *  @skbinfo : nfq skb flags (NFQA_SKB_*)
+ *  @ctx     : per-packet context for the decoders (see clock.h)
+ *  @ip_ops  : set to the ip ops (or NULL if there are none)
+ *  @ip_len  : set to their length
+ *  @l4_ops  : set to the tcp or udp ops (or NULL if there are none)
+ *  @l4_len  : set to their length
+ *
+ *  @return : 0 if at least one layer has ops to add
+ *
+ * The ip ops are decoded first. W/ a path mtu, the layer 4 ones only get
+ * what the ip ops left of it. A layer whose ops can't be decoded is left as
+ * is and the others are still annotated. Each layer has its own decoder
+ * instance, so both ops buffers stay valid until the next packet.
+ */
+template <bool OW>
+static int decode_layers(struct iphdr *iph, uint32_t skbinfo,
+                         struct ops_ctx *ctx, uint8_t **ip_ops, size_t *ip_len,
+                         uint8_t **l4_ops, size_t *l4_len)
+{
+    uint8_t  *l4h = (uint8_t *) iph + iph->ihl * 4;
+    size_t   avail = ntohs(iph->tot_len) - iph->ihl * 4;
+    uint16_t mtu   = ctx->mtu;
+    uint8_t  l4    = 0;             /* layer 4 w/ ops of its own */
+    ssize_t  left;                  /* path mtu left for it      */
+
+    *ip_ops = *l4_ops = NULL;
+    *ip_len = *l4_len = 0;
+
+    /* (see annotate() on udp gso super-packets) */
+    if (iph->protocol == IPPROTO_TCP && args.layers & (1 << LAYER_TCP)
+        && avail >= sizeof(struct tcphdr)
+        && ((struct tcphdr *) l4h)->doff * 4 <= avail)
+        l4 = IPPROTO_TCP;
+    else if (iph->protocol == IPPROTO_UDP && args.layers & (1 << LAYER_UDP)
+        && avail >= sizeof(struct udphdr)
+        && ntohs(((struct udphdr *) l4h)->len) >= sizeof(struct udphdr)
+        && ntohs(((struct udphdr *) l4h)->len) <= avail
+        && !(skbinfo & NFQA_SKB_GSO))
+        l4 = IPPROTO_UDP;
+
+    if (!l4 && !(args.layers & (1 << LAYER_IP))) {
+        DEBUG("No target layer in packet");
+        return 1;
+    }
+
+    if (l4 == IPPROTO_TCP && ctx->flow)
+        flow_learn(ctx->flow, ctx->dir, iph);
+
+    if (args.layers & (1 << LAYER_IP)) {
+        *ip_len = decode_ops<IPPROTO_IP, OW>(iph, (void **) ip_ops, ctx);
+        if (!*ip_len)
+            *ip_ops = NULL;
+    }
+
+    /* what the ip ops take off the path mtu */
+    if (*ip_len && mtu) {
+        left     = mtu - (ssize_t) *ip_len + (OW ? iph->ihl * 4 - 20 : 0);
+        ctx->mtu = left < 1 ? 1 : left > 0xffff ? 0xffff : left;
+    }
+
+    if (l4 == IPPROTO_TCP)
+        *l4_len = decode_ops<IPPROTO_TCP, OW>(iph, (void **) l4_ops, ctx);
+    else if (l4 == IPPROTO_UDP)
+        *l4_len = decode_ops<IPPROTO_UDP, OW>(iph, (void **) l4_ops, ctx);
+    if (!*l4_len)
+        *l4_ops = NULL;
+
+    ctx->mtu = mtu;
+    return !*ip_len && !*l4_len;
+}
+
+/* annotate - injects the user's options into one packet
+ *  @P        : target protocol (IPPROTO_IP, IPPROTO_TCP, IPPROTO_UDP or
+ *              ANNOTATE_MULTI for every layer in args.layers)
+ *  @OW       : overwrite existing options
+ *  @FULL     : always recompute checksums from scratch (--full-csum)
+ *  @iph      : original packet
+ *  @room     : writable bytes before iph (0 to leave the packet intact)
+ *  @tailroom : writable bytes after the packet (0 to leave it intact)
+ *  @skbinfo  : nfq skb flags (NFQA_SKB_*)
+ *  @ctx      : per-packet context for the decoders (see clock.h)
+ *  @head     : scratch buffer for the rewritten headers (SG_HEAD_MAX bytes)
+ *  @sg       : modified packet; valid only if 0 is returned
+ *
+ *  @return : 0 if the packet was modified, !0 if it should pass unchanged
+ *
+ * Decodes the ops, reassembles the packet & recalculates its checksums. The
+ * body (and for udp, the tail) of the result may reference the original
+ * packet and the decoder's (per-thread) ops buffer, respectively. If room
+ * (or for udp, tailroom) is given, the packet is modified in place whenever
+ * the new headers (or options) fit and the original packet (and up to room
+ * bytes before it) are lost, even if !0 is returned; the kernel still holds
+ * its own copy for an unchanged verdict.
+ *
+ * One instance exists for each mode (see annotate_select()); the decoder,
+ * reassembler & checksum routines are called directly and the branches that
+ * don't apply to the mode are compiled out. The multi-layer instances decode
+ * each layer's ops, then rewrite all headers in one reassembly & update the
+ * checksums once, so the packet takes a single trip through the queue.
+ */
+template <uint8_t P, bool OW, bool FULL>
+static int annotate(struct iphdr *iph, size_t room, size_t tailroom,
+                    uint32_t skbinfo, struct ops_ctx *ctx, uint8_t *head,
+                    struct pkt_sg *sg)
+{
+    struct iphdr *mod_iph;          /* modified packet hdr */
+    struct iovec l4_iov[3];         /* layer 4 fragments   */
+    size_t       l4_cnt;            /* # of l4 fragments   */
+    uint8_t      *ops_buffer;       /* complete ops buffer */
+    size_t       ops_len;           /* complete ops length */
+    uint8_t      *l4_ops = NULL;    /* multi: layer 4 ops  */
+    size_t       l4_len  = 0;       /* multi: their length */
+    ssize_t      ans;               /* answer              */
+
+    /* gso super-packets (only seen in gso mode) are segmented by the     *
+     * kernel after the verdict; every segment gets a copy of the ip & tcp *
+     * headers (including our options) w/ its own ip id & tcp seq number.  *
+     * udp options live in a trailer that only the last segment would get */
+    if (P == IPPROTO_UDP && skbinfo & NFQA_SKB_GSO) {
+        DEBUG("Skipping UDP GSO super-packet");
+        return 1;
+    }
+
+    /* show some debug info */
+    DEBUG("Received new packet: "
+          "src=%u.%u.%u.%u dst=%u.%u.%u.%u proto=\"%s\"",
+          (iph->saddr >>  0) & 0xff, (iph->saddr >>  8) & 0xff,
+          (iph->saddr >> 16) & 0xff, (iph->saddr >> 24) & 0xff,
+          (iph->daddr >>  0) & 0xff, (iph->daddr >>  8) & 0xff,
+          (iph->daddr >> 16) & 0xff, (iph->daddr >> 24) & 0xff,
+          str_ipproto[iph->protocol]);
+
+    /* record the options the endpoints put there themselves, before  *
+     * they are replaced                                              */
+    if constexpr (P == IPPROTO_TCP)
+        if (ctx->flow)
+            flow_learn(ctx->flow, ctx->dir, iph);
+
+    /* decode protocol specific ops (may depend on packet contents)         *
+     * NOTE: 0 len may mean that an error has occurred and will be reported *
+     *       by the decoder or that the target protcol was not found in the *
+     *       captured packet; for the latter case, refine the iptables rule */
+    if constexpr (P == ANNOTATE_MULTI) {
+        ans = decode_layers<OW>(iph, skbinfo, ctx, &ops_buffer, &ops_len,
+                  &l4_ops, &l4_len);
+        if (ans)
+            return 1;
+    } else {
+        ops_len = decode_ops<P, OW>(iph, (void **) &ops_buffer, ctx);
+        RET(!ops_len, 1, "Decoding failed");
+    }
+
+    /* reassemble the packet by incorporating the decoded options */
+    if constexpr (P == IPPROTO_IP)
+        ans = reassemble_ip_sg<OW>(iph, room, tailroom, head, ops_buffer,
+                ops_len, sg);
+    else if constexpr (P == IPPROTO_TCP)
+        ans = reassemble_tcp_sg<OW>(iph, room, tailroom, head, ops_buffer,
+                ops_len, sg);
+    else if constexpr (P == IPPROTO_UDP)
+        ans = reassemble_udp_sg<OW>(iph, room, tailroom, head, ops_buffer,
+                ops_len, sg);
+    else
+        ans = reassemble_multi_sg<OW>(iph, room, tailroom, head, ops_buffer,
+                ops_len, l4_ops, l4_len, sg);
+    RET(ans, 1, "Reassembly failed");
+
+    /* too large for the path; let the kernel fragment it (--pmtu=frag) *
+     * NOTE: w/ the other policies, the decoder already kept it smaller  */
+    mod_iph = (struct iphdr *) sg->head;
+    if (args.pmtu == PMTU_FRAG && ctx->mtu
+        && ntohs(mod_iph->tot_len) > ctx->mtu
+        && mod_iph->frag_off & htons(IP_DF)) {
+        DEBUG("Clearing DF to fit the path mtu (%hu)", ctx->mtu);
+
+        sg->delta.l3_old   = csum_partial(sg->delta.l3_old,
+                                 &mod_iph->frag_off, 2);
+        mod_iph->frag_off &= ~htons(IP_DF);
+        sg->delta.l3_new   = csum_partial(sg->delta.l3_new,
+                                 &mod_iph->frag_off, 2);
+    }
+
+    /* recalculate layer 4 and layer 3 checksums for updated content          *
+     * NOTE: for ip ops, the layer 4 protocol is only known at runtime; even  *
+     *       if it does not require checksum calculation it should still have *
+     *       a 'return 0' callback                                            *
+     * NOTE: the old checksums are updated w/ what the reassembler replaced,  *
+     *       unless the kernel left the layer 4 one for the nic to finish;    *
+     *       udp & ip ops replace nothing that the layer 4 checksum covers    */
+    if (FULL || skbinfo & NFQA_SKB_CSUMNOTREADY) {
+        l4_cnt = pkt_sg_l4(sg, l4_iov);
+
+        if constexpr (P == IPPROTO_TCP)
+            ans = tcp_csum_sg(mod_iph, l4_iov, l4_cnt);
+        else if constexpr (P == IPPROTO_UDP)
+            ans = udp_csum_sg(mod_iph, l4_iov, l4_cnt);
+        else
+            ans = layer4_csum_sg[mod_iph->protocol](mod_iph, l4_iov, l4_cnt);
+        RET(ans, 1, "Layer 4 checksum failed");
+
+        ans = ipv4_csum(mod_iph);
+        RET(ans, 1, "Layer 3 checksum failed");
+    } else {
+        if (P == IPPROTO_TCP || (P == ANNOTATE_MULTI && l4_ops
+                                 && mod_iph->protocol == IPPROTO_TCP)) {
+            pkt_sg_l4(sg, l4_iov);
+
+            ans = tcp_csum_inc(mod_iph, l4_iov, &sg->delta);
+            RET(ans, 1, "Layer 4 checksum update failed");
+        }
+
+        ans = ipv4_csum_inc(mod_iph, &sg->delta);
+        RET(ans, 1, "Layer 3 checksum update failed");
+    }
+
+    return 0;
+}
+
+/* annotate_burst - injects the user's options into a burst of packets
+ *  @P       : target protocol (see annotate())
+ *  @OW      : overwrite existing options
+ *  @FULL    : always recompute checksums from scratch (--full-csum)
+ *  @b       : burst (input filled in by the caller)
+ *  @n       : number of packets in the burst (at most BURST_MAX)
+ *  @changed : set to !0 for each packet that b->sg[] describes
+ *
+ *  @return : number of modified packets
+ *
+ * Same as calling annotate() for each packet, in three passes:
+ *   1. the ip & layer 4 header fields that decide whether a packet can take
+ *      the options are copied into the burst's arrays, while the headers of
+ *      the packets BURST_PREFETCH places ahead are being fetched (headers
+ *      are written to later, hence the write prefetch)
+ *   2. the fit checks run over those arrays w/o branches (the compiler is
+ *      free to vectorize this); in the multi-layer modes, a packet fits if
+ *      any of its layers may take options & the rest is left to the decoder
+ *   3. only the packets that fit are decoded, reassembled & checksummed;
+ *      if flows are tracked, their keys are hashed & their buckets fetched
+ *      for the whole burst before the first lookup; if path mtus are
+ *      checked, the frag-needed errors in the burst are applied first
+ * Packets that don't fit pass unchanged w/o reaching the decoder, so they
+ * don't report errors of their own. Neither do packets that fit but are
+ * outside the budget (see budget.cpp), if one is set; b->spent[] tells
+ * which of those are the first of their flow to be out of it for good.
+ *
+ * Unlike annotate(), the udp options trailer is copied into the burst (if
+ * it wasn't appended in place), since the decoder's buffer is reused by the
+ * next packet. Packets whose trailer doesn't fit in b->tail pass unchanged.
+ */
+template <uint8_t P, bool OW, bool FULL>
+static uint32_t annotate_burst(struct burst *b, uint32_t n, uint8_t *changed)
+{
+    uint8_t  *pkt, *l4;             /* current packet & its layer 4 hdr */
+    size_t   tail_len = 0;          /* bytes used in b->tail            */
+    uint32_t n_fit = 0;             /* packets that can take the ops    */
+    uint32_t n_mod = 0;             /* modified packets                 */
+    uint32_t hl;                    /* ip header length                 */
+    uint8_t  l_ip, l_tcp, l_udp;    /* target layers (multi modes)      */
+
+    l_ip  = !!(args.layers & (1 << LAYER_IP));
+    l_tcp = !!(args.layers & (1 << LAYER_TCP));
+    l_udp = !!(args.layers & (1 << LAYER_UDP));
+
+    budget_sync(b->bg);
+
+    /* 1. parse                                           *
+     * NOTE: prefetching NULL (skipped packets) is harmless */
+    for (uint32_t i = 0; i < n && i < BURST_PREFETCH; i++)
+        __builtin_prefetch(b->iph[i], 1);
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (i + BURST_PREFETCH < n)
+            __builtin_prefetch(b->iph[i + BURST_PREFETCH], 1);
+
+        pkt = (uint8_t *) b->iph[i];
+        if (!pkt) {
+            b->ver_ihl[i] = 0;
+            continue;
+        }
+
+        b->ver_ihl[i] = pkt[0];
+        b->proto[i]   = b->iph[i]->protocol;
+        b->tot_len[i] = ntohs(b->iph[i]->tot_len);
+        b->l4_len[i]  = 0;
+
+        /* layer 4 header (if present) */
+        hl = (pkt[0] & 0x0f) * 4;
+        l4 = pkt + hl;
+        if constexpr (P == IPPROTO_TCP) {
+            if (b->tot_len[i] >= hl + sizeof(struct tcphdr))
+                b->l4_len[i] = ((struct tcphdr *) l4)->doff * 4;
+        } else if constexpr (P == IPPROTO_UDP) {
+            if (b->tot_len[i] >= hl + sizeof(struct udphdr))
+                b->l4_len[i] = ntohs(((struct udphdr *) l4)->len);
+        }
+    }
+
+    /* 2. classify */
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t ihl = b->ver_ihl[i] & 0x0f;
+        uint32_t l3  = ihl * 4;
+        uint8_t  ok;
+
+        ok = (b->ver_ihl[i] >> 4 == 4)
+           & (ihl >= 5)
+           & (b->tot_len[i] >= l3);
+
+        if constexpr (P == IPPROTO_IP)
+            ok &= OW | (ihl < 15);
+        else if constexpr (P == IPPROTO_TCP)
+            ok &= (b->proto[i] == IPPROTO_TCP)
+                & (b->l4_len[i] >= sizeof(struct tcphdr))
+                & (b->l4_len[i] <= b->tot_len[i] - l3)
+                & (OW | (b->l4_len[i] < 60));
+        else if constexpr (P == IPPROTO_UDP)
+            ok &= (b->proto[i] == IPPROTO_UDP)
+                & (b->l4_len[i] >= sizeof(struct udphdr))
+                & (b->l4_len[i] <= b->tot_len[i] - l3)
+                & !(b->skbinfo[i] & NFQA_SKB_GSO);
+        else
+            ok &= (l_ip & (OW | (ihl < 15)))
+                | (l_tcp & (b->proto[i] == IPPROTO_TCP))
+                | (l_udp & (b->proto[i] == IPPROTO_UDP)
+                         & !(b->skbinfo[i] & NFQA_SKB_GSO));
+
+        b->fit[i]   = ok;
+        b->spent[i] = 0;
+        changed[i]  = 0;
+        n_fit      += ok;
+    }
+
+    if (n_fit < n)
+        DEBUG("%u of %u packets can't take the options", n - n_fit, n);
+
+    /* 3. annotate */
+    if (b->pm)
+        for (uint32_t i = 0; i < n; i++)
+            if (b->ver_ihl[i] >> 4 == 4 && (b->ver_ihl[i] & 0x0f) >= 5
+                && b->proto[i] == IPPROTO_ICMP)
+                pmtu_learn(b->pm, b->iph[i], &b->ctx[i].now);
+
+    if (b->ft)
+        for (uint32_t i = 0; i < n; i++) {
+            if (!b->fit[i])
+                continue;
+
+            b->hash[i] = flow_key(b->iph[i], &b->key[i], &b->fdir[i]);
+            flow_prefetch(b->ft, b->hash[i]);
+        }
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (!b->fit[i])
+            continue;
+
+        b->ctx[i].flow = NULL;
+        if (b->ft) {
+            b->ctx[i].flow = flow_find(b->ft, &b->key[i], b->hash[i],
+                                 &b->ctx[i].now);
+            b->ctx[i].dir  = b->fdir[i];
+        }
+
+        if (b->bg && !budget_admit(b->bg, b->iph[i], b->ctx[i].flow,
+                           &b->ctx[i].now)) {
+            b->spent[i] = budget_spent(b->bg, b->ctx[i].flow);
+            continue;
+        }
+
+        /* gso super-packets are segmented to the mtu by the kernel */
+        b->ctx[i].mtu = 0;
+        if (b->pm && !(b->skbinfo[i] & NFQA_SKB_GSO))
+            b->ctx[i].mtu = pmtu_get(b->pm, b->iph[i]->daddr,
+                                &b->ctx[i].now);
+
+        if (annotate<P, OW, FULL>(b->iph[i], b->room, b->tailroom[i],
+                b->skbinfo[i], &b->ctx[i], b->head[i], &b->sg[i]))
+            continue;
+
+        /* keep the trailer until the verdict is sent */
+        if constexpr (P == IPPROTO_UDP || P == ANNOTATE_MULTI) {
+            if (b->sg[i].tail_len) {
+                if (tail_len + b->sg[i].tail_len > sizeof(b->tail))
+                    continue;
+
+                memcpy(b->tail + tail_len, b->sg[i].tail, b->sg[i].tail_len);
+                b->sg[i].tail = b->tail + tail_len;
+                tail_len     += b->sg[i].tail_len;
+            }
+        }
+
+        changed[i] = 1;
+        n_mod++;
+    }
+
+    return n_mod;
+}
+
+/******************************************************************************
+ ****************************** PUBLIC FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* annotate_select - picks the annotation routines for a mode
+ *  @layers    : target layers (1 << LAYER_*; see cli_args.h)
+ *  @ow        : !0 to overwrite existing options
+ *  @full_csum : !0 to always recompute checksums from scratch
+ *
+ *  @return : annotation routines or NULL if no layer is given
+ *
+ * A single layer gets the routines of its protocol; several layers get the
+ * multi-layer ones, which read the layers from args.layers.
+ */
+const struct annotate_mode *annotate_select(uint8_t layers, uint8_t ow,
+                                            uint8_t full_csum)
+{
+    /* indexed by [ow][full_csum] */
+    static const struct annotate_mode ip_modes[2][2] = {
+        { { annotate<IPPROTO_IP, false, false>,
+            annotate_burst<IPPROTO_IP, false, false> },
+          { annotate<IPPROTO_IP, false, true>,
+            annotate_burst<IPPROTO_IP, false, true>  } },
+        { { annotate<IPPROTO_IP, true,  false>,
+            annotate_burst<IPPROTO_IP, true,  false> },
+          { annotate<IPPROTO_IP, true,  true>,
+            annotate_burst<IPPROTO_IP, true,  true>  } },
+    };
+    static const struct annotate_mode tcp_modes[2][2] = {
+        { { annotate<IPPROTO_TCP, false, false>,
+            annotate_burst<IPPROTO_TCP, false, false> },
+          { annotate<IPPROTO_TCP, false, true>,
+            annotate_burst<IPPROTO_TCP, false, true>  } },
+        { { annotate<IPPROTO_TCP, true,  false>,
+            annotate_burst<IPPROTO_TCP, true,  false> },
+          { annotate<IPPROTO_TCP, true,  true>,
+            annotate_burst<IPPROTO_TCP, true,  true>  } },
+    };
+    static const struct annotate_mode udp_modes[2][2] = {
+        { { annotate<IPPROTO_UDP, false, false>,
+            annotate_burst<IPPROTO_UDP, false, false> },
+          { annotate<IPPROTO_UDP, false, true>,
+            annotate_burst<IPPROTO_UDP, false, true>  } },
+        { { annotate<IPPROTO_UDP, true,  false>,
+            annotate_burst<IPPROTO_UDP, true,  false> },
+          { annotate<IPPROTO_UDP, true,  true>,
+            annotate_burst<IPPROTO_UDP, true,  true>  } },
+    };
+    static const struct annotate_mode multi_modes[2][2] = {
+        { { annotate<ANNOTATE_MULTI, false, false>,
+            annotate_burst<ANNOTATE_MULTI, false, false> },
+          { annotate<ANNOTATE_MULTI, false, true>,
+            annotate_burst<ANNOTATE_MULTI, false, true>  } },
+        { { annotate<ANNOTATE_MULTI, true,  false>,
+            annotate_burst<ANNOTATE_MULTI, true,  false> },
+          { annotate<ANNOTATE_MULTI, true,  true>,
+            annotate_burst<ANNOTATE_MULTI, true,  true>  } },
+    };
+
+    switch (layers) {
+        case 0:
+            return NULL;
+        case 1 << LAYER_IP:
+            return &ip_modes[!!ow][!!full_csum];
+        case 1 << LAYER_TCP:
+            return &tcp_modes[!!ow][!!full_csum];
+        case 1 << LAYER_UDP:
+            return &udp_modes[!!ow][!!full_csum];
+    }
+
+    return &multi_modes[!!ow][!!full_csum];
+}
@@ -0,0 +1,556 @@
+/*
+ * Copyright © 2021, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of ops-inject.
+ *
+ * ops-inject is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ops-inject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>                          /* size_t          */
+#include <stdint.h>                         /* [u]int*_t       */
+#include <string.h>                         /* memset, memcpy  */
+#include <arpa/inet.h>                      /* htonl, htons    */
+#include <sys/socket.h>                     /* recvmmsg, sendmsg */
+#include <linux/netlink.h>                  /* nlmsghdr        */
+#include <linux/netfilter.h>                /* NF_ACCEPT       */
+#include <linux/netfilter/nfnetlink.h>      /* nfgenmsg        */
+#include <linux/netfilter/nfnetlink_queue.h>/* NFQA_*          */
+#include <linux/netfilter/nfnetlink_conntrack.h>/* CTA_*       */
+
+#include "batch.h"
+#include "pool.h"
+#include "util.h"
+
+/* note that libnetfilter_queue.h is intentionally NOT included here; its *
+ * bundled copies of the nfnetlink headers clash with the kernel's uapi   */
+
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* tx_copy - appends a short-lived fragment to the datagram (by copy)
+ *  @txb : verdict batch
+ *  @src : fragment (NULL to append zeros)
+ *  @len : fragment length
+ *
+ *  @return : pointer to the copy inside the arena
+ *
+ * The caller must have ensured that there is enough room (tx_reserve).
+ * Adjacent arena fragments are merged into a single iovec entry.
+ */
+static uint8_t *tx_copy(struct tx_batch *txb, const void *src, size_t len)
+{
+    uint8_t      *dst  = txb->arena + txb->len;
+    struct iovec *last = txb->iovcnt ? &txb->iov[txb->iovcnt - 1] : NULL;
+
+    if (src)
+        memcpy(dst, src, len);
+    else
+        memset(dst, 0, len);
+
+    if (last && (uint8_t *) last->iov_base + last->iov_len == dst)
+        last->iov_len += len;
+    else {
+        txb->iov[txb->iovcnt].iov_base = dst;
+        txb->iov[txb->iovcnt].iov_len  = len;
+        txb->iovcnt++;
+    }
+
+    txb->len   += len;
+    txb->bytes += len;
+    return dst;
+}
+
+/* tx_ref - appends a fragment to the datagram by reference (no copy)
+ *  @txb : verdict batch
+ *  @src : fragment; must stay valid until the next flush
+ *  @len : fragment length
+ */
+static void tx_ref(struct tx_batch *txb, void *src, size_t len)
+{
+    if (!len)
+        return;
+
+    txb->iov[txb->iovcnt].iov_base = src;
+    txb->iov[txb->iovcnt].iov_len  = len;
+    txb->iovcnt++;
+
+    txb->bytes += len;
+}
+
+/* tx_reserve - makes sure that the next message fits in the datagram
+ *  @txb     : verdict batch
+ *  @msg_len : total message length
+ *  @cpy_len : bytes that will be copied into the arena
+ *  @iov_cnt : max number of iovec entries that will be used
+ *
+ *  @return : 0 if everything went ok
+ */
+static int tx_reserve(struct tx_batch *txb,
+                      size_t          msg_len,
+                      size_t          cpy_len,
+                      size_t          iov_cnt)
+{
+    int ans;
+
+    RET(msg_len > sizeof(txb->arena), 1, "Verdict too large (%zu)", msg_len);
+
+    if (txb->bytes  + msg_len > sizeof(txb->arena)
+    ||  txb->len    + cpy_len > sizeof(txb->arena)
+    ||  txb->iovcnt + iov_cnt > TX_IOV_MAX)
+    {
+        ans = tx_batch_flush(txb);
+        RET(ans, 1, "Unable to flush verdict batch");
+    }
+
+    return 0;
+}
+
+/* tx_batch_put - appends one verdict message to the datagram
+ *  @txb     : verdict batch
+ *  @type    : NFQNL_MSG_VERDICT or NFQNL_MSG_VERDICT_BATCH
+ *  @id      : packet id (for batch verdicts: highest id in the batch)
+ *  @verdict : netfilter verdict (NF_ACCEPT, NF_QUEUE | queue << 16, ...)
+ *  @sg      : modified packet or NULL if unchanged
+ *  @ct_mark : conntrack mark bits to set (see tx_batch_accept_ct())
+ *  @ct_mask : conntrack mark bits to change; 0 to leave the connection be
+ *
+ *  @return : 0 if everything went ok
+ *
+ * Flushes the datagram first if the new message does not fit. The head and
+ * tail of the packet are copied in, so they can be reused as soon as this
+ * function returns. The body is only referenced; it must stay valid until
+ * the next flush (the end of the current burst). A head that directly
+ * precedes the body (i.e.: headers grown in place) is referenced as well.
+ */
+static int tx_batch_put(struct tx_batch *txb,
+                        uint16_t        type,
+                        uint32_t        id,
+                        uint32_t        verdict,
+                        struct pkt_sg   *sg,
+                        uint32_t        ct_mark,
+                        uint32_t        ct_mask)
+{
+    struct nlmsghdr              nlh;
+    struct nfgenmsg              nfg;
+    struct nlattr                nla;
+    struct nfqnl_msg_verdict_hdr vh;
+    size_t                       pkt_len = 0;
+    size_t                       hdr_len;
+    size_t                       msg_len;
+    int                          ans;
+
+    /* calculate total (aligned) message length */
+    if (sg)
+        pkt_len = sg->head_len + sg->body_len + sg->tail_len;
+
+    hdr_len = NLMSG_HDRLEN
+            + NLMSG_ALIGN(sizeof(nfg))
+            + NLA_HDRLEN + NLA_ALIGN(sizeof(vh))
+            + (ct_mask ? NLA_HDRLEN + 2 * (NLA_HDRLEN + sizeof(ct_mark)) : 0)
+            + (sg ? NLA_HDRLEN : 0);
+    msg_len = hdr_len + (sg ? NLA_ALIGN(pkt_len) : 0);
+
+    /* make room if needed                                           *
+     * NOTE: head, tail and padding are copied; up to 4 iov entries */
+    ans = tx_reserve(txb, msg_len, hdr_len + (sg ? sg->head_len
+            + sg->tail_len + NLA_ALIGNTO : 0), 4);
+    RET(ans, 1, "Unable to make room for verdict");
+
+    /* netlink header */
+    nlh.nlmsg_len   = msg_len;
+    nlh.nlmsg_type  = (NFNL_SUBSYS_QUEUE << 8) | type;
+    nlh.nlmsg_flags = NLM_F_REQUEST;
+    nlh.nlmsg_seq   = ++txb->seq;
+    nlh.nlmsg_pid   = 0;
+    tx_copy(txb, &nlh, NLMSG_HDRLEN);
+
+    /* nfnetlink header */
+    nfg.nfgen_family = AF_UNSPEC;
+    nfg.version      = NFNETLINK_V0;
+    nfg.res_id       = htons(txb->q_num);
+    tx_copy(txb, &nfg, NLMSG_ALIGN(sizeof(nfg)));
+
+    /* verdict attribute */
+    nla.nla_type = NFQA_VERDICT_HDR;
+    nla.nla_len  = NLA_HDRLEN + sizeof(vh);
+    tx_copy(txb, &nla, NLA_HDRLEN);
+
+    vh.verdict = htonl(verdict);
+    vh.id      = htonl(id);
+    tx_copy(txb, &vh, NLA_ALIGN(sizeof(vh)));
+
+    /* conntrack attribute (if the connection is to be marked) */
+    if (ct_mask) {
+        nla.nla_type = NFQA_CT | NLA_F_NESTED;
+        nla.nla_len  = NLA_HDRLEN + 2 * (NLA_HDRLEN + sizeof(ct_mark));
+        tx_copy(txb, &nla, NLA_HDRLEN);
+
+        nla.nla_type = CTA_MARK;
+        nla.nla_len  = NLA_HDRLEN + sizeof(ct_mark);
+        ct_mark      = htonl(ct_mark);
+        tx_copy(txb, &nla, NLA_HDRLEN);
+        tx_copy(txb, &ct_mark, sizeof(ct_mark));
+
+        nla.nla_type = CTA_MARK_MASK;
+        nla.nla_len  = NLA_HDRLEN + sizeof(ct_mask);
+        ct_mask      = htonl(ct_mask);
+        tx_copy(txb, &nla, NLA_HDRLEN);
+        tx_copy(txb, &ct_mask, sizeof(ct_mask));
+    }
+
+    /* payload attribute (if packet was modified) */
+    if (sg) {
+        nla.nla_type = NFQA_PAYLOAD;
+        nla.nla_len  = NLA_HDRLEN + pkt_len;
+        tx_copy(txb, &nla, NLA_HDRLEN);
+
+        if (sg->head + sg->head_len == sg->body)
+            tx_ref(txb, sg->head, sg->head_len + sg->body_len);
+        else {
+            tx_copy(txb, sg->head, sg->head_len);
+            tx_ref(txb, sg->body, sg->body_len);
+        }
+        if (sg->tail_len)
+            tx_copy(txb, sg->tail, sg->tail_len);
+        if (NLA_ALIGN(pkt_len) != pkt_len)
+            tx_copy(txb, NULL, NLA_ALIGN(pkt_len) - pkt_len);
+    }
+
+    return 0;
+}
+
+/* tx_batch_end_run - emits the pending run of unchanged accepts (if any)
+ *  @txb : verdict batch
+ *
+ *  @return : 0 if everything went ok
+ *
+ * A run of one is sent as a regular verdict. Longer runs are collapsed into
+ * a single NFQNL_MSG_VERDICT_BATCH (what nfq_set_verdict_batch() sends). The
+ * kernel applies it to every queued packet with an id up to run_id; this is
+ * correct because all earlier packets were already given a verdict by the
+ * messages that precede it in the same datagram.
+ */
+static int tx_batch_end_run(struct tx_batch *txb)
+{
+    uint32_t run_len = txb->run_len;
+
+    if (!run_len)
+        return 0;
+
+    /* clear run before tx_batch_put() gets a chance to flush */
+    txb->run_len = 0;
+
+    return tx_batch_put(txb, run_len == 1 ? NFQNL_MSG_VERDICT
+            : NFQNL_MSG_VERDICT_BATCH, txb->run_id, NF_ACCEPT, NULL, 0, 0);
+}
+
+/******************************************************************************
+ ****************************** PUBLIC FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* rx_slot_iov - sets up the receive iovecs of one message
+ *  @iov   : two iovecs
+ *  @mtu   : POOL_MTU slot
+ *  @jumbo : POOL_JUMBO slot
+ *
+ * The message starts RX_HEADROOM bytes into the mtu slot. Whatever does not
+ * fit there goes to the jumbo slot, at the same offset that it would have
+ * had if the message had been received there whole (see rx_slot_join()).
+ */
+void rx_slot_iov(struct iovec *iov, uint8_t *mtu, uint8_t *jumbo)
+{
+    iov[0].iov_base = mtu + RX_HEADROOM;
+    iov[0].iov_len  = RX_MTU_SZ - RX_HEADROOM;
+    iov[1].iov_base = jumbo + RX_MTU_SZ;
+    iov[1].iov_len  = RX_SLOT_SZ - iov[0].iov_len;
+}
+
+/* rx_slot_join - finds the slot holding a received message
+ *  @mtu   : POOL_MTU slot
+ *  @jumbo : POOL_JUMBO slot
+ *  @len   : message length
+ *  @end   : set to the end of the returned slot
+ *
+ *  @return : slot; the message starts RX_HEADROOM bytes into it
+ *
+ * A message that spilled over into the jumbo slot is made contiguous by
+ * moving its start there as well (at most one mtu slot is copied).
+ */
+uint8_t *rx_slot_join(uint8_t *mtu, uint8_t *jumbo, size_t len, uint8_t **end)
+{
+    if (likely(len <= RX_MTU_SZ - RX_HEADROOM)) {
+        *end = mtu + RX_MTU_SZ;
+        return mtu;
+    }
+
+    memcpy(jumbo + RX_HEADROOM, mtu + RX_HEADROOM, RX_MTU_SZ - RX_HEADROOM);
+    *end = jumbo + RX_JUMBO_SZ;
+    return jumbo;
+}
+
+/* rx_batch_init - gives each message header its own receive slots
+ *  @rxb  : receive batch
+ *  @pool : buffer pool w/ at least BATCH_MAX slots of each class
+ *
+ *  @return : 0 if everything went ok
+ *
+ * The slots are held for as long as the batch is in use; every burst is
+ * done with (i.e.: its verdicts are sent) before the next one is received.
+ */
+int rx_batch_init(struct rx_batch *rxb, struct pool *pool)
+{
+    memset(rxb, 0, sizeof(*rxb));
+
+    for (size_t i = 0; i < BATCH_MAX; i++) {
+        rxb->mtu[i]   = pool_get(pool, POOL_MTU);
+        rxb->jumbo[i] = pool_get(pool, POOL_JUMBO);
+        RET(!rxb->mtu[i] || !rxb->jumbo[i], 1, "Buffer pool too small");
+
+        rx_slot_iov(rxb->iov[i], rxb->mtu[i], rxb->jumbo[i]);
+
+        rxb->msgs[i].msg_hdr.msg_iov    = rxb->iov[i];
+        rxb->msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
+    return 0;
+}
+
+/* rx_batch_recv - receives a burst of netlink messages
+ *  @rxb : receive batch
+ *  @fd  : nfq netlink socket
+ *  @n   : max number of messages to receive (at most BATCH_MAX)
+ *
+ *  @return : number of messages received or -1 on error (errno is set)
+ *
+ * Blocks until at least one message is available, then takes whatever else
+ * is already queued on the socket without blocking (MSG_WAITFORONE). The
+ * length of message i is rxb->msgs[i].msg_len; it starts RX_HEADROOM bytes
+ * into rxb->slot[i].
+ */
+int rx_batch_recv(struct rx_batch *rxb, int32_t fd, uint32_t n)
+{
+    int ans;
+
+    ans = recvmmsg(fd, rxb->msgs, n < BATCH_MAX ? n : BATCH_MAX,
+            MSG_WAITFORONE, NULL);
+
+    for (int i = 0; i < ans; i++)
+        rxb->slot[i] = rx_slot_join(rxb->mtu[i], rxb->jumbo[i],
+                           rxb->msgs[i].msg_len, &rxb->end[i]);
+
+    return ans;
+}
+
+/* tx_batch_init - initializes an empty verdict batch
+ *  @txb   : verdict batch
+ *  @fd    : nfq netlink socket
+ *  @q_num : queue number the verdicts refer to
+ *
+ *  @return : 0 if everything went ok
+ *
+ * Netlink refuses datagrams larger than the socket's send buffer, so it is
+ * grown to fit a full arena (SO_SNDBUFFORCE ignores wmem_max; needs root).
+ */
+int tx_batch_init(struct tx_batch *txb, int32_t fd, uint16_t q_num)
+{
+    int32_t sndbuf = 2 * sizeof(txb->arena);
+    int     ans;
+
+    txb->fd      = fd;
+    txb->q_num   = q_num;
+    txb->seq     = 0;
+    txb->run_id  = 0;
+    txb->run_len = 0;
+    txb->len     = 0;
+    txb->bytes   = 0;
+    txb->iovcnt  = 0;
+    txb->ooo     = 0;
+
+    ans = setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &sndbuf, sizeof(sndbuf));
+    RET(ans == -1, 1, "Unable to set socket send buffer (%s)",
+        strerror(errno));
+
+    return 0;
+}
+
+/* tx_batch_accept - queues an NF_ACCEPT verdict for an unchanged packet
+ *  @txb : verdict batch
+ *  @id  : packet id
+ *
+ *  @return : 0 if everything went ok
+ *
+ * Consecutive unchanged packets are merged into a single batch verdict,
+ * unless verdicts are issued out of order (txb->ooo); a batch verdict would
+ * also cover earlier packets that are still being processed.
+ */
+int tx_batch_accept(struct tx_batch *txb, uint32_t id)
+{
+    if (txb->ooo)
+        return tx_batch_put(txb, NFQNL_MSG_VERDICT, id, NF_ACCEPT, NULL,
+                   0, 0);
+
+    txb->run_id = id;
+    txb->run_len++;
+
+    return 0;
+}
+
+/* tx_batch_accept_ct - queues an NF_ACCEPT verdict that marks a connection
+ *  @txb  : verdict batch
+ *  @id   : packet id (unchanged packet)
+ *  @mark : conntrack mark bits to set
+ *  @mask : conntrack mark bits to change (mark & ~mask must be 0)
+ *
+ *  @return : 0 if everything went ok
+ *
+ * The kernel sets the mark of the packet's connection to (old & ~mask) |
+ * mark; a connmark rule in front of the NFQUEUE one can then keep the rest
+ * of the connection out of the queue. Needs NFQA_CFG_F_CONNTRACK on the
+ * queue (it loads the kernel's conntrack glue) & is ignored for packets w/o
+ * a connection. Batch verdicts can't carry the mark, so this ends the run.
+ */
+int tx_batch_accept_ct(struct tx_batch *txb,
+                       uint32_t        id,
+                       uint32_t        mark,
+                       uint32_t        mask)
+{
+    int ans;
+
+    /* preserve verdict order */
+    ans = tx_batch_end_run(txb);
+    RET(ans, 1, "Unable to queue batch verdict");
+
+    return tx_batch_put(txb, NFQNL_MSG_VERDICT, id, NF_ACCEPT, NULL, mark,
+               mask);
+}
+
+/* tx_batch_verdict - queues a verdict (w/ contiguous modified packet)
+ *  @txb     : verdict batch
+ *  @id      : packet id
+ *  @verdict : netfilter verdict
+ *  @pkt     : modified packet (copied; may be reused after return)
+ *  @pkt_len : length of modified packet
+ *
+ *  @return : 0 if everything went ok
+ */
+int tx_batch_verdict(struct tx_batch *txb,
+                     uint32_t        id,
+                     uint32_t        verdict,
+                     uint8_t         *pkt,
+                     size_t          pkt_len)
+{
+    struct pkt_sg sg = {
+        .head = pkt,  .head_len = pkt_len,
+        .body = NULL, .body_len = 0,
+        .tail = NULL, .tail_len = 0,
+    };
+
+    return tx_batch_verdict_sg(txb, id, verdict, &sg);
+}
+
+/* tx_batch_verdict_sg - queues a verdict (w/ scatter-gather modified packet)
+ *  @txb     : verdict batch
+ *  @id      : packet id
+ *  @verdict : netfilter verdict
+ *  @sg      : modified packet; the body is not copied and must stay valid
+ *             until the next flush
+ *
+ *  @return : 0 if everything went ok
+ */
+int tx_batch_verdict_sg(struct tx_batch *txb,
+                        uint32_t        id,
+                        uint32_t        verdict,
+                        struct pkt_sg   *sg)
+{
+    int ans;
+
+    /* preserve verdict order */
+    ans = tx_batch_end_run(txb);
+    RET(ans, 1, "Unable to queue batch verdict");
+
+    return tx_batch_put(txb, NFQNL_MSG_VERDICT, id, verdict, sg, 0, 0);
+}
+
+/* tx_batch_seal - closes the datagram so that it can be sent
+ *  @txb : verdict batch
+ *  @msg : set to the datagram's message header or NULL if there is nothing
+ *         to send
+ *
+ *  @return : 0 if everything went ok
+ *
+ * The message header lives inside txb. Neither it nor the arena or any
+ * referenced body may be touched until the datagram was sent and the batch
+ * reset; this lets the send be performed asynchronously (see uring.cpp).
+ */
+int tx_batch_seal(struct tx_batch *txb, struct msghdr **msg)
+{
+    int ans;
+
+    *msg = NULL;
+
+    /* a pending run must make it into this datagram */
+    if (txb->run_len) {
+        ans = tx_batch_end_run(txb);
+        RET(ans, 1, "Unable to queue batch verdict");
+    }
+
+    if (!txb->iovcnt)
+        return 0;
+
+    memset(&txb->snl, 0, sizeof(txb->snl));
+    txb->snl.nl_family = AF_NETLINK;
+
+    memset(&txb->msg, 0, sizeof(txb->msg));
+    txb->msg.msg_name    = &txb->snl;
+    txb->msg.msg_namelen = sizeof(txb->snl);
+    txb->msg.msg_iov     = txb->iov;
+    txb->msg.msg_iovlen  = txb->iovcnt;
+
+    *msg = &txb->msg;
+    return 0;
+}
+
+/* tx_batch_reset - empties a (sent) verdict batch
+ *  @txb : verdict batch
+ */
+void tx_batch_reset(struct tx_batch *txb)
+{
+    txb->len    = 0;
+    txb->bytes  = 0;
+    txb->iovcnt = 0;
+}
+
+/* tx_batch_flush - sends all queued verdicts in one datagram (one syscall)
+ *  @txb : verdict batch
+ *
+ *  @return : 0 if everything went ok
+ */
+int tx_batch_flush(struct tx_batch *txb)
+{
+    struct msghdr *msg;
+    ssize_t       ans;
+
+    ans = tx_batch_seal(txb, &msg);
+    RET(ans, 1, "Unable to seal verdict batch");
+
+    if (!msg)
+        return 0;
+
+    ans = sendmsg(txb->fd, msg, 0);
+    tx_batch_reset(txb);
+    RET(ans == -1, 1, "Unable to send verdict batch (%s)", strerror(errno));
+
+    return 0;
+}
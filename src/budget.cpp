@@ -0,0 +1,370 @@
+/*
+ * Copyright © 2021, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of ops-inject.
+ *
+ * ops-inject is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ops-inject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>            /* fopen, fread           */
+#include <stdint.h>           /* [u]int*_t              */
+#include <stdlib.h>           /* calloc, strtoul        */
+#include <string.h>           /* strncmp, strcspn       */
+#include <errno.h>            /* errno                  */
+#include <arpa/inet.h>        /* ntohl                  */
+
+#include "budget.h"
+#include "cli_args.h"
+#include "util.h"
+
+/* shared config; written by the main thread only (seqlock) */
+static struct budget_cfg shared;
+static uint32_t          shared_seq;
+
+/* report requests (see budget_request_report()) */
+static uint32_t          shared_reports;
+
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* budget_show - prints a budget config
+ *  @cfg : config
+ */
+static void budget_show(const struct budget_cfg *cfg)
+{
+    INFO("Budget: first=%u sample=%u rate=%u/%u prefix=/%hhu", cfg->first,
+         cfg->sample, cfg->rate, cfg->burst, cfg->prefix);
+}
+
+/* budget_num - parses the numeric value of a budget spec field
+ *  @str : value
+ *  @end : set to the first character after the value
+ *  @max : largest accepted value
+ *  @val : set to the value
+ *
+ *  @return : 0 if everything went ok
+ */
+static int budget_num(const char *str, char **end, uint32_t max,
+                      uint32_t *val)
+{
+    unsigned long ans;
+
+    errno = 0;
+    ans   = strtoul(str, end, 10);
+    RET(*end == str || errno || ans > max, 1, "Invalid budget value \"%s\"",
+        str);
+
+    *val = ans;
+    return 0;
+}
+
+/******************************************************************************
+ ****************************** PUBLIC FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* budget_parse - parses a budget spec
+ *  @spec : comma separated list of
+ *            first=N           : first N packets of each flow
+ *            sample=K          : 1 in K packets of each flow
+ *            rate=PPS[/BURST]  : per destination prefix (burst: PPS)
+ *            prefix=LEN        : destination prefix length (default: 24)
+ *          or "none" (annotate everything)
+ *  @cfg  : set to the parsed config; untouched on error
+ *
+ *  @return : 0 if everything went ok
+ */
+int budget_parse(const char *spec, struct budget_cfg *cfg)
+{
+    struct budget_cfg tmp = { .prefix = 24 };
+    uint32_t          burst = 0, prefix = 24;
+    const char        *it = spec;
+    char              *end;
+    size_t            len;
+    int               ans;
+
+    if (!strncmp(spec, "none", 5)) {
+        *cfg = tmp;
+        return 0;
+    }
+
+    while (*it) {
+        len = strcspn(it, "=");
+        RET(!it[len], 1, "Budget field w/o value \"%s\"", it);
+
+        if (len == 5 && !strncmp(it, "first", len))
+            ans = budget_num(it + len + 1, &end, UINT32_MAX, &tmp.first);
+        else if (len == 6 && !strncmp(it, "sample", len))
+            ans = budget_num(it + len + 1, &end, UINT32_MAX, &tmp.sample);
+        else if (len == 4 && !strncmp(it, "rate", len)) {
+            ans = budget_num(it + len + 1, &end, UINT32_MAX, &tmp.rate);
+            if (!ans && *end == '/')
+                ans = budget_num(end + 1, &end, UINT32_MAX, &burst);
+        } else if (len == 6 && !strncmp(it, "prefix", len))
+            ans = budget_num(it + len + 1, &end, 32, &prefix);
+        else
+            RET(1, 1, "Unknown budget field \"%.*s\"", (int) len, it);
+
+        RET(ans, 1, "Invalid budget spec \"%s\"", spec);
+        RET(*end && *end != ',', 1, "Invalid budget spec \"%s\"", spec);
+
+        it = *end ? end + 1 : end;
+    }
+
+    tmp.burst  = tmp.rate ? (burst ? : tmp.rate) : 0;
+    tmp.prefix = prefix;
+
+    *cfg = tmp;
+    return 0;
+}
+
+/* budget_publish - replaces the shared config
+ *  @cfg : new config
+ *
+ * Must only be called by one thread at a time (the main thread). The other
+ * threads pick it up at their next budget_sync().
+ */
+void budget_publish(const struct budget_cfg *cfg)
+{
+    __atomic_store_n(&shared_seq, shared_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&shared.first,  cfg->first,  __ATOMIC_RELAXED);
+    __atomic_store_n(&shared.sample, cfg->sample, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared.rate,   cfg->rate,   __ATOMIC_RELAXED);
+    __atomic_store_n(&shared.burst,  cfg->burst,  __ATOMIC_RELAXED);
+    __atomic_store_n(&shared.prefix, cfg->prefix, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&shared_seq, shared_seq + 1, __ATOMIC_RELEASE);
+
+    budget_show(cfg);
+}
+
+/* budget_load - (re)reads the budget spec from a file & publishes it
+ *  @path : file w/ a budget spec (see budget_parse()) on its first line
+ *
+ *  @return : 0 if everything went ok; the previous config is kept otherwise
+ */
+int budget_load(const char *path)
+{
+    struct budget_cfg cfg;
+    char              spec[BUDGET_SPEC_MAX];
+    FILE              *f;
+    size_t            len;
+    int               ans;
+
+    f = fopen(path, "r");
+    RET(!f, 1, "Unable to open %s (%s)", path, strerror(errno));
+
+    len = fread(spec, 1, sizeof(spec) - 1, f);
+    fclose(f);
+
+    spec[len] = '\0';
+    spec[strcspn(spec, " \t\r\n")] = '\0';
+
+    ans = budget_parse(spec, &cfg);
+    RET(ans, 1, "Keeping the previous budget");
+
+    budget_publish(&cfg);
+    return 0;
+}
+
+/* budget_flows - checks if the budget needs flows to be tracked
+ *  @return : !0 if a per-flow policy is set or may be set later
+ */
+uint8_t budget_flows(void)
+{
+    return args.budget
+        && (shared.first || shared.sample || args.budget_file);
+}
+
+/* budget_request_report - asks every thread to print its budget counters
+ *
+ * Each thread prints them at its next budget_sync(), i.e.: its next burst.
+ */
+void budget_request_report(void)
+{
+    __atomic_fetch_add(&shared_reports, 1, __ATOMIC_RELAXED);
+}
+
+/* budget_create - allocates the budget state of one thread
+ *  @name : owner (for display)
+ *  @idx  : owner index (for display)
+ *
+ *  @return : budget state or NULL on error
+ *
+ * The shared config is picked up by the first budget_sync().
+ */
+struct budget *budget_create(const char *name, uint32_t idx)
+{
+    struct budget *bg;
+
+    bg = (struct budget *) calloc(1, sizeof(*bg));
+    RET(!bg, NULL, "Unable to allocate budget");
+
+    bg->name    = name;
+    bg->idx     = idx;
+    bg->reports = __atomic_load_n(&shared_reports, __ATOMIC_RELAXED);
+
+    return bg;
+}
+
+/* budget_destroy - releases the budget state of a thread
+ *  @bg : budget state (may be NULL)
+ */
+void budget_destroy(struct budget *bg)
+{
+    free(bg);
+}
+
+/* budget_sync - picks up config changes & report requests
+ *  @bg : budget state (may be NULL)
+ *
+ * Costs one load when nothing changed; meant to be called once per burst.
+ * A config that is being written is picked up by a later call. Token
+ * buckets start over when the rate or the prefix length changes.
+ */
+void budget_sync(struct budget *bg)
+{
+    struct budget_cfg cfg;
+    uint32_t          seq, reports;
+
+    if (!bg)
+        return;
+
+    reports = __atomic_load_n(&shared_reports, __ATOMIC_RELAXED);
+    if (unlikely(reports != bg->reports)) {
+        bg->reports = reports;
+        budget_report(bg);
+    }
+
+    seq = __atomic_load_n(&shared_seq, __ATOMIC_ACQUIRE);
+    if (likely(seq == bg->seq) || seq & 1)
+        return;
+
+    cfg.first  = __atomic_load_n(&shared.first,  __ATOMIC_RELAXED);
+    cfg.sample = __atomic_load_n(&shared.sample, __ATOMIC_RELAXED);
+    cfg.rate   = __atomic_load_n(&shared.rate,   __ATOMIC_RELAXED);
+    cfg.burst  = __atomic_load_n(&shared.burst,  __ATOMIC_RELAXED);
+    cfg.prefix = __atomic_load_n(&shared.prefix, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shared_seq, __ATOMIC_RELAXED) != seq)
+        return;
+
+    if (cfg.rate != bg->cfg.rate || cfg.burst != bg->cfg.burst
+        || cfg.prefix != bg->cfg.prefix)
+        memset(bg->tb, 0, sizeof(bg->tb));
+
+    bg->cfg       = cfg;
+    bg->seq       = seq;
+    bg->mask      = cfg.prefix ? ~0U << (32 - cfg.prefix) : 0;
+    bg->interval  = cfg.rate ? 1000000000UL / cfg.rate : 0;
+    bg->tolerance = cfg.burst ? bg->interval * (cfg.burst - 1) : 0;
+}
+
+/* budget_report - prints the budget counters of a thread
+ *  @bg : budget state (may be NULL)
+ */
+void budget_report(struct budget *bg)
+{
+    if (!bg)
+        return;
+
+    INFO("%s %u budget: admitted=%lu over: first=%lu sample=%lu rate=%lu "
+         "spent=%lu", bg->name, bg->idx, bg->admitted, bg->over_first,
+         bg->over_sample, bg->over_rate, bg->spent);
+}
+
+/* budget_admit - decides if a packet is annotated
+ *  @bg  : budget state
+ *  @iph : packet (ip header already checked)
+ *  @f   : packet's flow (or NULL if not tracked)
+ *  @now : time of processing
+ *
+ *  @return : !0 if the packet is within budget
+ *
+ * The per-flow policies count the flow's packets, including the ones that
+ * were not annotated; w/o a flow, "first" admits everything and "sample"
+ * counts the thread's packets instead. A packet only takes a token once
+ * the other policies have admitted it.
+ *
+ * Token buckets are direct mapped by prefix; a prefix that collides w/ the
+ * one in its slot takes the slot over w/ a full bucket. This keeps memory
+ * fixed at the cost of some leniency under many active prefixes.
+ */
+uint8_t budget_admit(struct budget *bg, struct iphdr *iph, struct flow *f,
+                     const struct timespec *now)
+{
+    struct budget_tb *tb;
+    uint64_t         t;
+    uint32_t         net, pkts;
+
+    /* first N per flow */
+    if (bg->cfg.first && f && f->pkts > bg->cfg.first) {
+        bg->over_first++;
+        return 0;
+    }
+
+    /* 1 in K (per flow if possible) */
+    if (bg->cfg.sample > 1) {
+        pkts = f ? f->pkts - 1 : bg->n++;
+        if (pkts % bg->cfg.sample) {
+            bg->over_sample++;
+            return 0;
+        }
+    }
+
+    /* token bucket of the destination prefix */
+    if (bg->cfg.rate) {
+        net = ntohl(iph->daddr) & bg->mask;
+        tb  = &bg->tb[(net * 0x9e3779b1U) >> 20 & (BUDGET_TB_SLOTS - 1)];
+        t   = (uint64_t) now->tv_sec * 1000000000UL + now->tv_nsec;
+
+        if (!tb->used || tb->net != net) {
+            tb->net  = net;
+            tb->used = 1;
+            tb->tat  = t;
+        }
+
+        if (t + bg->tolerance < tb->tat) {
+            bg->over_rate++;
+            return 0;
+        }
+
+        tb->tat = (tb->tat > t ? tb->tat : t) + bg->interval;
+    }
+
+    bg->admitted++;
+    return 1;
+}
+
+/* budget_spent - checks if a flow just ran out of budget for good
+ *  @bg : budget state
+ *  @f  : flow of a packet that budget_admit() turned down (or NULL)
+ *
+ *  @return : !0 for the first packet past the flow's first N
+ *
+ * No later packet of the flow will be admitted (unless the flow is forgotten
+ * or the config changes), so its connection may skip the queue from then on
+ * (see --ct-mark). The other policies may admit later packets again.
+ */
+uint8_t budget_spent(struct budget *bg, struct flow *f)
+{
+    if (!bg->cfg.first || !f || f->pkts != bg->cfg.first + 1)
+        return 0;
+
+    bg->spent++;
+    return 1;
+}
@@ -20,32 +20,116 @@
 #include <string.h>         /* strncmp                   */
 #include <sys/stat.h>       /* fstat                     */
 #include <errno.h>          /* errno                     */
-#include <stdlib.h>         /* malloc                    */
+#include <stdlib.h>         /* malloc, strtoul           */
 #include <fcntl.h>          /* open                      */
 #include <unistd.h>         /* read, close               */
+#include <netinet/in.h>     /* IPPROTO_*                 */
 
+extern "C" {
+#include "ops_ip.h"         /* ip_ops_shrink             */
+}
+
+#include "batch.h"
+#include "pipeline.h"
 #include "decoders.h"
 #include "reassemblers.h"
+#include "annotate.h"
+#include "flow.h"
+#include "budget.h"
+#include "pmtu.h"
 #include "cli_args.h"
 #include "util.h"
 
+/* long-only options */
+#define OPT_OFFLINE 0x100
+#define OPT_OUT     0x101
+#define OPT_FULL    0x102
+#define OPT_CLOCK   0x103
+#define OPT_FLOWS   0x104
+#define OPT_FLOW_TO 0x105
+#define OPT_BUDGET  0x106
+#define OPT_BG_FILE 0x107
+#define OPT_PMTU    0x108
+#define OPT_MTU     0x109
+#define OPT_CT_MARK 0x10a
+
 /* argp API global variables */
 const char *argp_program_version     = "version 1.0";
 const char *argp_program_bug_address = "<andru.mantu@gmail.com>";
 
 /* command line arguments */
 static struct argp_option options[] = {
-    { "proto",     'p', "{ip|tcp|udp}", 0,
-      "Target protocol" },
+    { "proto",     'p', "{ip|tcp|udp}[,...]", 0,
+      "Target protocol; a list adds each one's ops in the same pass, w/ one "
+      "FILE per protocol, in the same order" },
     { "queue",     'q', "NUM", 0,
       "Netfilter queue number"},
+    { "queues",    'Q', "N-M", 0,
+      "Netfilter queue range; one worker thread per queue" },
+    { "pin",       'c', NULL, 0,
+      "Pin each worker to the cpu feeding its queue (default: no)" },
+    { "gso",       'g', NULL, 0,
+      "Accept GSO/TSO super-packets; offloads can stay on (default: no)" },
+    { "batch",     'b', "NUM", 0,
+      "Max packets received & verdicts sent per syscall (default: 32)" },
     { "redirect",  'r', "NUM", 0,
       "Target queue redirection (default: disabled)" },
     { "overwrite", 'w', NULL, 0,
       "Overwrite existing ops (default: no)" },
+    { "rcvbuf",    'B', "BYTES", 0,
+      "Socket receive buffer; grows on overruns (default: 8388608)" },
+    { "maxlen",    'm', "NUM", 0,
+      "Min kernel queue length; grows with drain rate (default: 1024)" },
+    { "fail-open", 'f', NULL, 0,
+      "Accept packets that overflow the kernel queue (default: no)" },
+    { "high-water", 'H', "PCT", 0,
+      "Socket backlog at which packets pass w/o decoding (default: 75)" },
+    { "pipeline",  'P', "NUM", 0,
+      "Decode on NUM threads per queue, besides rx & verdicts (default: 0)" },
+    { "uring",     'u', NULL, 0,
+      "Use the io_uring event loop; needs a build w/ URING=1 (default: no)" },
+    { "offline",   OPT_OFFLINE, "PCAP", 0,
+      "Annotate a capture instead of a live queue; no root needed" },
+    { "out",       OPT_OUT, "PCAP", 0,
+      "Where to write the annotated capture (default: nowhere)" },
+    { "full-csum", OPT_FULL, NULL, 0,
+      "Recompute checksums instead of updating them; fixes bad input "
+      "checksums (default: no)" },
+    { "clock",     OPT_CLOCK, "{coarse|tsc|packet}", 0,
+      "Time source for timestamp ops: sampled per burst (coarse, tsc) or "
+      "the kernel's receive time, if set (packet) (default: coarse)" },
+    { "flows",     OPT_FLOWS, "NUM", 0,
+      "Max tracked flows per thread; 0 disables tracking (default: 65536 if "
+      "an op needs per-flow state, else 0)" },
+    { "flow-timeout", OPT_FLOW_TO, "SEC", 0,
+      "Idle time after which a flow is forgotten (default: 120)" },
+    { "budget",    OPT_BUDGET, "SPEC", 0,
+      "Annotate only the packets within budget; SPEC is a comma separated "
+      "list of first=N (per flow), sample=K (1 in K per flow), "
+      "rate=PPS[/BURST] & prefix=LEN (per destination prefix) "
+      "(default: none)" },
+    { "budget-file", OPT_BG_FILE, "FILE", 0,
+      "Read the budget SPEC from FILE; re-read on SIGHUP. Counters are "
+      "printed on SIGUSR2" },
+    { "pmtu",      OPT_PMTU, "{skip|shrink|frag}", 0,
+      "Keep annotated packets within the path mtu of their destination: "
+      "pass the ones that don't fit unchanged (skip), shorten variable "
+      "length ops (shrink) or clear DF so they are fragmented (frag) "
+      "(default: no checks)" },
+    { "mtu",       OPT_MTU, "BYTES", 0,
+      "Path mtu assumed when the kernel has no route (always, offline) "
+      "(default: 1500)" },
+    { "ct-mark",   OPT_CT_MARK, "MARK[/MASK]", 0,
+      "Set MARK on the connection of a flow that is past its first=N budget, "
+      "so that a connmark rule can keep the rest of it out of the queue "
+      "(default: disabled)" },
     { 0 }
 };
 
+/* layers given to -p, in order (i.e.: the order of the ops files) */
+static uint8_t layer_order[LAYER_MAX];
+static uint8_t n_layers;
+
 /* argument parser prototype */
 static error_t parse_opt(int, char *, struct argp_state *);
 
@@ -57,19 +141,62 @@ static char doc[] = "ops-inject -- injects user defined ops into specific header
     "\vExample usage:\n"
     "\t# iptables -I OUTPUT -p icmp -j NFQUEUE --queue-num 0 --queue-bypass\n"
     "\t# ./bin/ops-inject -p ip -q 0 -w <(printf '\\x07')\n"
-    "\t$ ping $(dig +short digitalocean.com | head -n 1)";
+    "\t$ ping $(dig +short digitalocean.com | head -n 1)\n"
+    "\nMulti-queue usage:\n"
+    "\t# iptables -I OUTPUT -p icmp -j NFQUEUE --queue-balance 0:3 "
+    "--queue-cpu-fanout --queue-bypass\n"
+    "\t# ./bin/ops-inject -p ip -Q 0-3 -c -w <(printf '\\x07')\n"
+    "\nMulti-layer usage:\n"
+    "\t# iptables -I OUTPUT -p tcp -j NFQUEUE --queue-num 0 --queue-bypass\n"
+    "\t# ./bin/ops-inject -p ip,tcp -q 0 -w <(printf '\\x07') "
+    "<(printf '\\x01\\x01\\x01\\x01')\n"
+    "\nConnmark bypass usage:\n"
+    "\t# iptables -I OUTPUT -p tcp -j NFQUEUE --queue-num 0 --queue-bypass\n"
+    "\t# iptables -I OUTPUT -m connmark --mark 0x100/0x100 -j ACCEPT\n"
+    "\t# ./bin/ops-inject -p ip -q 0 --budget=first=3 "
+    "--ct-mark=0x100/0x100 <(printf '\\x07')\n"
+    "\nOffline usage:\n"
+    "\t$ ./bin/ops-inject -p ip -w --offline in.pcap --out out.pcap "
+    "<(printf '\\x07')";
 
 /* declaration of relevant structures */
 struct argp      argp = { options, parse_opt, args_doc, doc };
 struct arguments args = {
     .q_num     = 0,
+    .q_last    = 0,
     .nq_num    = 0,
     .redirect  = 0,
     .overwrite = 0,
-    .ops       = NULL,
-    .ops_len   = 0,
+    .pin_cpu   = 0,
+    .gso       = 0,
+    .batch     = 32,
+    .rcvbuf    = 8 << 20,
+    .maxlen    = 1024,
+    .fail_open = 0,
+    .hwm       = 75,
+    .uring     = 0,
+    .pipeline  = 0,
+    .offline   = NULL,
+    .out       = NULL,
+    .full_csum = 0,
+    .proto     = 0,
+    .layers    = 0,
+    .clock     = CLK_COARSE,
+    .flows     = FLOW_AUTO,
+    .flow_timeout = FLOW_DEF_TMO,
+    .budget    = 0,
+    .budget_file = NULL,
+    .pmtu      = PMTU_OFF,
+    .mtu       = PMTU_DEF,
+    .ct_mark   = 0,
+    .ct_mask   = 0,
+    .ops       = { },
+    .ops_len   = { },
     .decoder   = NULL,
     .reasmbl   = NULL,
+    .reasmbl_sg = NULL,
+    .annotate   = NULL,
+    .annotate_burst = NULL,
 };
 
 /* parse_opt - parses one argument and updates relevant structures
@@ -81,28 +208,89 @@ struct arguments args = {
  */
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
-    struct stat statbuf;
-    int         fd, ans;
-    ssize_t     rb;
+    const struct annotate_mode *mode;
+    struct budget_cfg          budget;
+    struct stat                statbuf;
+    const char                 *it;
+    char                       *end;
+    size_t                     len;
+    int                        fd, ans;
+    ssize_t                    rb;
+    uint8_t                    layer = 0;
 
     switch (key) {
         /* protocol */
         case 'p':
-            if (!strncmp(arg, "ip", 3)) {
+            args.layers = 0;
+            n_layers    = 0;
+
+            for (it = arg; *it; it += len + !!it[len]) {
+                len = strcspn(it, ",");
+                if (len == 2 && !strncmp(it, "ip", len))
+                    layer = LAYER_IP;
+                else if (len == 3 && !strncmp(it, "tcp", len))
+                    layer = LAYER_TCP;
+                else if (len == 3 && !strncmp(it, "udp", len))
+                    layer = LAYER_UDP;
+                else
+                    return ARGP_ERR_UNKNOWN;
+
+                if (args.layers & 1 << layer)
+                    return ARGP_ERR_UNKNOWN;
+                args.layers |= 1 << layer;
+                layer_order[n_layers++] = layer;
+            }
+
+            /* several layers are annotated in one pass (see annotate.cpp) */
+            args.decoder    = NULL;
+            args.reasmbl    = NULL;
+            args.reasmbl_sg = NULL;
+            if (n_layers != 1)
+                break;
+
+            if (layer == LAYER_IP) {
+                args.proto   = IPPROTO_IP;
                 args.decoder = decode_ip_ops;
                 args.reasmbl = reassemble_ip;
-            } else if (!strncmp(arg, "tcp", 4)) {
+                args.reasmbl_sg = reassemble_ip_sg;
+            } else if (layer == LAYER_TCP) {
+                args.proto   = IPPROTO_TCP;
                 args.decoder = decode_tcp_ops;
                 args.reasmbl = reassemble_tcp;
-            } else if (!strncmp(arg, "udp", 4)) {
+                args.reasmbl_sg = reassemble_tcp_sg;
+            } else {
+                args.proto   = IPPROTO_UDP;
                 args.decoder = decode_udp_ops;
                 args.reasmbl = reassemble_udp;
-            } else
-                return ARGP_ERR_UNKNOWN;
+                args.reasmbl_sg = reassemble_udp_sg;
+            }
             break;
         /* queue number */
         case 'q':
             sscanf(arg, "%hd", &args.q_num);
+            args.q_last = args.q_num;
+            break;
+        /* queue range (one worker per queue) */
+        case 'Q':
+            ans = sscanf(arg, "%hu-%hu", &args.q_num, &args.q_last);
+            if (ans == 1)
+                args.q_last = args.q_num;
+            else if (ans != 2)
+                return ARGP_ERR_UNKNOWN;
+            break;
+        /* cpu pinning */
+        case 'c':
+            args.pin_cpu = 1;
+            break;
+        /* gso super-packets */
+        case 'g':
+            args.gso = 1;
+            break;
+        /* burst size */
+        case 'b':
+            sscanf(arg, "%u", &args.batch);
+            if (!args.batch || args.batch > BATCH_MAX)
+                return ARGP_ERR_UNKNOWN;
             break;
         /* queue redirection number */
         case 'r':
@@ -113,8 +301,113 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
         case 'w':
             args.overwrite = 1;
             break;
-        /* user's ops file */
+        /* socket receive buffer size */
+        case 'B':
+            sscanf(arg, "%u", &args.rcvbuf);
+            break;
+        /* kernel queue length */
+        case 'm':
+            sscanf(arg, "%u", &args.maxlen);
+            break;
+        /* fail open */
+        case 'f':
+            args.fail_open = 1;
+            break;
+        /* load shedding threshold */
+        case 'H':
+            sscanf(arg, "%hhu", &args.hwm);
+            if (args.hwm > 100)
+                return ARGP_ERR_UNKNOWN;
+            break;
+        /* pipeline mode */
+        case 'P':
+            sscanf(arg, "%u", &args.pipeline);
+            if (args.pipeline > PIPE_STAGES_MAX)
+                return ARGP_ERR_UNKNOWN;
+            break;
+        /* io_uring event loop */
+        case 'u':
+#ifdef HAVE_URING
+            args.uring = 1;
+#else
+            argp_error(state, "not built w/ io_uring support (make URING=1)");
+#endif
+            break;
+        /* offline mode input & output */
+        case OPT_OFFLINE:
+            args.offline = arg;
+            break;
+        case OPT_OUT:
+            args.out = arg;
+            break;
+        case OPT_FULL:
+            args.full_csum = 1;
+            break;
+        /* timestamp source */
+        case OPT_CLOCK:
+            if (!strncmp(arg, "coarse", 7))
+                args.clock = CLK_COARSE;
+            else if (!strncmp(arg, "tsc", 4))
+                args.clock = CLK_TSC;
+            else if (!strncmp(arg, "packet", 7))
+                args.clock = CLK_PACKET;
+            else
+                return ARGP_ERR_UNKNOWN;
+            break;
+        /* flow tracking */
+        case OPT_FLOWS:
+            sscanf(arg, "%u", &args.flows);
+            if (args.flows == FLOW_AUTO)
+                return ARGP_ERR_UNKNOWN;
+            break;
+        case OPT_FLOW_TO:
+            sscanf(arg, "%u", &args.flow_timeout);
+            if (!args.flow_timeout)
+                return ARGP_ERR_UNKNOWN;
+            break;
+        /* annotation budget */
+        case OPT_BUDGET:
+            if (budget_parse(arg, &budget))
+                return ARGP_ERR_UNKNOWN;
+            budget_publish(&budget);
+            args.budget = 1;
+            break;
+        case OPT_BG_FILE:
+            if (budget_load(arg))
+                return ARGP_ERR_UNKNOWN;
+            args.budget      = 1;
+            args.budget_file = arg;
+            break;
+        /* path mtu checks */
+        case OPT_PMTU:
+            if (!strncmp(arg, "skip", 5))
+                args.pmtu = PMTU_SKIP;
+            else if (!strncmp(arg, "shrink", 7))
+                args.pmtu = PMTU_SHRINK;
+            else if (!strncmp(arg, "frag", 5))
+                args.pmtu = PMTU_FRAG;
+            else
+                return ARGP_ERR_UNKNOWN;
+            break;
+        case OPT_MTU:
+            sscanf(arg, "%hu", &args.mtu);
+            if (args.mtu < PMTU_MIN)
+                return ARGP_ERR_UNKNOWN;
+            break;
+        /* connmark of flows that need no more annotation */
+        case OPT_CT_MARK:
+            args.ct_mark = strtoul(arg, &end, 0);
+            args.ct_mask = *end == '/' ? strtoul(end + 1, &end, 0)
+                         : UINT32_MAX;
+            if (*end || !args.ct_mark || args.ct_mark & ~args.ct_mask)
+                return ARGP_ERR_UNKNOWN;
+            break;
+        /* user's ops files; one per -p protocol, in the same order */
         case ARGP_KEY_ARG:
+            if (state->arg_num >= n_layers)
+                argp_error(state, "expected one FILE per -p protocol");
+            layer = layer_order[state->arg_num];
+
             /* read uninterpreted ops into memory */
             fd = open(arg, O_RDONLY);
             DIE(fd == -1, "Check ops file path or permissions (%d)", errno);
@@ -126,18 +419,44 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
              * give the buffer an arbitrary larger size by faking st_size */
             statbuf.st_size = 1024;
 
-            args.ops = (uint8_t *) malloc(statbuf.st_size);
-            DIE(!args.ops, "Unable to allocate memory (%d)", errno);
+            args.ops[layer] = (uint8_t *) malloc(statbuf.st_size);
+            DIE(!args.ops[layer], "Unable to allocate memory (%d)", errno);
 
-            rb = read(fd, args.ops, statbuf.st_size);
+            rb = read(fd, args.ops[layer], statbuf.st_size);
             DIE(rb == -1, "Unable to read ops file (%d)", errno);
             DIE(rb == 0,  "No ops specified in given file");
 
             ans = close(fd);
             DIE(ans == -1, "Unable to close ops file (%d)", errno);
 
-            args.ops_len = rb;
+            args.ops_len[layer] = rb;
+
+            break;
+        /* all options parsed; specialize the annotation routines once */
+        case ARGP_KEY_END:
+            if (args.layers) {
+                mode = annotate_select(args.layers, args.overwrite,
+                           args.full_csum);
+                args.annotate       = mode->one;
+                args.annotate_burst = mode->burst;
+            }
+
+            /* track flows only if some op or policy has a use for them */
+            if (args.flows == FLOW_AUTO)
+                args.flows = decode_flow_ops(args.layers) || budget_flows()
+                           ? FLOW_DEF_MAX : 0;
+
+            /* per-flow policies count packets in the flow table */
+            ALERT(!args.flows && budget_flows(),
+                "--budget first=N / sample=K has no effect w/ --flows=0");
+
+            ip_ops_shrink = args.pmtu == PMTU_SHRINK;
 
+            /* only a spent first=N budget ends a flow's annotation */
+            ALERT(args.ct_mask && !args.budget,
+                "--ct-mark has no effect w/o --budget first=N");
+            ALERT(args.ct_mask && !args.flows,
+                "--ct-mark has no effect w/ --flows=0");
             break;
         /* unknown argument */
         default:
@@ -0,0 +1,178 @@
+/*
+ * Copyright © 2021, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of ops-inject.
+ *
+ * ops-inject is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ops-inject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>         /* [u]int*_t        */
+#include <time.h>           /* clock_gettime    */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>      /* __rdtsc          */
+#include <cpuid.h>          /* __get_cpuid      */
+#define CLK_X86
+#endif
+
+#include "clock.h"
+#include "util.h"
+
+#define NSEC_PER_SEC    1000000000UL
+
+/* tsc to ns conversion is re-anchored to CLOCK_REALTIME this often, so that *
+ * calibration errors & ntp adjustments don't accumulate                     */
+#define CLK_ANCHOR_NS   NSEC_PER_SEC
+
+/* tsc calibration interval */
+#define CLK_CALIB_NS    (20 * 1000000UL)
+
+static uint8_t  clk_src = CLK_COARSE;   /* selected burst clock          */
+static uint64_t clk_mult;               /* ns per tsc tick (32.32 fixed) */
+
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* ts_ns - converts a timespec to ns */
+static inline uint64_t ts_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+#ifdef CLK_X86
+/* tsc_usable - checks for an invariant tsc (constant rate, never stops)
+ *
+ *  @return : !0 if the tsc can be used as a clock
+ */
+static int tsc_usable(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return 0;
+
+    return !!(edx & (1 << 8));
+}
+
+/* tsc_calibrate - measures the tsc rate against CLOCK_MONOTONIC_RAW
+ *
+ *  @return : 0 if everything went ok
+ */
+static int tsc_calibrate(void)
+{
+    struct timespec t0, t1;
+    uint64_t        c0, c1;
+    uint64_t        ns;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+    c0 = __rdtsc();
+
+    do {
+        clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+        ns = ts_ns(&t1) - ts_ns(&t0);
+    } while (ns < CLK_CALIB_NS);
+    c1 = __rdtsc();
+
+    RET(c1 <= c0, 1, "TSC did not advance");
+    clk_mult = (uint64_t)(((unsigned __int128) ns << 32) / (c1 - c0));
+
+    return 0;
+}
+
+/* tsc_now - reads the wall clock off the tsc
+ *  @now : current time
+ *
+ * Each thread keeps its own anchor (tsc & CLOCK_REALTIME taken together), so
+ * no state is shared once the rate is calibrated.
+ *
+ * The rate was measured against CLOCK_MONOTONIC_RAW, so by the time the
+ * anchor is renewed the extrapolated time may have run ahead of
+ * CLOCK_REALTIME (calibration error, ntp slewing). The returned time never
+ * goes back; it stands still until the new anchor catches up instead, so
+ * that timestamps derived from it (e.g.: tcp TSval) never decrease.
+ */
+static void tsc_now(struct timespec *now)
+{
+    static __thread uint64_t anchor_tsc;
+    static __thread uint64_t anchor_ns;
+    static __thread uint64_t last_ns;
+    uint64_t                 tsc = __rdtsc();
+    uint64_t                 ns;
+
+    ns = (uint64_t)(((unsigned __int128)(tsc - anchor_tsc) * clk_mult) >> 32);
+
+    if (!anchor_ns || ns >= CLK_ANCHOR_NS) {
+        clock_gettime(CLOCK_REALTIME, now);
+        anchor_tsc = tsc;
+        anchor_ns  = ts_ns(now);
+        ns         = anchor_ns;
+    } else {
+        ns += anchor_ns;
+    }
+
+    if (ns < last_ns)
+        ns = last_ns;
+    last_ns = ns;
+
+    now->tv_sec  = ns / NSEC_PER_SEC;
+    now->tv_nsec = ns % NSEC_PER_SEC;
+}
+#endif /* CLK_X86 */
+
+/******************************************************************************
+ ****************************** PUBLIC FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* clk_init - selects the clock used for time dependent options
+ *  @src : CLK_*
+ *
+ *  @return : 0 if everything went ok
+ *
+ * Must be called before any worker starts. If the tsc can't be used, the
+ * coarse clock is used instead. CLK_PACKET only applies to packets that carry
+ * a kernel timestamp; all others fall back to CLK_COARSE.
+ */
+int clk_init(uint8_t src)
+{
+    clk_src = src == CLK_TSC ? CLK_TSC : CLK_COARSE;
+    if (clk_src != CLK_TSC)
+        return 0;
+
+#ifdef CLK_X86
+    if (tsc_usable() && !tsc_calibrate()) {
+        INFO("TSC runs at %.3f MHz", 1000.0 * ((uint64_t) 1 << 32) / clk_mult);
+        return 0;
+    }
+#endif
+
+    WAR("No invariant TSC; falling back to the coarse clock");
+    clk_src = CLK_COARSE;
+    return 1;
+}
+
+/* clk_burst - samples the burst clock
+ *  @now : current wall clock time
+ */
+void clk_burst(struct timespec *now)
+{
+#ifdef CLK_X86
+    if (clk_src == CLK_TSC) {
+        tsc_now(now);
+        return;
+    }
+#endif
+
+    clock_gettime(CLOCK_REALTIME_COARSE, now);
+}
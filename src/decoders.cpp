@@ -19,15 +19,15 @@
 
 #include <stdio.h>          /* size_t    */
 #include <stdint.h>         /* [u]int*_t */
-#include <string.h>         /* memset    */
+#include <stdlib.h>         /* malloc    */
+#include <string.h>         /* memcpy    */
 #include <arpa/inet.h>      /* ntohs     */
+#include <netinet/in.h>     /* IPPROTO_* */
 #include <netinet/ip.h>     /* iphdr     */
 #include <netinet/tcp.h>    /* tcphdr    */
 #include <netinet/udp.h>    /* udphdr    */
 
-#include <queue>            /* priority queue */
-#include <tuple>            /* tuple          */
-#include <vector>           /* vector         */
+#include <algorithm>        /* stable_sort */
 
 extern "C" {
 #include "ops_ip.h"         /* individual ip  options decoders */
@@ -37,281 +37,404 @@ extern "C" {
 
 #include "cli_args.h"
 #include "decoders.h"
+#include "pmtu.h"
 #include "util.h"
 
 using namespace std;
 
-/* create alias for post processing data        *
- *      <0> : destination of processed option   *
- *      <1> : length of promised option         *
- *      <2> : pointer to user's type request    */
-typedef tuple<uint8_t *, size_t, uint8_t *> pp_data;
+/* individual option decoder callback */
+typedef size_t (*decoder_t)(uint8_t *, size_t, uint8_t **, struct iphdr *,
+    uint8_t *, struct ops_ctx *);
+
+/* per protocol decoder tables */
+struct ops_proto {
+    decoder_t *decoders;            /* decoder callback array       */
+    uint64_t  *prio;                /* processing priority          */
+    uint8_t   *dyn;                 /* packet dependent options     */
+    uint8_t   *flow;                /* flow dependent options       */
+    uint8_t   mask;                 /* user byte to table index     */
+    uint8_t   pad;                  /* pad section to 4 bytes       */
+    uint8_t   layer;                /* user ops (args.ops[layer])   */
+};
+
+/* option that is rendered for each packet */
+struct plan_op {
+    uint8_t *op;                    /* user option (in args.ops[])  */
+    size_t  off;                    /* offset in options section    */
+    uint8_t delayed;                /* after all other options      */
+};
+
+/* options section that was rendered once for a given amount of space      *
+ * NOTE: built on the first packet w/ that amount of space, in each thread; *
+ *       args.ops[] must not change after that                              */
+struct ops_plan {
+    uint8_t        state;           /* PLAN_* below                 */
+    size_t         len;             /* section length (w/ padding)  */
+    size_t         raw_len;         /* section length (w/o padding) */
+    uint8_t        *buf;            /* pre-rendered section         */
+    size_t         n_dyn;           /* number of dynamic options    */
+    struct plan_op *dyn;            /* dynamic options, in order    */
+};
+
+enum {
+    PLAN_NONE,                      /* not built yet                */
+    PLAN_OK,                        /* ready to use                 */
+    PLAN_FAIL,                      /* user ops don't fit           */
+};
+
+/* ip and tcp plans are indexed by the space left for options (in words) */
+#define PLAN_WORDS 11
+
+static const struct ops_proto ip_proto = {
+    .decoders = ip_decoders,
+    .prio     = ip_ops_prio,
+    .dyn      = ip_ops_dyn,
+    .flow     = NULL,
+    .mask     = 0x7f,
+    .pad      = 1,
+    .layer    = LAYER_IP,
+};
+
+static const struct ops_proto tcp_proto = {
+    .decoders = tcp_decoders,
+    .prio     = tcp_ops_prio,
+    .dyn      = tcp_ops_dyn,
+    .flow     = tcp_ops_flow,
+    .mask     = 0xff,
+    .pad      = 1,
+    .layer    = LAYER_TCP,
+};
+
+static const struct ops_proto udp_proto = {
+    .decoders = udp_decoders,
+    .prio     = udp_ops_prio,
+    .dyn      = udp_ops_dyn,
+    .flow     = NULL,
+    .mask     = 0xff,
+    .pad      = 0,
+    .layer    = LAYER_UDP,
+};
+
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* plan_build - renders every packet independent user option
+ *  @plan     : plan to be built (state is PLAN_NONE)
+ *  @proto    : protocol decoder tables
+ *  @iph      : first packet that uses this plan
+ *  @ops      : scratch buffer (the thread's options buffer)
+ *  @len_left : space left for options
+ *  @ctx      : context of the first packet
+ *
+ *  @return : 0 if everything went well
+ *
+ * Walks the protocol's user ops exactly like the original per-packet decoder
+ * did, except that packet dependent options (see *_ops_dyn) are treated like
+ * delayed ones: only their space is reserved. Delayed options are then stably
+ * ordered by priority, after the immediate ones, so that the per-packet work
+ * is reduced to patching these slots in a fixed order.
+ *
+ * The plan is marked PLAN_FAIL if the options don't fit, so that the decoders'
+ * error messages are only shown once. A failed plan holds no memory.
+ */
+static int plan_build(struct ops_plan *plan, const struct ops_proto *proto,
+                      struct iphdr *iph, uint8_t *ops, size_t len_left,
+                      struct ops_ctx *ctx)
+{
+    const uint64_t *prio    = proto->prio;
+    const uint8_t  mask     = proto->mask;
+    uint8_t        *usr     = args.ops[proto->layer];
+    size_t         usr_len  = args.ops_len[proto->layer];
+    size_t         len      = 0;
+    size_t         ans;
+    uint8_t        *aux;
+
+    plan->state = PLAN_FAIL;
+    plan->n_dyn = 0;
+
+    plan->dyn = (struct plan_op *) malloc(usr_len * sizeof(*plan->dyn));
+    RET(!plan->dyn, 1, "Unable to allocate options plan");
+
+    for (uint8_t *it = usr; it < usr + usr_len; len += ans) {
+        /* save ptr to current user option before being incremented */
+        aux = it;
+
+        /* packet independent option; render it now */
+        if (!prio[*it & mask] && !proto->dyn[*it & mask]) {
+            ans = proto->decoders[*it & mask](ops + len, len_left - len, &it,
+                    iph, ops, ctx);
+            GOTO(!ans, cleanup, "Unable to decode byte %lu of user ops",
+                (unsigned long)(it - usr));
+            continue;
+        }
+
+        /* request space estimate */
+        ans = proto->decoders[*it & mask](NULL, len_left - len, &it, iph, ops,
+                ctx);
+        GOTO(!ans, cleanup, "Unable to decode byte %lu of user ops",
+            (unsigned long)(it - usr));
+
+        memset(ops + len, 0, ans);
+        plan->dyn[plan->n_dyn++] = { aux, len, !!prio[*aux & mask] };
+    }
 
+    /* immediate options keep their order and go first */
+    stable_sort(plan->dyn, plan->dyn + plan->n_dyn,
+        [prio, mask](const struct plan_op &lhs, const struct plan_op &rhs)
+        {
+            return (lhs.delayed ? prio[*lhs.op & mask] : 0) <
+                   (rhs.delayed ? prio[*rhs.op & mask] : 0);
+        });
+
+    /* calculate padded length (must be multiple of 4 for ihl / doff) */
+    plan->raw_len = len;
+    plan->len     = proto->pad ? (len + 3) & ~0x03UL : len;
+    memset(ops + len, 0, plan->len - len);
+
+    plan->buf = (uint8_t *) malloc(plan->len ? : 1);
+    GOTO(!plan->buf, cleanup, "Unable to allocate options plan");
+    memcpy(plan->buf, ops, plan->len);
+
+    plan->state = PLAN_OK;
+    return 0;
+
+cleanup:
+    free(plan->dyn);
+    plan->dyn = NULL;
+    return 1;
+}
 
-/* decode_ip_ops - generate options section based on user's requested ops
+/* plan_render - generates the options section for one packet
+ *  @plan       : plan for the packet's amount of space
+ *  @proto      : protocol decoder tables
  *  @iph        : start of ip header
- *  @ops_buffer : address of a pointer used to indicate generated ops buffer
- *                location to the caller; buffer becomes invalid after a
- *                subsequent call to this function
- *  @ow         : 0 if not overwriting existing options
+ *  @ops        : the thread's options buffer
+ *  @len_left   : space left for options
+ *  @ops_buffer : set to the generated options section
+ *  @ctx        : per-packet context (see clock.h)
  *
- *  @return : len of ops section buffer (is multiple of 4 bytes) or 0 on failure
- *            (adding ops may cause fragmentation or exceed ops length limit)
+ *  @return : len of ops section buffer or 0 on failure
  *
- * NOTE: the caller must remove any previous EOOL, recompose the packet,
- *       recalculate total length and checksum
+ * If no user option depends on the packet, the pre-rendered section is used
+ * as is. Otherwise, it is copied over and the dynamic slots are filled in.
  */
-size_t decode_ip_ops(struct iphdr *iph, void **ops_buffer, uint8_t ow)
+static size_t plan_render(struct ops_plan *plan, const struct ops_proto *proto,
+                          struct iphdr *iph, uint8_t *ops, size_t len_left,
+                          void **ops_buffer, struct ops_ctx *ctx)
 {
-    /* ip options size limit is 40 bytes (4 bit IHL) */
-    static uint8_t  ops[40];
-    size_t          len_left   = 0;     /* space left for options        */
-    size_t          padded_len = 0;     /* length of options w/  padding */
-    size_t          len        = 0;     /* length of options w/o padding */
-    size_t          ans;
-    uint8_t         *aux;
-
-    /* priority queue holding delayed option processing requests */
-    auto compare = [](pp_data lhs, pp_data rhs)
-    {
-        return ip_ops_prio[*get<2>(lhs) & 0x7f] >
-               ip_ops_prio[*get<2>(rhs) & 0x7f];
-    };
-    priority_queue<pp_data, vector<pp_data>, decltype(compare)> pq(compare);
+    struct plan_op *d;
+    uint8_t        *it;
+    size_t         ans;
 
-    /* sanity checks */
-    RET(!iph,         0, "iph is NULL");
-    RET(!ops_buffer,  0, "ops_buffer is NULL");
+    RET(plan->state != PLAN_OK, 0, "User ops don't fit in %lu bytes",
+        (unsigned long) len_left);
 
-    /* check protocol */
-    RET(iph->version != 4, 0, "Layer 3 protocol mismatch");
-
-    /* calculate remaining length in header */
-    len_left = (0x0f - (ow ? 5 : iph->ihl)) * 4;
-
-    /* perform decoding */
-    for (uint8_t *it = args.ops; it < args.ops + args.ops_len; len += ans) {
-        /* immediate processing */
-        if (!ip_ops_prio[*it & 0x7f]) {
-            ans = ip_decoders[*it & 0x7f](ops + len, len_left - len, &it, iph, ops);
-            RET(!ans, 0, "Unable to decode byte %lu of user ops",
-                (unsigned long)(it - args.ops));
-        }
-        /* delayed processing */
-        else {
-            /* save ptr to current user option before being incremented */
-            aux = it;
-
-            /* request space estimate */
-            ans = ip_decoders[*it & 0x7f](NULL, len_left - len, &it, iph, ops);
-            RET(!ans, 0, "Unable to decode byte %lu of user ops",
-                (unsigned long)(it - args.ops));
-
-            /* enqueue request */
-            pq.push(make_tuple(ops + len, ans, aux));
-        }
+    if (!plan->n_dyn) {
+        *ops_buffer = plan->buf;
+        return plan->len;
     }
 
-    /* perform delayed decoding */
-    while (!pq.empty()) {
-        auto [delayed_dst, delayed_len, delayed_op] = pq.top();
-        pq.pop();
+    memcpy(ops, plan->buf, plan->len);
 
-        ans = ip_decoders[*delayed_op & 0x7f](delayed_dst, len_left - len,
-                &delayed_op, iph, ops);
+    for (d = plan->dyn; d < plan->dyn + plan->n_dyn; d++) {
+        it  = d->op;
+        ans = proto->decoders[*it & proto->mask](ops + d->off,
+                len_left - (d->delayed ? plan->raw_len : d->off), &it, iph,
+                ops, ctx);
         RET(!ans, 0, "Unable to decode byte %lu of user ops",
-            (unsigned long)(delayed_op - args.ops));
+            (unsigned long)(d->op - args.ops[proto->layer]));
     }
 
-    /* calculate padded length (must be multiple of 4 for ihl) */
-    padded_len  = len & ~0x03L;
-    padded_len += !!(len & 0x03) * 4;
-
-    /* set padding (if needed) */
-    memset(ops + len, 0, padded_len - len);
-
-    /* return reference to options buffer and length of (padded) buffer */
-    *ops_buffer = &ops;
-    return padded_len;
+    *ops_buffer = ops;
+    return plan->len;
 }
 
-/* decode_tcp_ops - generate options section based on user's requested ops
+/******************************************************************************
+ ****************************** PUBLIC FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* decode_ops - generate options section based on user's requested ops
+ *  @P          : target protocol (IPPROTO_IP, IPPROTO_TCP or IPPROTO_UDP)
+ *  @OW         : overwrite existing options
  *  @iph        : start of ip header
  *  @ops_buffer : address of a pointer used to indicate generated ops buffer
- *                location to the caller; buffer becomes invalid after a
- *                subsequent call to this function
- *  @ow         : 0 if not overwriting existing options
+ *                location to the caller; buffer is per-thread and becomes
+ *                invalid after a subsequent call from the same thread
+ *  @ctx        : per-packet context (e.g.: time of processing for timestamps)
  *
- *  @return : len of ops section buffer (is multiple of 4 bytes) or 0 on failure
- *            (adding ops may cause fragmentation or exceed ops length limit)
+ *  @return : len of ops section buffer or 0 on failure (adding ops may cause
+ *            fragmentation or exceed ops length limit); ip & tcp sections
+ *            are padded to a multiple of 4 bytes, udp ones aren't
+ *
+ * Every (P, OW) combination has its own instantiation (and thus its own
+ * per-thread buffer & plans), so the protocol checks and header lengths fold
+ * into constants where the mode allows it (e.g.: w/ OW, the space left for ip
+ * or tcp options is always 40 bytes).
+ *
+ * ip & tcp plans are indexed by the space left for options. udp plans are
+ * indexed by the parity of the udp length (CCO alignment) and built for the
+ * space left in the first packet. Later packets w/ less space than the plan
+ * needs are rejected rather than given shorter fill options.
+ *
+ * W/ a path mtu in ctx (see pmtu.h), the space left is also limited to what
+ * keeps the packet within it, unless the kernel is left to fragment it
+ * (--pmtu=frag). udp plans are still built & rendered for the space the
+ * packet would have w/o that limit; only their length is checked against it.
  *
  * NOTE: the caller must remove any previous EOOL, recompose the packet,
- *       recalculate data offset and checksum
+ *       recalculate total length, data offset and checksums
  */
-size_t decode_tcp_ops(struct iphdr *iph, void **ops_buffer, uint8_t ow)
+template <uint8_t P, bool OW>
+size_t decode_ops(struct iphdr *iph, void **ops_buffer, struct ops_ctx *ctx)
 {
-    /* tcp options size limit is 40 bytes (4 bit Data Offset) */
-    static uint8_t  ops[40];
-    size_t          len_left   = 0;     /* space left for options        */
-    size_t          padded_len = 0;     /* length of options w/  padding */
-    size_t          len        = 0;     /* length of options w/o padding */
-    size_t          ans;
-    uint8_t         *aux;
-    struct tcphdr*  tcph;
-
-    /* priority queue holding delayed option processing requests */
-    auto compare = [](pp_data lhs, pp_data rhs)
-    {
-        return tcp_ops_prio[*get<2>(lhs)] >
-               tcp_ops_prio[*get<2>(rhs)];
-    };
-    priority_queue<pp_data, vector<pp_data>, decltype(compare)> pq(compare);
+    /* ip & tcp options size limit is 40 bytes (4 bit IHL / Data Offset) *
+     * udp options size limit is determined by packet length             */
+    static thread_local uint8_t         ops[P == IPPROTO_UDP ? 0xffff : 40];
+    static thread_local struct ops_plan plans[P == IPPROTO_UDP ? 2
+                                                               : PLAN_WORDS];
+    const struct ops_proto              *proto;     /* decoder tables    */
+    struct ops_plan                     *plan;      /* plan for packet   */
+    size_t                              space;      /* space w/o mtu     */
+    size_t                              len_left;   /* space for options */
+    size_t                              kept;       /* bytes kept as is  */
+    struct tcphdr                       *tcph;
+    struct udphdr                       *udph;
 
     /* sanity checks */
     RET(!iph,         0, "iph is NULL");
     RET(!ops_buffer,  0, "ops_buffer is NULL");
 
     /* check protocol */
-    RET(iph->version  != 4, 0, "Layer 3 protocol mismatch");
-    RET(iph->protocol != 6, 0, "Layer 4 protocol mismatch");
-
-    /* extract tcp header */
-    tcph = (struct tcphdr *)(((uint8_t *) iph) + iph->ihl * 4);
-
-    /* calculate remaining length in header */
-    len_left = (0x0f - (ow ? 5 : tcph->doff)) * 4;
-
-    /* perform decoding */
-    for (uint8_t *it = args.ops; it < args.ops + args.ops_len; len += ans) {
-        /* immediate processing */
-        if (!tcp_ops_prio[*it]) {
-            ans = tcp_decoders[*it](ops + len, len_left - len, &it,
-                    iph, ops);
-            RET(!ans, 0, "Unable to decode byte %lu of user ops",
-                (unsigned long)(it - args.ops));
-        }
-        /* delayed processing */
-        else {
-            /* save ptr to current user option before being incremented */
-            aux = it;
-
-            /* request space estimate */
-            ans = tcp_decoders[*it](NULL, len_left - len, &it, iph, ops);
-            RET(!ans, 0, "Unable to decode byte %lu of user ops",
-                (unsigned long)(it - args.ops));
-
-            /* enqueue request */
-            pq.push(make_tuple(ops + len, ans, aux));
-        }
-    }
+    RET(iph->version != 4, 0, "Layer 3 protocol mismatch");
 
-    /* perform delayed decoding */
-    while (!pq.empty()) {
-        auto [delayed_dst, delayed_len, delayed_op] = pq.top();
-        pq.pop();
+    /* calculate remaining length for options */
+    if constexpr (P == IPPROTO_IP) {
+        RET(!OW && iph->ihl < 5, 0, "Invalid IHL");
 
-        ans = tcp_decoders[*delayed_op](delayed_dst, len_left - len,
-                &delayed_op, iph, ops);
-        RET(!ans, 0, "Unable to decode byte %lu of user ops",
-            (unsigned long)(delayed_op - args.ops));
+        proto = &ip_proto;
+        space = (0x0f - (OW ? 5 : iph->ihl)) * 4;
+        kept  = ntohs(iph->tot_len) - (OW ? iph->ihl * 4 - 20 : 0);
+    } else if constexpr (P == IPPROTO_TCP) {
+        RET(iph->protocol != IPPROTO_TCP, 0, "Layer 4 protocol mismatch");
+
+        tcph = (struct tcphdr *)(((uint8_t *) iph) + iph->ihl * 4);
+        RET(!OW && tcph->doff < 5, 0, "Invalid data offset");
+
+        proto = &tcp_proto;
+        space = (0x0f - (OW ? 5 : tcph->doff)) * 4;
+        kept  = ntohs(iph->tot_len) - (OW ? tcph->doff * 4 - 20 : 0);
+    } else {
+        RET(iph->protocol != IPPROTO_UDP, 0, "Layer 4 protocol mismatch");
+
+        udph = (struct udphdr *)(((uint8_t *) iph) + iph->ihl * 4);
+
+        proto = &udp_proto;
+        kept  = OW ? iph->ihl * 4 + ntohs(udph->len) : ntohs(iph->tot_len);
+        space = sizeof(ops) - kept;
     }
 
-    /* calculate padded length (must be multiple of 4 for doff) */
-    padded_len  = len & ~0x03L;
-    padded_len += !!(len & 0x03) * 4;
+    /* stay within the path mtu (ip & tcp sections are padded) */
+    len_left = space;
+    if (ctx && ctx->mtu && args.pmtu != PMTU_FRAG) {
+        len_left = ctx->mtu > kept ? ctx->mtu - kept : 0;
+        if constexpr (P != IPPROTO_UDP)
+            len_left &= ~3UL;
+        len_left = min(len_left, space);
+    }
 
-    /* set padding if needed */
-    memset(ops + len, 0, padded_len - len);
+    if constexpr (P == IPPROTO_UDP)
+        plan = &plans[ntohs(udph->len) & 1];
+    else
+        plan = &plans[len_left / 4];
+
+    if (plan->state == PLAN_NONE)
+        plan_build(plan, proto, iph, ops, P == IPPROTO_UDP ? space : len_left,
+            ctx);
+
+    /* udp decoders (e.g.: CCO) derive the options' offset from the space *
+     * they are given, so they always get all of it & the mtu is enforced *
+     * on the plan's (fixed) length instead                               */
+    if constexpr (P == IPPROTO_UDP) {
+        RET(plan->state == PLAN_OK && plan->len > len_left, 0,
+            "Not enough space for options");
+        len_left = space;
+    }
 
-    /* return references to options buffer and length of padded buffer */
-    *ops_buffer = &ops;
-    return padded_len;
+    return plan_render(plan, proto, iph, ops, len_left, ops_buffer, ctx);
 }
 
-/* decode_udp_ops - generate options section based on user's requested ops
+template size_t decode_ops<IPPROTO_IP,  false>(struct iphdr *, void **,
+    struct ops_ctx *);
+template size_t decode_ops<IPPROTO_IP,  true> (struct iphdr *, void **,
+    struct ops_ctx *);
+template size_t decode_ops<IPPROTO_TCP, false>(struct iphdr *, void **,
+    struct ops_ctx *);
+template size_t decode_ops<IPPROTO_TCP, true> (struct iphdr *, void **,
+    struct ops_ctx *);
+template size_t decode_ops<IPPROTO_UDP, false>(struct iphdr *, void **,
+    struct ops_ctx *);
+template size_t decode_ops<IPPROTO_UDP, true> (struct iphdr *, void **,
+    struct ops_ctx *);
+
+/* decode_{ip,tcp,udp}_ops - decode_ops() w/ overwrite mode chosen at runtime
  *  @iph        : start of ip header
- *  @ops_buffer : address of a pointer used to indicate generated ops buffer
- *                location to the caller; buffer becomes invalid after a
- *                subsequent call to this function
+ *  @ops_buffer : set to the generated options section (see decode_ops())
  *  @ow         : 0 if not overwriting existing options
+ *  @ctx        : per-packet context
  *
- *  @return : len of ops section buffer (is multiple of 4 bytes) or 0 on failure
- *            (adding ops may cause fragmentation or exceed ops length limit)
- *
- * NOTE: the caller must remove any previous EOOL, recompose the packet,
- *       recalculate data offset and checksum
+ *  @return : len of ops section buffer or 0 on failure
  */
-size_t decode_udp_ops(struct iphdr *iph, void **ops_buffer, uint8_t ow)
+size_t decode_ip_ops(struct iphdr *iph, void **ops_buffer, uint8_t ow,
+                     struct ops_ctx *ctx)
 {
-    /* udp options size limit is determined by packet length */
-    static uint8_t  ops[0xffff];
-    size_t          len_left   = 0;     /* space left for options        */
-    size_t          len        = 0;     /* length of options w/o padding */
-    size_t          ans;
-    struct udphdr   *udph;
-    uint8_t         *aux;
-
-    /* priority queue holding delayed option processing requests */
-    auto compare = [](pp_data lhs, pp_data rhs)
-    {
-        return udp_ops_prio[*get<2>(lhs)] >
-               udp_ops_prio[*get<2>(rhs)];
-    };
-    priority_queue<pp_data, vector<pp_data>, decltype(compare)> pq(compare);
-
-    /* sanity checks */
-    RET(!iph,         0, "iph is NULL");
-    RET(!ops_buffer,  0, "ops_buffer is NULL");
-
-    /* check protocol */
-    RET(iph->version  != 4,  0, "Layer 3 protocol mismatch");
-    RET(iph->protocol != 17, 0, "Layer 4 protocol mismatch");
-
-    /* extract udp header */
-    udph = (struct udphdr *)(((uint8_t *) iph) + iph->ihl * 4);
+    return ow ? decode_ops<IPPROTO_IP, true>(iph, ops_buffer, ctx)
+              : decode_ops<IPPROTO_IP, false>(iph, ops_buffer, ctx);
+}
 
-    /* calculate remaining length for options */
-    len_left = sizeof(ops) - (ow ? iph->ihl * 4 + ntohs(udph->len) :
-        ntohs(iph->tot_len));
-
-    /* perform decoding */
-    for (uint8_t *it = args.ops; it < args.ops + args.ops_len; len += ans) {
-        /* immediate processing */
-        if (!udp_ops_prio[*it]){
-            ans = udp_decoders[*it](ops + len, len_left - len, &it,
-                    iph, ops);
-            RET(!ans, 0, "Unable to decode byte %lu of user ops",
-                (unsigned long)(it - args.ops));
-        }
-        /* delayed processing */
-        else {
-            /* save ptr to current user option before being incremented */
-            aux = it;
-
-            /* request space estimation */
-            ans = udp_decoders[*it](NULL, len_left - len, &it, iph, ops);
-            RET(!ans, 0, "Unable to decode byte %lu of user ops",
-                (unsigned long)(it - args.ops));
-
-            /* enqueue request */
-            pq.push(make_tuple(ops + len, ans, aux));
-        }
-    }
+size_t decode_tcp_ops(struct iphdr *iph, void **ops_buffer, uint8_t ow,
+                      struct ops_ctx *ctx)
+{
+    return ow ? decode_ops<IPPROTO_TCP, true>(iph, ops_buffer, ctx)
+              : decode_ops<IPPROTO_TCP, false>(iph, ops_buffer, ctx);
+}
 
-    /* perform delayed decoding */
-    while (!pq.empty()) {
-        auto [delayed_dst, delayed_len, delayed_op] = pq.top();
-        pq.pop();
+size_t decode_udp_ops(struct iphdr *iph, void **ops_buffer, uint8_t ow,
+                      struct ops_ctx *ctx)
+{
+    return ow ? decode_ops<IPPROTO_UDP, true>(iph, ops_buffer, ctx)
+              : decode_ops<IPPROTO_UDP, false>(iph, ops_buffer, ctx);
+}
 
-        ans = udp_decoders[*delayed_op](delayed_dst, len_left - len,
-                &delayed_op, iph, ops);
-        RET(!ans, 0, "Unable to decode byte %lu of user ops",
-            (unsigned long)(delayed_op - args.ops));
+/* decode_flow_ops - checks if the user ops need per-flow state
+ *  @layers : target layers (bits of LAYER_*)
+ *
+ *  @return : !0 if any of their args.ops[] uses the packet's flow (see flow.h)
+ *
+ * NOTE: scans raw bytes; an experimental option's payload may match too,
+ *       which only costs an unneeded flow table
+ */
+uint8_t decode_flow_ops(uint8_t layers)
+{
+    static const struct ops_proto *protos[LAYER_MAX] = {
+        [LAYER_IP]  = &ip_proto,
+        [LAYER_TCP] = &tcp_proto,
+        [LAYER_UDP] = &udp_proto,
+    };
+    const struct ops_proto *p;
+    uint8_t                *ops;
+
+    for (uint8_t l = 0; l < LAYER_MAX; l++) {
+        p   = protos[l];
+        ops = args.ops[l];
+        if (!(layers & 1 << l) || !p->flow)
+            continue;
+
+        /* NOTE: the tables have no entry for 0xff */
+        for (size_t i = 0; i < args.ops_len[l]; i++)
+            if ((ops[i] & p->mask) < 0xff && p->flow[ops[i] & p->mask])
+                return 1;
     }
 
-    /* no padding needed (length not expressed in dwords)       *
-     * return references to options buffer and length of buffer */
-    *ops_buffer = &ops;
-    return len;
+    return 0;
 }
-
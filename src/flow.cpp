@@ -0,0 +1,506 @@
+/*
+ * Copyright © 2021, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of ops-inject.
+ *
+ * ops-inject is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ops-inject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>            /* size_t                 */
+#include <stdint.h>           /* [u]int*_t              */
+#include <stdlib.h>           /* calloc, free           */
+#include <string.h>           /* memset                 */
+#include <arpa/inet.h>        /* ntohl, ntohs           */
+#include <netinet/in.h>       /* IPPROTO_*              */
+#include <netinet/ip.h>       /* iphdr, IP_OFFMASK      */
+#include <netinet/tcp.h>      /* tcphdr                 */
+
+#include "flow.h"
+#include "pool.h"
+#include "util.h"
+
+static_assert(sizeof(struct flow) == 64, "flow entry is not a cache line");
+static_assert(sizeof(struct flow_bucket) == 64, "bucket is not a cache line");
+
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* flow_tdiff - signed distance between two (wrapping) ticks
+ *  @a : tick
+ *  @b : tick
+ *
+ *  @return : a - b
+ */
+static inline int32_t flow_tdiff(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b);
+}
+
+/* flow_slot - picks the wheel slot for a deadline
+ *  @ft      : flow table
+ *  @expires : deadline (tick)
+ *
+ *  @return : index in ft->wheel
+ *
+ * Deadlines in the next FLOW_L0_SLOTS ticks go on level 0, one slot per
+ * tick. Later ones go on level 1 and are moved down when their block of
+ * FLOW_L0_SLOTS ticks begins. Deadlines past the end of level 1 are filed
+ * in its last slot and simply re-filed when that comes up.
+ */
+static uint32_t flow_slot(struct flow_table *ft, uint32_t expires)
+{
+    int32_t delta = flow_tdiff(expires, ft->cur);
+
+    if (delta < 0)
+        expires = ft->cur;
+    else if (delta >= FLOW_L0_SLOTS * (FLOW_L1_SLOTS - 1))
+        expires = ft->cur + FLOW_L0_SLOTS * (FLOW_L1_SLOTS - 1) - 1;
+
+    if (flow_tdiff(expires, ft->cur) < FLOW_L0_SLOTS)
+        return expires % FLOW_L0_SLOTS;
+
+    return FLOW_L0_SLOTS + (expires / FLOW_L0_SLOTS) % FLOW_L1_SLOTS;
+}
+
+/* flow_link - files a flow in the wheel slot of its deadline
+ *  @ft : flow table
+ *  @f  : flow (not linked)
+ */
+static void flow_link(struct flow_table *ft, struct flow *f)
+{
+    uint32_t idx = f - ft->flows + 1;
+
+    f->wheel = flow_slot(ft, f->expires);
+    f->prev  = 0;
+    f->next  = ft->wheel[f->wheel];
+
+    if (f->next)
+        ft->flows[f->next - 1].prev = idx;
+    ft->wheel[f->wheel] = idx;
+}
+
+/* flow_unlink - takes a flow out of its wheel slot
+ *  @ft : flow table
+ *  @f  : flow (linked)
+ */
+static void flow_unlink(struct flow_table *ft, struct flow *f)
+{
+    if (f->prev)
+        ft->flows[f->prev - 1].next = f->next;
+    else
+        ft->wheel[f->wheel] = f->next;
+
+    if (f->next)
+        ft->flows[f->next - 1].prev = f->prev;
+}
+
+/* flow_release - removes a flow from the table
+ *  @ft : flow table
+ *  @f  : flow (linked)
+ */
+static void flow_release(struct flow_table *ft, struct flow *f)
+{
+    flow_unlink(ft, f);
+    ft->buckets[f->pos / FLOW_WAYS].idx[f->pos % FLOW_WAYS] = 0;
+
+    f->next  = ft->free;
+    ft->free = f - ft->flows + 1;
+    ft->used--;
+}
+
+/* flow_drain - reclaims or re-files the flows of one wheel slot
+ *  @ft     : flow table
+ *  @slot   : index in ft->wheel
+ *  @budget : max flows to handle; decremented
+ *
+ *  @return : 0 if the slot is now empty
+ *
+ * Re-filed flows never land back in the same slot: their deadline is after
+ * ft->cur, which is what this slot stands for.
+ */
+static int flow_drain(struct flow_table *ft, uint32_t slot, uint32_t *budget)
+{
+    struct flow *f;
+
+    while (ft->wheel[slot]) {
+        if (!*budget)
+            return 1;
+        --*budget;
+
+        f = &ft->flows[ft->wheel[slot] - 1];
+
+        if (flow_tdiff(f->expires, ft->cur) > 0) {
+            flow_unlink(ft, f);
+            flow_link(ft, f);
+            continue;
+        }
+
+        flow_release(ft, f);
+        ft->expired++;
+    }
+
+    return 0;
+}
+
+/* flow_advance - runs the wheel up to the current tick
+ *  @ft : flow table
+ *
+ * Handles at most FLOW_EXPIRE_MAX flows per call, so that a mass expiry is
+ * spread over several bursts; a slot that wasn't emptied is resumed by the
+ * next call. A jump of more than one full turn (e.g.: the queue was idle)
+ * only replays the last turn, which still visits every slot.
+ */
+static void flow_advance(struct flow_table *ft)
+{
+    const uint32_t turn   = FLOW_L0_SLOTS * FLOW_L1_SLOTS;
+    uint32_t       budget = FLOW_EXPIRE_MAX;
+
+    if (flow_tdiff(ft->now, ft->cur) >= (int32_t) turn)
+        ft->cur = ft->now - turn + 1;
+
+    while (flow_tdiff(ft->now, ft->cur) >= 0) {
+        /* a new level 0 turn begins; move its level 1 flows down */
+        if (!(ft->cur % FLOW_L0_SLOTS)
+            && flow_drain(ft, FLOW_L0_SLOTS
+                   + (ft->cur / FLOW_L0_SLOTS) % FLOW_L1_SLOTS, &budget))
+            return;
+
+        if (flow_drain(ft, ft->cur % FLOW_L0_SLOTS, &budget))
+            return;
+
+        ft->cur++;
+    }
+}
+
+/* flow_reclaim - frees the flow closest to its deadline
+ *  @ft : flow table (w/o free entries)
+ *
+ * The wheel is searched in deadline order; since deadlines are only moved
+ * lazily, this is the least recently seen flow give or take a wheel turn.
+ */
+static void flow_reclaim(struct flow_table *ft)
+{
+    uint32_t slot;
+
+    for (uint32_t i = 0; i < FLOW_L0_SLOTS; i++) {
+        slot = (ft->cur + i) % FLOW_L0_SLOTS;
+        if (ft->wheel[slot])
+            goto found;
+    }
+    for (uint32_t i = 0; i < FLOW_L1_SLOTS; i++) {
+        slot = FLOW_L0_SLOTS + (ft->cur / FLOW_L0_SLOTS + i) % FLOW_L1_SLOTS;
+        if (ft->wheel[slot])
+            goto found;
+    }
+    return;
+
+found:
+    flow_release(ft, &ft->flows[ft->wheel[slot] - 1]);
+    ft->evicted++;
+}
+
+/* flow_key_eq - compares two canonical keys
+ *  @a : key
+ *  @b : key
+ *
+ *  @return : !0 if equal
+ */
+static inline int flow_key_eq(const struct flow_key *a,
+                              const struct flow_key *b)
+{
+    return a->addr[0] == b->addr[0] && a->addr[1] == b->addr[1]
+        && a->port[0] == b->port[0] && a->port[1] == b->port[1]
+        && a->proto   == b->proto;
+}
+
+/******************************************************************************
+ ****************************** PUBLIC FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* flow_create - allocates an empty flow table
+ *  @max       : max number of flows (older ones are evicted past that)
+ *  @timeout_s : idle timeout (seconds)
+ *
+ *  @return : flow table or NULL on error
+ *
+ * Memory is bounded by max: one cache line per flow plus one bucket (also
+ * a cache line) per FLOW_WAYS / 2 flows, i.e.: ~80 bytes per flow. Like
+ * the receive buffers, it is placed on the calling thread's numa node and
+ * prefaulted (see pool_map()).
+ */
+struct flow_table *flow_create(uint32_t max, uint32_t timeout_s)
+{
+    struct flow_table *ft;
+    uint32_t          n_buckets = 2;
+
+    RET(!max, NULL, "Flow table w/o flows");
+
+    while (n_buckets < max / (FLOW_WAYS / 2) && n_buckets < (1U << 31))
+        n_buckets <<= 1;
+
+    ft = (struct flow_table *) calloc(1, sizeof(*ft));
+    RET(!ft, NULL, "Unable to allocate flow table");
+
+    ft->mask    = n_buckets - 1;
+    ft->max     = max;
+    ft->timeout = ((uint64_t) timeout_s * 1000 + FLOW_TICK_MS - 1)
+                / FLOW_TICK_MS ? : 1;
+    ft->len     = (size_t) n_buckets * sizeof(*ft->buckets)
+                + (size_t) max * sizeof(*ft->flows);
+
+    ft->buckets = (struct flow_bucket *) pool_map(ft->len, NULL, NULL);
+    GOTO(!ft->buckets, cleanup, "Unable to map flow table");
+    ft->flows = (struct flow *) (ft->buckets + n_buckets);
+
+    /* every entry starts out free (mapping is zeroed) */
+    for (uint32_t i = 0; i < max; i++)
+        ft->flows[i].next = i + 2 <= max ? i + 2 : 0;
+    ft->free = 1;
+
+    return ft;
+
+cleanup:
+    free(ft);
+    return NULL;
+}
+
+/* flow_destroy - releases a flow table
+ *  @ft : flow table (may be NULL)
+ */
+void flow_destroy(struct flow_table *ft)
+{
+    if (!ft)
+        return;
+
+    pool_unmap(ft->buckets, ft->len);
+    free(ft);
+}
+
+/* flow_report - prints flow table stats
+ *  @ft   : flow table (may be NULL)
+ *  @name : table owner (for display)
+ *  @idx  : owner index (for display)
+ */
+void flow_report(struct flow_table *ft, const char *name, uint32_t idx)
+{
+    if (!ft)
+        return;
+
+    INFO("%s %u flows: now=%u/%u created=%lu expired=%lu evicted=%lu", name,
+         idx, ft->used, ft->max, ft->created, ft->expired, ft->evicted);
+}
+
+/* flow_key - extracts the canonical 5-tuple of a packet
+ *  @iph : ip packet (header length & total length already checked)
+ *  @key : set to the canonical key
+ *  @dir : set to the packet's direction (see struct flow)
+ *
+ *  @return : hash of the key; the same for both directions
+ *
+ * Ports are only taken from the first fragment of tcp & udp packets; other
+ * protocols (and fragments) are tracked per address pair.
+ */
+uint64_t flow_key(struct iphdr *iph, struct flow_key *key, uint8_t *dir)
+{
+    uint16_t *ports;
+    uint64_t src, dst, lo, hi;
+    uint16_t sport = 0, dport = 0;
+
+    if ((iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP)
+        && !(iph->frag_off & htons(IP_OFFMASK))
+        && ntohs(iph->tot_len) >= iph->ihl * 4 + 4)
+    {
+        ports = (uint16_t *) ((uint8_t *) iph + iph->ihl * 4);
+        sport = ports[0];
+        dport = ports[1];
+    }
+
+    src  = (uint64_t) ntohl(iph->saddr) << 16 | ntohs(sport);
+    dst  = (uint64_t) ntohl(iph->daddr) << 16 | ntohs(dport);
+    *dir = src > dst;
+
+    memset(key, 0, sizeof(*key));
+    key->addr[0] = *dir ? iph->daddr : iph->saddr;
+    key->addr[1] = *dir ? iph->saddr : iph->daddr;
+    key->port[0] = *dir ? dport : sport;
+    key->port[1] = *dir ? sport : dport;
+    key->proto   = iph->protocol;
+
+    /* murmur3 finalizer over both endpoints */
+    lo  = *dir ? dst : src;
+    hi  = *dir ? src : dst;
+    lo ^= (hi << 7 | hi >> 57) * 0x9e3779b97f4a7c15ULL ^ iph->protocol;
+    lo ^= lo >> 33;
+    lo *= 0xff51afd7ed558ccdULL;
+    lo ^= lo >> 33;
+    lo *= 0xc4ceb9fe1a85ec53ULL;
+    lo ^= lo >> 33;
+
+    return lo;
+}
+
+/* flow_find - looks up a flow, adding it if it's new
+ *  @ft   : flow table
+ *  @key  : canonical key (see flow_key())
+ *  @hash : its hash
+ *  @now  : time of processing
+ *
+ *  @return : flow (never NULL)
+ *
+ * Each lookup pushes the flow's deadline back by the idle timeout. Flows
+ * that went stale but were not reclaimed yet start over as new ones. If
+ * the table is full, the flow closest to its deadline is evicted; if both
+ * buckets are full, the home bucket's stalest flow is.
+ */
+struct flow *flow_find(struct flow_table *ft, struct flow_key *key,
+                       uint64_t hash, const struct timespec *now)
+{
+    struct flow_bucket *b[2];
+    struct flow        *f;
+    uint32_t           tick, bkt, way, idx;
+    uint16_t           sig = hash >> 48;
+
+    /* run the wheel (the clock only moves it forward) */
+    tick = ((uint64_t) now->tv_sec * 1000 + now->tv_nsec / 1000000)
+         / FLOW_TICK_MS;
+    if (unlikely(!ft->started)) {
+        ft->now     = tick;
+        ft->cur     = tick;
+        ft->started = 1;
+    }
+    if (flow_tdiff(tick, ft->now) > 0)
+        ft->now = tick;
+    if (flow_tdiff(ft->now, ft->cur) >= 0)
+        flow_advance(ft);
+
+    /* look in the home bucket & the one after it */
+    b[0] = &ft->buckets[hash & ft->mask];
+    b[1] = &ft->buckets[(hash + 1) & ft->mask];
+
+    for (uint32_t i = 0; i < 2; i++) {
+        for (way = 0; way < FLOW_WAYS; way++) {
+            if (b[i]->sig[way] != sig || !b[i]->idx[way])
+                continue;
+
+            f = &ft->flows[b[i]->idx[way] - 1];
+            if (!flow_key_eq(&f->key, key))
+                continue;
+
+            if (flow_tdiff(ft->now, f->expires) >= 0) {
+                memset(f->dir, 0, sizeof(f->dir));
+                f->pkts = 0;
+            }
+            goto out;
+        }
+    }
+
+    /* new flow; make sure there is an entry & a way for it */
+    if (!ft->free)
+        flow_reclaim(ft);
+
+    for (bkt = 0; bkt < 2; bkt++)
+        for (way = 0; way < FLOW_WAYS; way++)
+            if (!b[bkt]->idx[way])
+                goto insert;
+
+    bkt = 0;
+    way = 0;
+    for (uint32_t i = 1; i < FLOW_WAYS; i++)
+        if (flow_tdiff(ft->flows[b[0]->idx[i] - 1].expires,
+                ft->flows[b[0]->idx[way] - 1].expires) < 0)
+            way = i;
+    flow_release(ft, &ft->flows[b[0]->idx[way] - 1]);
+    ft->evicted++;
+
+insert:
+    idx      = ft->free;
+    f        = &ft->flows[idx - 1];
+    ft->free = f->next;
+    ft->used++;
+    ft->created++;
+
+    memset(f, 0, sizeof(*f));
+    f->key  = *key;
+    f->pos  = ((hash + bkt) & ft->mask) * FLOW_WAYS + way;
+
+    b[bkt]->sig[way] = sig;
+    b[bkt]->idx[way] = idx;
+
+    f->expires = ft->now + ft->timeout;
+    flow_link(ft, f);
+
+out:
+    /* only the deadline moves; the wheel re-files the flow lazily */
+    f->expires = ft->now + ft->timeout;
+    f->pkts++;
+    return f;
+}
+
+/* flow_learn - records the stateful tcp options that a packet carries
+ *  @f   : packet's flow
+ *  @dir : packet's direction
+ *  @iph : ip packet (ip header already checked)
+ *
+ * The timestamp's TSecr is the peer's latest TSval as seen by the sender.
+ * As long as the peer's own packets don't go through the queue, it stands
+ * in for them; this keeps echoed values right when only one direction is
+ * queued. Must run before the packet's options are replaced.
+ */
+void flow_learn(struct flow *f, uint8_t dir, struct iphdr *iph)
+{
+    struct tcphdr *tcph;
+    uint8_t       *op, *end;
+
+    if (iph->protocol != IPPROTO_TCP
+        || ntohs(iph->tot_len) < iph->ihl * 4 + sizeof(*tcph))
+        return;
+
+    tcph = (struct tcphdr *) ((uint8_t *) iph + iph->ihl * 4);
+    op   = (uint8_t *) (tcph + 1);
+    end  = (uint8_t *) tcph + tcph->doff * 4;
+    if (end > (uint8_t *) iph + ntohs(iph->tot_len))
+        return;
+
+    f->dir[dir].seen = 1;
+
+    while (op < end && *op != 0x00) {
+        if (*op == 0x01) {
+            op++;
+            continue;
+        }
+        if (op + 2 > end || op[1] < 2 || op + op[1] > end)
+            break;
+
+        /* timestamp */
+        if (op[0] == 0x08 && op[1] == 10) {
+            f->dir[dir].ts_val  = ntohl(*(uint32_t *) (op + 2));
+            f->dir[dir].has_ts  = 1;
+            f->dir[dir].ts_syn |= tcph->syn;
+
+            if (tcph->ack && !f->dir[!dir].seen) {
+                f->dir[!dir].ts_val = ntohl(*(uint32_t *) (op + 6));
+                f->dir[!dir].has_ts = 1;
+            }
+        }
+
+        /* echo (RFC 1072) */
+        if (op[0] == 0x06 && op[1] == 6) {
+            f->dir[dir].echo     = ntohl(*(uint32_t *) (op + 2));
+            f->dir[dir].has_echo = 1;
+        }
+
+        op += op[1];
+    }
+}
@@ -19,124 +19,46 @@
 
 #include <stdio.h>            /* size_t                 */
 #include <stdint.h>           /* [u]int*_t              */
-#include <signal.h>           /* siginterrupt           */
-#include <unistd.h>           /* read, geteuid          */
-#include <string.h>           /* memset, memmove        */
-#include <stdlib.h>           /* malloc, system, exit   */
-#include <arpa/inet.h>        /* ntohl, ...             */
-#include <netinet/ip.h>       /* iphdr                  */
-#include <netinet/tcp.h>      /* tcphdr                 */
-#include <netinet/udp.h>      /* udphdr                 */
-#include <netinet/in.h>       /* IPPROTO_*              */
-
-#include <stdbool.h>          /* fixes pktbuff.h error  */
-#include <linux/netfilter.h>  /* NF_ACCEPT              */
-#include <libnetfilter_queue/libnetfilter_queue.h>
-
-/* prefer writing these in C due to Designated Initializers      *
- * makes the usage of callback arrays more pleasant              *
- *                                                               *
- * TODO: clang has support for designated initializers in c++    *
- *       maybe make the switch at some point; dont' care for now */
-extern "C" {
-#include "str_proto.h"
-#include "csum.h"
-}
+#include <signal.h>           /* sigaction, sigsuspend  */
+#include <unistd.h>           /* geteuid, sysconf       */
+#include <string.h>           /* memset                 */
+#include <stdlib.h>           /* calloc, free           */
+#include <pthread.h>          /* pthread_*              */
+
 #include "cli_args.h"
+#include "worker.h"
+#include "offline.h"
+#include "budget.h"
 #include "util.h"
 
-/******************************************************************************
- **************************** IMPORTANT VARIABLES *****************************
- ******************************************************************************/
-
-static bool bml = false;    /* break main loop */
-
 /******************************************************************************
  ****************************** LOCAL FUNCTIONS *******************************
  ******************************************************************************/
 
 /* sigint_handler - sets <break main loop> variable to true
  *  @<redacted> : signal number; don't care to access it
+ *
+ * Also installed for SIGUSR1, which is used only to interrupt the workers'
+ * blocking reads once the main thread decides to shut down.
  */
 static void sigint_handler(int)
 {
     bml = true;
 }
 
-/* annotator - callback routine for NetfilterQueue
- *  @qh    : netfilter queue handle
- *  @nfmsg : general form of address family dependent message
- *  @nfd   : nfq related data for packet evaluation
- *  @data  : data parameter passed unchanged by nfq_create_queue()
- *           here, NULL
- *
- *  @return : 0 if ok, -1 on error (handled by nfq_set_verdict())
+/* budget requests (set by sigbudget_handler()) */
+static volatile sig_atomic_t budget_reload;
+static volatile sig_atomic_t budget_dump;
+
+/* sigbudget_handler - notes a runtime budget request for the main thread
+ *  @sig : SIGHUP (re-read --budget-file) or SIGUSR2 (print counters)
  */
-static int32_t annotator(struct nfq_q_handle *qh,
-                         struct nfgenmsg     *nfmsg,
-                         struct nfq_data     *nfd,
-                         void                *data)
+static void sigbudget_handler(int sig)
 {
-    static uint8_t              mod_buffer[0xffff]; /* modified packet     */
-    struct nfqnl_msg_packet_hdr *ph;                /* nfq meta header     */
-    struct iphdr                *iph;               /* ip header           */
-    struct iphdr                *mod_iph;           /* modified packet hdr */
-    uint8_t                     *ops_buffer;        /* complete ops buffer */
-    size_t                      ops_len;            /* complete ops length */
-    ssize_t                     ans;                /* answer              */
-
-    /* get nfq packet header (w/ metadata) */
-    ph = nfq_get_msg_packet_hdr(nfd);
-    RET(!ph, -1, "Unable to retrieve packet meta hdr (%d)", errno);
-
-    /* extract raw packet */
-    ans = nfq_get_payload(nfd, (uint8_t **) &iph);
-    RET(ans == -1, -1, "Unable to retrieve packet data (%d)", errno);
-    RET(ans != ntohs(iph->tot_len), -1, "Payload size & total len mismatch");
-
-    /* show some debug info */
-    DEBUG("Received new packet: "
-          "src=%u.%u.%u.%u dst=%u.%u.%u.%u proto=\"%s\"",
-          (iph->saddr >>  0) & 0xff, (iph->saddr >>  8) & 0xff,
-          (iph->saddr >> 16) & 0xff, (iph->saddr >> 24) & 0xff,
-          (iph->daddr >>  0) & 0xff, (iph->daddr >>  8) & 0xff,
-          (iph->daddr >> 16) & 0xff, (iph->daddr >> 24) & 0xff,
-          str_ipproto[iph->protocol]);
-
-    /* decode protocol specific ops (may depend on packet contents)         *
-     * NOTE: 0 len may mean that an error has occurred and will be reported *
-     *       by the decoder or that the target protcol was not found in the *
-     *       captured packet; for the latter case, refine the iptables rule */
-    ops_len = args.decoder(iph, (void **) &ops_buffer, args.overwrite);
-    GOTO(!ops_len, pass_unchanged, "Decoding failed");
-
-    /* reassemble the packet by incorporating the decoded options */
-    ans = args.reasmbl(iph, mod_buffer, ops_buffer, ops_len, args.overwrite);
-    GOTO(ans, pass_unchanged, "Reassembly failed");
-
-    /* recalculate layer 4 and layer 3 checksums for updated content          *
-     * NOTE: even if a layer 4 protocol does not require checksum calculation *
-     *       it should still have a 'return 0' callback                       */
-    mod_iph = (struct iphdr *) mod_buffer;
-    ans = layer4_csum[mod_iph->protocol](mod_iph);
-    GOTO(ans, pass_unchanged, "Layer 4 checksum failed");
-
-    ans = ipv4_csum(mod_iph);
-    GOTO(ans, pass_unchanged, "Layer 3 checksum failed");
-
-    /* in case of filter chaining */
-    if (args.redirect)
-        goto redirect;
-
-    /* set verdict */
-pass_changed:
-    return nfq_set_verdict(qh, ntohl(ph->packet_id), NF_ACCEPT,
-        ntohs(mod_iph->tot_len), mod_buffer);
-pass_unchanged:
-    return nfq_set_verdict(qh, ntohl(ph->packet_id), NF_ACCEPT, 0, NULL);
-redirect:
-    return nfq_set_verdict(qh, ntohl(ph->packet_id),
-        (args.nq_num << 16) | NF_QUEUE, ntohs(mod_iph->tot_len), mod_buffer);
+    if (sig == SIGHUP)
+        budget_reload = 1;
+    else
+        budget_dump = 1;
 }
 
 /******************************************************************************
@@ -145,63 +67,119 @@ redirect:
 
 int32_t main(int argc, char **argv)
 {
-    struct sigaction    act;            /* signal response action */
-    struct nfq_handle   *h  = NULL;     /* nfq connection handle  */
-    struct nfq_q_handle *qh = NULL;     /* nfq queue              */
-    int32_t             fd;             /* nfq file descriptor    */
-    uint8_t             buffer[0xffff]; /* packet buffer          */
-    ssize_t             ans;            /* answer                 */
-
-    /* check effective user id */
-    DIE(geteuid(), "Please run as root");
+    struct sigaction act;           /* signal response action     */
+    sigset_t         blocked;       /* signals blocked in workers */
+    sigset_t         oldmask;       /* original signal mask       */
+    struct worker    *workers;      /* one worker per queue       */
+    size_t           n_workers;     /* number of queues           */
+    long             n_cpus;        /* number of online cpus      */
+    size_t           spawned = 0;   /* successfully started       */
+    ssize_t          ans;           /* answer                     */
 
     /* parse command line argumnets */
     argp_parse(&argp, argc, argv, 0, 0, &args);
-    DIE(!args.ops, "No user options provided");
-    DIE(!args.ops_len, "User options have length 0");
+    DIE(!args.layers, "No protocol specified");
+    for (uint8_t l = 0; l < LAYER_MAX; l++) {
+        if (!(args.layers & 1 << l))
+            continue;
+        DIE(!args.ops[l], "No user options provided");
+        DIE(!args.ops_len[l], "User options have length 0");
+    }
+    DIE(args.q_last < args.q_num, "Invalid queue range");
+    DIE(args.pipeline && args.uring, "Pipeline & io_uring modes are exclusive");
     INFO("Parsed cli arguments");
 
-    /* open nfq handle */
-    h = nfq_open();
-    DIE(!h, "Unable to open nfq handle (%s)", strerror(errno));
-    INFO("Opened nfq handle");
+    /* calibrate the timestamp source (if needed) */
+    clk_init(args.clock);
 
-    /* bind nfq handle to queue */
-    qh = nfq_create_queue(h, args.q_num, annotator, NULL);
-    GOTO(!qh, cleanup_handle, "Unable to create a queue (%s)",
-        strerror(errno));
-    INFO("Bound nfq handle to queue");
+    /* annotate a capture file; no queues involved */
+    if (args.offline)
+        return offline_run(args.offline, args.out);
 
-    /* set the amount of data to be copied to userspace (max ip packet size) */
-    ans = nfq_set_mode(qh, NFQNL_COPY_PACKET, sizeof(buffer));
-    GOTO(ans < 0, cleanup_queue, "Unable to set mode (%s)", strerror(errno));
-    INFO("Set copy packet mode");
-
-    /* obtain fd of queue handle's associated socket */
-    fd = nfq_fd(h);
+    /* check effective user id */
+    DIE(geteuid(), "Please run as root");
 
     /* set gracious behaviour for Ctrl^C signal                            *
      * because SA_RESTART is not set, interrupted syscalls fail with EINTR */
     memset(&act, 0, sizeof(act));
     act.sa_handler = sigint_handler;
     ans = sigaction(SIGINT, &act, NULL);
-    GOTO(ans == -1, cleanup_queue, "Unable to set new SIGINT handler (%s)",
-        strerror(errno));
-
-    /* read packets into userspace buffer & invoke callback */
-    INFO("Starting main loop");
-    while ((ans = read(fd, buffer, sizeof(buffer)))) {
-        GOTO(ans < 0, cleanup_queue, "Error reading from socket (%s)",
+    DIE(ans == -1, "Unable to set new SIGINT handler (%s)", strerror(errno));
+    ans = sigaction(SIGUSR1, &act, NULL);
+    DIE(ans == -1, "Unable to set new SIGUSR1 handler (%s)", strerror(errno));
+
+    /* runtime budget control */
+    if (args.budget) {
+        act.sa_handler = sigbudget_handler;
+        ans = sigaction(SIGHUP, &act, NULL);
+        DIE(ans == -1, "Unable to set new SIGHUP handler (%s)",
+            strerror(errno));
+        ans = sigaction(SIGUSR2, &act, NULL);
+        DIE(ans == -1, "Unable to set new SIGUSR2 handler (%s)",
             strerror(errno));
+    }
 
-        nfq_handle_packet(h, (char *) buffer, ans);
+    /* workers inherit the signal mask; keep SIGINT (& the budget signals) *
+     * for the main thread                                                */
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGHUP);
+    sigaddset(&blocked, SIGUSR2);
+    ans = pthread_sigmask(SIG_BLOCK, &blocked, &oldmask);
+    DIE(ans, "Unable to block SIGINT (%s)", strerror(ans));
+
+    /* allocate worker contexts */
+    n_workers = args.q_last - args.q_num + 1;
+    workers = (struct worker *) calloc(n_workers, sizeof(struct worker));
+    DIE(!workers, "Unable to allocate memory (%d)", errno);
+
+    n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    DIE(n_cpus < 1, "Unable to get number of cpus (%s)", strerror(errno));
+
+    /* start one worker per queue */
+    for (; spawned < n_workers; spawned++) {
+        workers[spawned].q_num = args.q_num + spawned;
+        workers[spawned].cpu   = args.pin_cpu ? spawned % n_cpus : -1;
+
+        ans = pthread_create(&workers[spawned].tid, NULL, worker_main,
+                &workers[spawned]);
+        GOTO(ans, stop_workers, "Unable to start worker for queue %zu (%s)",
+            args.q_num + spawned, strerror(ans));
     }
+    INFO("Started %zu worker(s)", spawned);
+
+    /* wait for Ctrl^C (atomically unblocking SIGINT)            *
+     * NOTE: the workers apply budget changes at their next burst */
+    while (!bml) {
+        sigsuspend(&oldmask);
+
+        if (budget_reload) {
+            budget_reload = 0;
+            if (args.budget_file)
+                budget_load(args.budget_file);
+            else
+                WAR("No --budget-file to reload");
+        }
+        if (budget_dump) {
+            budget_dump = 0;
+            budget_request_report();
+        }
+    }
+
+stop_workers:
+    bml = true;
 
-cleanup_queue:
-    nfq_destroy_queue(qh);
-cleanup_handle:
-    nfq_close(h);
+    /* interrupt blocking reads until each worker notices bml              *
+     * NOTE: a worker may be between checking bml and calling read() when *
+     *       the first signal arrives; keep nudging until it is joinable   */
+    for (size_t i = 0; i < spawned; i++) {
+        while (pthread_tryjoin_np(workers[i].tid, NULL)) {
+            pthread_kill(workers[i].tid, SIGUSR1);
+            usleep(1000);
+        }
+    }
+
+    free(workers);
 
     return 0;
 }
-
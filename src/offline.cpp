@@ -0,0 +1,406 @@
+/*
+ * Copyright © 2021, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of ops-inject.
+ *
+ * ops-inject is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ops-inject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>            /* FILE, fwrite, setvbuf  */
+#include <stdint.h>           /* [u]int*_t              */
+#include <stdlib.h>           /* calloc, free           */
+#include <string.h>           /* memcpy                 */
+#include <time.h>             /* clock_gettime          */
+#include <fcntl.h>            /* open                   */
+#include <unistd.h>           /* close                  */
+#include <byteswap.h>         /* bswap_*                */
+#include <arpa/inet.h>        /* ntohs                  */
+#include <netinet/ip.h>       /* iphdr                  */
+#include <sys/mman.h>         /* mmap                   */
+#include <sys/stat.h>         /* fstat                  */
+
+#include "reassemblers.h"
+#include "annotate.h"
+#include "flow.h"
+#include "budget.h"
+#include "pmtu.h"
+#include "cli_args.h"
+#include "offline.h"
+#include "util.h"
+
+/* pcap magic numbers (as read in native byte order) */
+#define PCAP_MAGIC_US       0xa1b2c3d4      /* microsecond timestamps   */
+#define PCAP_MAGIC_NS       0xa1b23c4d      /* nanosecond timestamps    */
+
+/* supported link types */
+#define LINKTYPE_ETHERNET   1               /* 14 byte ethernet header  */
+#define LINKTYPE_RAW        101             /* ip packet, no link layer */
+#define LINKTYPE_LINUX_SLL  113             /* linux cooked v1          */
+#define LINKTYPE_IPV4       228             /* ipv4 packet only         */
+#define LINKTYPE_LINUX_SLL2 276             /* linux cooked v2          */
+
+#define ETH_P_IPV4          0x0800
+#define ETH_P_VLAN          0x8100
+
+/* pcap file header */
+struct pcap_hdr {
+    uint32_t magic;         /* PCAP_MAGIC_* (maybe swapped) */
+    uint16_t major;         /* format version (2.4)         */
+    uint16_t minor;
+    int32_t  thiszone;      /* always 0                     */
+    uint32_t sigfigs;       /* always 0                     */
+    uint32_t snaplen;       /* max captured length          */
+    uint32_t linktype;      /* LINKTYPE_*                   */
+};
+
+/* pcap record header */
+struct pcap_rec {
+    uint32_t ts_sec;        /* timestamp (seconds)          */
+    uint32_t ts_frac;       /* timestamp (us or ns)         */
+    uint32_t incl_len;      /* captured length              */
+    uint32_t orig_len;      /* length on the wire           */
+};
+
+/* records annotated together */
+struct pcap_burst {
+    struct burst    b;                      /* ip packets (NULL if none)  */
+    struct pcap_rec rec[BURST_MAX];         /* record headers (host order) */
+    uint8_t         *pkt[BURST_MAX];        /* record data                */
+    ssize_t         off[BURST_MAX];         /* link layer header length   */
+    uint8_t         changed[BURST_MAX];     /* !0 if b.sg[] is valid      */
+    uint32_t        n;                      /* records in burst           */
+};
+
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* rd16 - reads an unaligned big endian 16-bit value
+ *  @p : data
+ *
+ *  @return : value in host byte order
+ */
+static inline uint16_t rd16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+/* link_supported - checks if link_offset() knows a link type
+ *  @linktype : LINKTYPE_*
+ *
+ *  @return : !0 if supported
+ */
+static int link_supported(uint32_t linktype)
+{
+    return linktype == LINKTYPE_ETHERNET
+        || linktype == LINKTYPE_RAW
+        || linktype == LINKTYPE_LINUX_SLL
+        || linktype == LINKTYPE_IPV4
+        || linktype == LINKTYPE_LINUX_SLL2;
+}
+
+/* link_offset - finds the ipv4 header behind the link layer header
+ *  @linktype : LINKTYPE_*
+ *  @pkt      : captured frame
+ *  @len      : captured length
+ *
+ *  @return : offset of the ip header or -1 if not ipv4 (or not supported)
+ */
+static ssize_t link_offset(uint32_t linktype, uint8_t *pkt, size_t len)
+{
+    switch (linktype) {
+        case LINKTYPE_ETHERNET:
+            if (len >= 18 && rd16(pkt + 12) == ETH_P_VLAN)
+                return rd16(pkt + 16) == ETH_P_IPV4 ? 18 : -1;
+            return len >= 14 && rd16(pkt + 12) == ETH_P_IPV4 ? 14 : -1;
+        case LINKTYPE_LINUX_SLL:
+            return len >= 16 && rd16(pkt + 14) == ETH_P_IPV4 ? 16 : -1;
+        case LINKTYPE_LINUX_SLL2:
+            return len >= 20 && rd16(pkt) == ETH_P_IPV4 ? 20 : -1;
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+            return len && pkt[0] >> 4 == 4 ? 0 : -1;
+    }
+
+    return -1;
+}
+
+/* write_rec - appends one record to the output capture
+ *  @out     : output stream
+ *  @rec     : original record header (host byte order)
+ *  @link    : link layer header
+ *  @off     : length of link layer header
+ *  @sg      : modified packet
+ *  @old_len : length of the original ip packet
+ *
+ *  @return : 0 if everything went ok
+ *
+ * Anything captured after the original ip packet (e.g.: ethernet padding)
+ * is dropped.
+ */
+static int write_rec(FILE            *out,
+                     struct pcap_rec *rec,
+                     uint8_t         *link,
+                     size_t          off,
+                     struct pkt_sg   *sg,
+                     size_t          old_len)
+{
+    struct pcap_rec nrec;
+    size_t          new_len = sg->head_len + sg->body_len + sg->tail_len;
+    size_t          ans;
+
+    nrec.ts_sec   = rec->ts_sec;
+    nrec.ts_frac  = rec->ts_frac;
+    nrec.incl_len = off + new_len;
+    nrec.orig_len = rec->orig_len + new_len - old_len;
+
+    ans  = fwrite(&nrec, sizeof(nrec), 1, out);
+    ans &= fwrite(link, off, 1, out)         || !off;
+    ans &= fwrite(sg->head, sg->head_len, 1, out);
+    ans &= fwrite(sg->body, sg->body_len, 1, out) || !sg->body_len;
+    ans &= fwrite(sg->tail, sg->tail_len, 1, out) || !sg->tail_len;
+    RET(!ans, 1, "Unable to write record (%s)", strerror(errno));
+
+    return 0;
+}
+
+/* flush_burst - annotates a burst of records & writes them out in order
+ *  @out : output stream (NULL to only annotate)
+ *  @pb  : records
+ *
+ *  @return : number of modified records or -1 on error
+ */
+static ssize_t flush_burst(FILE *out, struct pcap_burst *pb)
+{
+    ssize_t n_mod;
+    size_t  ans;
+
+    n_mod = args.annotate_burst(&pb->b, pb->n, pb->changed);
+
+    for (uint32_t i = 0; out && i < pb->n; i++) {
+        if (pb->changed[i]) {
+            ans = write_rec(out, &pb->rec[i], pb->pkt[i], pb->off[i],
+                    &pb->b.sg[i], pb->b.tot_len[i]);
+            RET(ans, -1, "Unable to write record");
+            continue;
+        }
+
+        ans  = fwrite(&pb->rec[i], sizeof(pb->rec[i]), 1, out);
+        ans &= fwrite(pb->pkt[i], pb->rec[i].incl_len, 1, out)
+            || !pb->rec[i].incl_len;
+        RET(!ans, -1, "Unable to write record (%s)", strerror(errno));
+    }
+
+    pb->n = 0;
+    return n_mod;
+}
+
+/******************************************************************************
+ ****************************** PUBLIC FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* offline_run - runs the annotation chain over a capture file
+ *  @in_path  : input pcap
+ *  @out_path : output pcap (NULL to only measure)
+ *
+ *  @return : 0 if everything went ok
+ *
+ * The input is memory mapped (privately, so nothing is written back) and
+ * every ipv4 packet is passed to annotate_burst(), i.e.: the same decoder,
+ * reassembler & checksum chain as the live path, BURST_MAX records at a
+ * time. Non-ipv4 and truncated packets are copied through unchanged.
+ * Throughput is measured over the whole loop; leave out the output file to
+ * time only the annotation.
+ *
+ * W/ --clock=packet, time dependent options use the capture timestamps, so
+ * the output is reproducible; otherwise, the clock is sampled per packet.
+ * Flows are tracked (and expired) by the same clock.
+ */
+int offline_run(const char *in_path, const char *out_path)
+{
+    struct pcap_hdr   hdr;            /* input file header      */
+    struct pcap_rec   rec;            /* current record header  */
+    struct pcap_burst *pb = NULL;     /* records in flight      */
+    struct stat       statbuf;        /* input file stats       */
+    struct timespec   t0, t1;         /* processing interval    */
+    struct iphdr      *iph;           /* current ip packet      */
+    uint8_t           *base, *pos, *end, *pkt;
+    uint32_t          i;              /* index in burst         */
+    FILE              *out = NULL;
+    uint64_t          n_pkts = 0, n_mod = 0;
+    uint64_t          elapsed;
+    uint8_t           swapped;
+    ssize_t           off;
+    int               fd, ret = 1;
+    ssize_t           ans;
+
+    /* map input capture */
+    fd = open(in_path, O_RDONLY);
+    RET(fd == -1, 1, "Unable to open %s (%s)", in_path, strerror(errno));
+
+    ans = fstat(fd, &statbuf);
+    GOTO(ans == -1, cleanup_fd, "Unable to stat %s (%s)", in_path,
+        strerror(errno));
+    GOTO(statbuf.st_size < (off_t) sizeof(hdr), cleanup_fd,
+        "%s is not a pcap file", in_path);
+
+    base = (uint8_t *) mmap(NULL, statbuf.st_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    GOTO(base == MAP_FAILED, cleanup_fd, "Unable to map %s (%s)", in_path,
+        strerror(errno));
+    end = base + statbuf.st_size;
+
+    /* check file header */
+    memcpy(&hdr, base, sizeof(hdr));
+    swapped = hdr.magic == bswap_32(PCAP_MAGIC_US)
+           || hdr.magic == bswap_32(PCAP_MAGIC_NS);
+    if (swapped) {
+        hdr.magic    = bswap_32(hdr.magic);
+        hdr.major    = bswap_16(hdr.major);
+        hdr.minor    = bswap_16(hdr.minor);
+        hdr.snaplen  = bswap_32(hdr.snaplen);
+        hdr.linktype = bswap_32(hdr.linktype);
+    }
+    GOTO(hdr.magic != PCAP_MAGIC_US && hdr.magic != PCAP_MAGIC_NS,
+        cleanup_map, "%s is not a pcap file", in_path);
+    GOTO(!link_supported(hdr.linktype), cleanup_map,
+        "Unsupported link type %u", hdr.linktype);
+
+    /* open output capture (same format, in host byte order)          *
+     * NOTE: injected options can push packets past the input snaplen */
+    if (out_path) {
+        out = fopen(out_path, "w");
+        GOTO(!out, cleanup_map, "Unable to open %s (%s)", out_path,
+            strerror(errno));
+        setvbuf(out, NULL, _IOFBF, PCAP_OUT_BUF);
+
+        hdr.thiszone = 0;
+        hdr.sigfigs  = 0;
+        hdr.snaplen  = hdr.snaplen > 0x40000 ? hdr.snaplen : 0x40000;
+
+        ans = fwrite(&hdr, sizeof(hdr), 1, out);
+        GOTO(!ans, cleanup_out, "Unable to write %s (%s)", out_path,
+            strerror(errno));
+    }
+
+    /* no room to grow the packets in place; the capture is contiguous */
+    pb = (struct pcap_burst *) calloc(1, sizeof(*pb));
+    GOTO(!pb, cleanup_out, "Unable to allocate burst");
+
+    if (args.flows) {
+        pb->b.ft = flow_create(args.flows, args.flow_timeout);
+        GOTO(!pb->b.ft, cleanup_out, "Unable to create flow table");
+    }
+    if (args.budget) {
+        pb->b.bg = budget_create("Offline", 0);
+        GOTO(!pb->b.bg, cleanup_out, "Unable to create budget");
+    }
+    if (args.pmtu) {
+        pb->b.pm = pmtu_create(args.mtu, 0);
+        GOTO(!pb->b.pm, cleanup_out, "Unable to create path mtu cache");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    for (pos = base + sizeof(hdr); pos + sizeof(rec) <= end;
+         pos += sizeof(rec) + rec.incl_len)
+    {
+        memcpy(&rec, pos, sizeof(rec));
+        if (swapped) {
+            rec.ts_sec   = bswap_32(rec.ts_sec);
+            rec.ts_frac  = bswap_32(rec.ts_frac);
+            rec.incl_len = bswap_32(rec.incl_len);
+            rec.orig_len = bswap_32(rec.orig_len);
+        }
+
+        pkt = pos + sizeof(rec);
+        if (pkt + rec.incl_len > end) {
+            ALERT(1, "Capture ends w/ truncated record");
+            break;
+        }
+        n_pkts++;
+
+        i = pb->n++;
+        pb->rec[i]    = rec;
+        pb->pkt[i]    = pkt;
+        pb->b.iph[i]  = NULL;
+
+        /* look for a complete ipv4 packet */
+        off = link_offset(hdr.linktype, pkt, rec.incl_len);
+        pb->off[i] = off;
+
+        iph = (struct iphdr *) (pkt + off);
+        if (off != -1
+        &&  rec.incl_len - off >= (ssize_t) sizeof(*iph)
+        &&  ntohs(iph->tot_len) <= rec.incl_len - off
+        &&  ntohs(iph->tot_len) >= iph->ihl * 4)
+        {
+            pb->b.iph[i] = iph;
+        }
+
+        if (args.clock == CLK_PACKET) {
+            pb->b.ctx[i].now.tv_sec  = rec.ts_sec;
+            pb->b.ctx[i].now.tv_nsec = hdr.magic == PCAP_MAGIC_NS
+                                     ? rec.ts_frac : rec.ts_frac * 1000;
+        } else
+            clk_burst(&pb->b.ctx[i].now);
+
+        if (pb->n < BURST_MAX)
+            continue;
+
+        ans = flush_burst(out, pb);
+        GOTO(ans < 0, cleanup_out, "Unable to write %s", out_path);
+        n_mod += ans;
+    }
+
+    ans = flush_burst(out, pb);
+    GOTO(ans < 0, cleanup_out, "Unable to write %s", out_path);
+    n_mod += ans;
+
+    if (out) {
+        ans = fflush(out);
+        GOTO(ans, cleanup_out, "Unable to write %s (%s)", out_path,
+            strerror(errno));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    elapsed = (t1.tv_sec - t0.tv_sec) * 1000000000UL
+            + t1.tv_nsec - t0.tv_nsec;
+
+    INFO("Processed %lu packets (%lu modified) in %.3f ms",
+         n_pkts, n_mod, elapsed / 1e6);
+    INFO("%.0f pps, %.1f ns/pkt",
+         elapsed ? n_pkts * 1e9 / elapsed : 0.0,
+         n_pkts ? (double) elapsed / n_pkts : 0.0);
+
+    flow_report(pb->b.ft, "Offline", 0);
+    budget_report(pb->b.bg);
+    pmtu_report(pb->b.pm, "Offline", 0);
+
+    ret = 0;
+cleanup_out:
+    if (pb) {
+        flow_destroy(pb->b.ft);
+        budget_destroy(pb->b.bg);
+        pmtu_destroy(pb->b.pm);
+    }
+    free(pb);
+    if (out)
+        fclose(out);
+cleanup_map:
+    munmap(base, statbuf.st_size);
+cleanup_fd:
+    close(fd);
+    return ret;
+}
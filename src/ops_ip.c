@@ -17,7 +17,6 @@
  * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <sys/time.h>       /* gettimeofday    */
 #include <arpa/inet.h>      /* htonl           */
 #include <string.h>         /* memset          */
 
@@ -28,12 +27,17 @@
 #define _TRACEROUTE_MODE    /* see decode_ts */
 
 
+/* shrink variable length options to the space left (see --pmtu=shrink) */
+uint8_t ip_ops_shrink = 0;
+
+
 /* decode_eool - EOOL decoding callback
  *  @dst_buffer : buffer where ops are constructed before they are injected
  *  @len_left   : remaining bytes in dst_buffer
  *  @usr_ops    : reference to user specified current option
  *  @iph        : pointer to start of ip header
  *  @ops_sec    : start of temporary options buffer
+ *  @ctx        : per-packet context (e.g.: time of processing)
  *
  *  @return : number of bytes written to dst_buffer or 0 on error
  *
@@ -56,11 +60,12 @@
  *
  * NOTE: this applies to all other decoders as well, but will be omitted.
  */
-static size_t decode_eool(uint8_t      *dst_buffer,
-                          size_t       len_left,
-                          uint8_t      **usr_ops,
-                          struct iphdr *iph,
-                          uint8_t      *ops_sec)
+static size_t decode_eool(uint8_t        *dst_buffer,
+                          size_t         len_left,
+                          uint8_t        **usr_ops,
+                          struct iphdr   *iph,
+                          uint8_t        *ops_sec,
+                          struct ops_ctx *ctx)
 {
     /* sanity checks */
     RET(!usr_ops, 0, "usr_ops is NULL");
@@ -80,11 +85,12 @@ static size_t decode_eool(uint8_t      *dst_buffer,
     return 1;
 }
 
-static size_t decode_nop(uint8_t      *dst_buffer,
-                         size_t       len_left,
-                         uint8_t      **usr_ops,
-                         struct iphdr *iph,
-                         uint8_t      *ops_sec)
+static size_t decode_nop(uint8_t        *dst_buffer,
+                         size_t         len_left,
+                         uint8_t        **usr_ops,
+                         struct iphdr   *iph,
+                         uint8_t        *ops_sec,
+                         struct ops_ctx *ctx)
 {
     /* sanity checks */
     RET(!usr_ops, 0, "usr_ops is NULL");
@@ -104,34 +110,40 @@ static size_t decode_nop(uint8_t      *dst_buffer,
     return 1;
 }
 
-static size_t decode_record_route(uint8_t      *dst_buffer,
-                                  size_t       len_left,
-                                  uint8_t      **usr_ops,
-                                  struct iphdr *iph,
-                                  uint8_t      *ops_sec)
+static size_t decode_record_route(uint8_t        *dst_buffer,
+                                  size_t         len_left,
+                                  uint8_t        **usr_ops,
+                                  struct iphdr   *iph,
+                                  uint8_t        *ops_sec,
+                                  struct ops_ctx *ctx)
 {
+    size_t len = 39;
+
     /* sanity checks */
     RET(!usr_ops, 0, "usr_ops is NULL");
     RET(!iph,     0, "iph is NULL");
     RET(!ops_sec, 0, "ops_sec is NULL");
 
-    /* normal mode */
-    RET(len_left < 39, 0, "Not enough space for option");
+    /* fewer hops if that's all the packet has room for (at least one) */
+    if (ip_ops_shrink && len_left < len)
+        len = len_left < 7 ? 39 : 3 + (len_left - 3) / 4 * 4;
+
+    RET(len_left < len, 0, "Not enough space for option");
 
     /* postponing processing */
     if (!dst_buffer) {
         (*usr_ops)++;
-        return 39;
+        return len;
     }
 
-    /* allocate as much space as possible for routing data (9 hops) */
+    /* allocate as much space as possible for routing data (<= 9 hops) */
     dst_buffer[0] = ((*usr_ops)++)[0];      /* type    */
-    dst_buffer[1] = 39;                     /* length  */
+    dst_buffer[1] = len;                    /* length  */
     dst_buffer[2] = 4;                      /* pointer */
 
-    memset(dst_buffer + 3, 0, 36);
+    memset(dst_buffer + 3, 0, len - 3);
 
-    return 39;
+    return len;
 }
 
 /* the initial way this was supposed to work was by adding the generating
@@ -144,16 +156,15 @@ static size_t decode_record_route(uint8_t      *dst_buffer,
  * increment the overflow field. if we have control of both endpoints, we
  * can determine up to 8 ip-ops knowledgeable hosts along the route.
  */
-static size_t decode_ts(uint8_t      *dst_buffer,
-                        size_t       len_left,
-                        uint8_t      **usr_ops,
-                        struct iphdr *iph,
-                        uint8_t      *ops_sec)
+static size_t decode_ts(uint8_t        *dst_buffer,
+                        size_t         len_left,
+                        uint8_t        **usr_ops,
+                        struct iphdr   *iph,
+                        uint8_t        *ops_sec,
+                        struct ops_ctx *ctx)
 {
     struct timestamp *ts;
-    struct timeval   tv;
     uint32_t         msec;
-    int              ans;
 
     /* sanity checks */
     RET(!usr_ops, 0, "usr_ops is NULL");
@@ -170,11 +181,9 @@ static size_t decode_ts(uint8_t      *dst_buffer,
         return 12;
     }
 
-    /* get time of day for timestamp & convert it to ms since midnight in UT */
-    ans = gettimeofday(&tv, NULL);
-    RET(ans == -1, 0, "Unable to get time of day (%d)", errno);
-
-    msec = (tv.tv_sec % 86400) * 1000 + tv.tv_usec / 1000;
+    /* convert time of processing to ms since midnight in UT */
+    RET(!ctx, 0, "ctx is NULL");
+    msec = (ctx->now.tv_sec % 86400) * 1000 + ctx->now.tv_nsec / 1000000;
 
     /* we set only one timestamp w/ associated ip address            *
      * we use flag 0x3 to prevent middleboxes from adding timestamps */
@@ -224,11 +233,12 @@ static size_t decode_ts(uint8_t      *dst_buffer,
  * fills the space with consecutively-valued bytes until the next 32b boundary
  * if start of content is already 32b aligned, 4 more bytes are added
  */
-static size_t decode_unknown(uint8_t      *dst_buffer,
-                             size_t       len_left,
-                             uint8_t      **usr_ops,
-                             struct iphdr *iph,
-                             uint8_t      *ops_sec)
+static size_t decode_unknown(uint8_t        *dst_buffer,
+                             size_t         len_left,
+                             uint8_t        **usr_ops,
+                             struct iphdr   *iph,
+                             uint8_t        *ops_sec,
+                             struct ops_ctx *ctx)
 {
     uint8_t option_off, option_len;
 
@@ -268,11 +278,12 @@ static size_t decode_unknown(uint8_t      *dst_buffer,
  * Asking for an unimplemented option will cause this to return 0 (error) and
  * abort the option section generation. Packet should pass unmodified.
  */
-static size_t decode_dummy(uint8_t      *dst_buffer,
-                           size_t       len_left,
-                           uint8_t      **usr_ops,
-                           struct iphdr *iph,
-                           uint8_t      *ops_sec)
+static size_t decode_dummy(uint8_t        *dst_buffer,
+                           size_t         len_left,
+                           uint8_t        **usr_ops,
+                           struct iphdr   *iph,
+                           uint8_t        *ops_sec,
+                           struct ops_ctx *ctx)
 {
     return 0;
 }
@@ -280,7 +291,7 @@ static size_t decode_dummy(uint8_t      *dst_buffer,
 
 /* individual option decoder callback array */
 size_t (*ip_decoders[0x7f])(uint8_t *, size_t, uint8_t **,
-                            struct iphdr *,  uint8_t *) = {
+                            struct iphdr *, uint8_t *, struct ops_ctx *) = {
     [0x00 ... 0x7e] = decode_dummy,
 
     [0x00] = decode_eool,           /* End Of Options List */
@@ -306,3 +317,13 @@ uint64_t ip_ops_prio[0x7f] = {
     [0x5e] = 0,                     /* Experimental Option */
 };
 
+/* option content depends on the packet or on the time of processing *
+ * NOTE: all other options are rendered once per header size & cached *
+ *       by the decoder (see decoders.cpp)                            */
+uint8_t ip_ops_dyn[0x7f] = {
+    [0x00 ... 0x7e] = 0,
+
+#ifndef _TRACEROUTE_MODE
+    [0x44] = 1,                     /* TimeStamp           */
+#endif
+};
@@ -17,10 +17,10 @@
  * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <sys/time.h>       /* gettimeofday    */
 #include <arpa/inet.h>      /* htonl           */
 
 #include "ops_tcp.h"
+#include "flow.h"
 #include "util.h"
 
 
@@ -30,6 +30,7 @@
  *  @usr_ops    : reference to user specified current option
  *  @iph        : pointer to start of ip header
  *  @ops_sec    : start of temporary options buffer
+ *  @ctx        : per-packet context (e.g.: time of processing)
  *
  *  @return : number of bytes written to dst_buffer or 0 on error
  *
@@ -52,11 +53,12 @@
  *
  * NOTE: this applies to all other decoders as well, but will be omitted.
  */
-static size_t decode_eool(uint8_t       *dst_buffer,
-                          size_t        len_left,
-                          uint8_t       **usr_ops,
-                          struct iphdr  *iph,
-                          uint8_t       *ops_sec)
+static size_t decode_eool(uint8_t        *dst_buffer,
+                          size_t         len_left,
+                          uint8_t        **usr_ops,
+                          struct iphdr   *iph,
+                          uint8_t        *ops_sec,
+                          struct ops_ctx *ctx)
 {
     /* sanity checks */
     RET(!usr_ops, 0, "usr_ops is NULL");
@@ -80,7 +82,8 @@ static size_t decode_nop(uint8_t        *dst_buffer,
                          size_t         len_left,
                          uint8_t        **usr_ops,
                          struct iphdr   *iph,
-                         uint8_t        *ops_sec)
+                         uint8_t        *ops_sec,
+                         struct ops_ctx *ctx)
 {
     /* sanity checks */
     RET(!usr_ops, 0, "usr_ops is NULL");
@@ -100,14 +103,68 @@ static size_t decode_nop(uint8_t        *dst_buffer,
     return 1;
 }
 
-/* obsoleted in RFC6247                                                *
- * this function implements both echo (kind=6) and echo reply (kind=7) */
-static size_t decode_echo_reply(uint8_t       *dst_buffer,
-                                size_t        len_left,
-                                uint8_t       **usr_ops,
-                                struct iphdr  *iph,
-                                uint8_t       *ops_sec)
+/* ctx_ms - time of processing as a 32b millisecond clock
+ *  @ctx : per-packet context
+ *
+ *  @return : wrapping millisecond count
+ */
+static inline uint32_t ctx_ms(struct ops_ctx *ctx)
+{
+    return (uint32_t) ctx->now.tv_sec * 1000 + ctx->now.tv_nsec / 1000000;
+}
+
+/* obsoleted in RFC6247                                       *
+ * echo (kind=6) carries the sender's clock; it is recorded in *
+ * the flow so that the peer's echo reply can return it         */
+static size_t decode_echo(uint8_t        *dst_buffer,
+                          size_t         len_left,
+                          uint8_t        **usr_ops,
+                          struct iphdr   *iph,
+                          uint8_t        *ops_sec,
+                          struct ops_ctx *ctx)
+{
+    uint32_t val;
+
+    /* sanity checks */
+    RET(!usr_ops, 0, "usr_ops is NULL");
+    RET(!iph,     0, "iph is NULL");
+    RET(!ops_sec, 0, "ops_sec is NULL");
+
+    RET(len_left < 6, 0, "Not enough space for option");
+
+    /* postponing processing */
+    if (!dst_buffer) {
+        (*usr_ops)++;
+        return 6;
+    }
+
+    RET(!ctx, 0, "ctx is NULL");
+    val = ctx_ms(ctx);
+
+    if (ctx->flow) {
+        ctx->flow->dir[ctx->dir].echo     = val;
+        ctx->flow->dir[ctx->dir].has_echo = 1;
+    }
+
+    dst_buffer[0] = ((*usr_ops)++)[0];                  /* kind         */
+    dst_buffer[1] = 6;                                  /* length       */
+    *(uint32_t *) &dst_buffer[2] = htonl(val);          /* info to echo */
+
+    return 6;
+}
+
+/* obsoleted in RFC6247                                         *
+ * echo reply (kind=7) returns the peer's last echo info; 0 if  *
+ * the flow isn't tracked or the peer hasn't sent any echo yet  */
+static size_t decode_echo_reply(uint8_t        *dst_buffer,
+                                size_t         len_left,
+                                uint8_t        **usr_ops,
+                                struct iphdr   *iph,
+                                uint8_t        *ops_sec,
+                                struct ops_ctx *ctx)
 {
+    struct flow_dir *peer;
+
     /* sanity checks */
     RET(!usr_ops, 0, "usr_ops is NULL");
     RET(!iph,     0, "iph is NULL");
@@ -121,10 +178,13 @@ static size_t decode_echo_reply(uint8_t       *dst_buffer,
         return 6;
     }
 
-    /* echoed value should be timestamp; place dummy value */
+    RET(!ctx, 0, "ctx is NULL");
+    peer = ctx->flow ? &ctx->flow->dir[!ctx->dir] : NULL;
+
     dst_buffer[0] = ((*usr_ops)++)[0];                  /* kind         */
     dst_buffer[1] = 6;                                  /* length       */
-    *(uint32_t *) &dst_buffer[2] = htonl(0x01020304);   /* echoed value */
+    *(uint32_t *) &dst_buffer[2] =                      /* echoed value */
+        htonl(peer && peer->has_echo ? peer->echo : 0);
 
     return 6;
 }
@@ -133,11 +193,12 @@ static size_t decode_ts(uint8_t         *dst_buffer,
                         size_t          len_left,
                         uint8_t         **usr_ops,
                         struct iphdr    *iph,
-                        uint8_t         *ops_sec)
+                        uint8_t         *ops_sec,
+                        struct ops_ctx  *ctx)
 {
-    struct timeval  tv;
     struct tcphdr   *tcph;
-    int             ans;
+    struct flow_dir *own, *peer;
+    uint32_t        ts_val, ts_ecr;
 
     /* sanity checks */
     RET(!usr_ops, 0, "usr_ops is NULL");
@@ -152,25 +213,37 @@ static size_t decode_ts(uint8_t         *dst_buffer,
         return 10;
     }
 
-    /* get time of day for timestamp                                    *
+    /* time of processing is used for timestamp                         *
      * NOTE: unlike ip timestamps, we only care that it's monotonically *
              non-decreasing in time                                     */
-    ans = gettimeofday(&tv, NULL);
-    RET(ans == -1, 0, "Unable to get time of day (%d)", errno);
+    RET(!ctx, 0, "ctx is NULL");
 
     /* get tcp header */
     tcph = (struct tcphdr *)(((uint8_t *) iph) + iph->ihl * 4);
+    own  = ctx->flow ? &ctx->flow->dir[ctx->dir]  : NULL;
+    peer = ctx->flow ? &ctx->flow->dir[!ctx->dir] : NULL;
+
+    /* RFC 7323: timestamps outside SYNs only if this side's SYN had one *
+     * NOTE: w/o a tracked flow, there is no telling; stick to SYNs      */
+    RET(!tcph->syn && !(own && own->ts_syn), 0,
+        "TCP SYN not set and no timestamp negotiated");
+
+    /* TSval = generated ts                                 *
+     * TSecr = peer's last TSval if ACK=1 (0 if unknown) ; 0 otherwise */
+    ts_val = ctx_ms(ctx);
+    ts_ecr = tcph->ack && peer && peer->has_ts ? peer->ts_val : 0;
+
+    if (own) {
+        own->ts_val  = ts_val;
+        own->has_ts  = 1;
+        own->ts_syn |= tcph->syn;
+    }
 
-    /* for testing: do not add timestamp outside SYN (ACK) */
-    RET(!tcph->syn, 0, "TCP SYN not set");
-
-    /* TSecr = 0         if ACK=0 ; TSval is generated ts *
-     * TSval = TSecr + x if ACK=1 ; TSecr is generated ts */
-    *(uint32_t *)(dst_buffer + 2) = htonl((uint32_t) tv.tv_sec + tcph->ack * 100);
-    *(uint32_t *)(dst_buffer + 6) = htonl((uint32_t) tv.tv_sec * tcph->ack);
+    dst_buffer[0] = ((*usr_ops)++)[0];  /* kind   */
+    dst_buffer[1] = 10;                 /* length */
 
-    *(uint32_t *)(dst_buffer + 2) = htonl(10000 + tcph->ack * 100);
-    *(uint32_t *)(dst_buffer + 6) = htonl(10000 * tcph->ack);
+    *(uint32_t *)(dst_buffer + 2) = htonl(ts_val);
+    *(uint32_t *)(dst_buffer + 6) = htonl(ts_ecr);
 
     return 10;
 }
@@ -187,11 +260,12 @@ static size_t decode_ts(uint8_t         *dst_buffer,
  * fills the space with consecutively-valued bytes until the next 32b boundary
  * if start of content is already 32b aligned, 4 more bytes are added
  */
-static size_t decode_reserved(uint8_t      *dst_buffer,
-                              size_t       len_left,
-                              uint8_t      **usr_ops,
-                              struct iphdr *iph,
-                              uint8_t      *ops_sec)
+static size_t decode_reserved(uint8_t        *dst_buffer,
+                              size_t         len_left,
+                              uint8_t        **usr_ops,
+                              struct iphdr   *iph,
+                              uint8_t        *ops_sec,
+                              struct ops_ctx *ctx)
 {
     uint8_t option_off, option_len;
 
@@ -239,11 +313,12 @@ static size_t decode_reserved(uint8_t      *dst_buffer,
  * fills the space with consecutively-valued bytes until the next 32b boundary
  * if start of content is already 32b aligned, 4 more bytes are added
  */
-static size_t decode_experimental(uint8_t      *dst_buffer,
-                                  size_t       len_left,
-                                  uint8_t      **usr_ops,
-                                  struct iphdr *iph,
-                                  uint8_t      *ops_sec)
+static size_t decode_experimental(uint8_t        *dst_buffer,
+                                  size_t         len_left,
+                                  uint8_t        **usr_ops,
+                                  struct iphdr   *iph,
+                                  uint8_t        *ops_sec,
+                                  struct ops_ctx *ctx)
 {
     uint8_t option_off, option_len;
 
@@ -285,11 +360,12 @@ static size_t decode_experimental(uint8_t      *dst_buffer,
  * Asking for an unimplemented option will cause this to return 0 (error) and
  * abort the option section generation. Packet will pass unmodified.
  */
-static size_t decode_dummy(uint8_t      *dst_buffer,
-                           size_t       len_left,
-                           uint8_t      **usr_ops,
-                           struct iphdr *iph,
-                           uint8_t      *ops_sec)
+static size_t decode_dummy(uint8_t        *dst_buffer,
+                           size_t         len_left,
+                           uint8_t        **usr_ops,
+                           struct iphdr   *iph,
+                           uint8_t        *ops_sec,
+                           struct ops_ctx *ctx)
 {
     return 0;
 }
@@ -297,15 +373,13 @@ static size_t decode_dummy(uint8_t      *dst_buffer,
 
 /* individual option decoder callback array */
 size_t (*tcp_decoders[0xff])(uint8_t *, size_t, uint8_t **,
-                             struct iphdr *, uint8_t *) = {
+                             struct iphdr *, uint8_t *, struct ops_ctx *) = {
     [0x00 ... 0xfe] = decode_dummy,
 
     [0x00] = decode_eool,           /* End Of Options List */
     [0x01] = decode_nop,            /* No OPtion           */
-    //[0x06] = decode_echo_reply,     /* Echo                */
-    //[0x07] = decode_echo_reply,     /* Echo Reply          */
-    [0x06] = decode_reserved,
-    [0x07] = decode_reserved,
+    [0x06] = decode_echo,           /* Echo                */
+    [0x07] = decode_echo_reply,     /* Echo Reply          */
     [0x08] = decode_ts,             /* Timestamp           */
     [0x47] = decode_reserved,       /* Reserved Option     */
     [0xfe] = decode_experimental,   /* Experimental Option */
@@ -327,3 +401,20 @@ uint64_t tcp_ops_prio[0xff] = {
     [0xfe] = 0,                     /* Experimental Option */
 };
 
+/* options rendered per packet (see ip_ops_dyn) */
+uint8_t tcp_ops_dyn[0xff] = {
+    [0x00 ... 0xfe] = 0,
+
+    [0x06] = 1,                     /* Echo                */
+    [0x07] = 1,                     /* Echo Reply          */
+    [0x08] = 1,                     /* Timestamp           */
+};
+
+/* options that use per-flow state (see flow.h) */
+uint8_t tcp_ops_flow[0xff] = {
+    [0x00 ... 0xfe] = 0,
+
+    [0x06] = 1,                     /* Echo                */
+    [0x07] = 1,                     /* Echo Reply          */
+    [0x08] = 1,                     /* Timestamp           */
+};
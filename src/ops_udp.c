@@ -17,7 +17,6 @@
  * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <sys/time.h>       /* gettimeofday    */
 #include <arpa/inet.h>      /* htonl           */
 
 #include "csum.h"
@@ -30,6 +29,7 @@
  *  @usr_ops    : reference to user specified current option
  *  @iph        : pointer to start of ip header
  *  @ops_sec    : start of temporary options buffer
+ *  @ctx        : per-packet context (e.g.: time of processing)
  *
  *  @return : number of bytes written to dst_buffer or 0 on error
  *
@@ -52,11 +52,12 @@
  *
  * NOTE: this applies to all other decoders as well, but will be omitted.
  */
-static size_t decode_eool(uint8_t       *dst_buffer,
-                          size_t        len_left,
-                          uint8_t       **usr_ops,
-                          struct iphdr  *iph,
-                          uint8_t       *ops_sec)
+static size_t decode_eool(uint8_t        *dst_buffer,
+                          size_t         len_left,
+                          uint8_t        **usr_ops,
+                          struct iphdr   *iph,
+                          uint8_t        *ops_sec,
+                          struct ops_ctx *ctx)
 {
     /* sanity checks */
     RET(!usr_ops, 0, "usr_ops is NULL");
@@ -80,7 +81,8 @@ static size_t decode_nop(uint8_t        *dst_buffer,
                          size_t         len_left,
                          uint8_t        **usr_ops,
                          struct iphdr   *iph,
-                         uint8_t        *ops_sec)
+                         uint8_t        *ops_sec,
+                         struct ops_ctx *ctx)
 {
     /* sanity checks */
     RET(!usr_ops, 0, "usr_ops is NULL");
@@ -104,11 +106,9 @@ static size_t decode_ts(uint8_t         *dst_buffer,
                         size_t          len_left,
                         uint8_t         **usr_ops,
                         struct iphdr    *iph,
-                        uint8_t         *ops_sec)
+                        uint8_t         *ops_sec,
+                        struct ops_ctx  *ctx)
 {
-    struct timeval  tv;
-    int             ans;
-
     /* sanity checks */
     RET(!usr_ops, 0, "usr_ops is NULL");
     RET(!iph,     0, "iph is NULL");
@@ -122,16 +122,15 @@ static size_t decode_ts(uint8_t         *dst_buffer,
         return 10;
     }
 
-    /* get time of day for timestamp                                    *
+    /* time of processing is used for timestamp                         *
      * NOTE: unlike ip timestamps, we only care that it's monotonically *
      *       non-decreasing in time                                     */
-    ans = gettimeofday(&tv, NULL);
-    RET(ans == -1, 0, "Unable to get time of day (%d)", errno);
+    RET(!ctx, 0, "ctx is NULL");
 
     /* unlike tcp timestamp, we don't care about TSecr (always 0) */
     dst_buffer[0] = ((*usr_ops)++)[0];  /* kind   */
     dst_buffer[1] = 10;                 /* length */
-    *(uint32_t *)(dst_buffer + 2) = htonl((uint32_t) tv.tv_sec);
+    *(uint32_t *)(dst_buffer + 2) = htonl((uint32_t) ctx->now.tv_sec);
     *(uint32_t *)(dst_buffer + 6) = 0;
 
     return 10;
@@ -142,11 +141,12 @@ static size_t decode_ts(uint8_t         *dst_buffer,
  *       presentation; in the IETF draft it is unspecified at this point.
  *       replace it when standardized but use 0xcc until then.
  */
-static size_t decode_cco(uint8_t      *dst_buffer,
-                         size_t       len_left,
-                         uint8_t      **usr_ops,
-                         struct iphdr *iph,
-                         uint8_t      *ops_sec)
+static size_t decode_cco(uint8_t        *dst_buffer,
+                         size_t         len_left,
+                         uint8_t        **usr_ops,
+                         struct iphdr   *iph,
+                         uint8_t        *ops_sec,
+                         struct ops_ctx *ctx)
 {
     struct udphdr *udph;
     uint16_t      udp_len, udp_ops_len;
@@ -166,7 +166,10 @@ static size_t decode_cco(uint8_t      *dst_buffer,
     udp_len     = ntohs(udph->len);
     udp_ops_len = 0xffff - len_left - ntohs(iph->tot_len);
 
-    ret_val = 4 + (udp_len + (uint64_t) dst_buffer - (uint64_t) ops_sec & 1);
+    /* when postponing, the option would start at the current end of the *
+     * options area (i.e.: udp_ops_len), not at NULL - ops_sec           */
+    ret_val = 4 + ((udp_len + (dst_buffer ? dst_buffer - ops_sec :
+                    udp_ops_len)) & 1);
 
     /* postponing processing */
     if (!dst_buffer) {
@@ -211,11 +214,12 @@ static size_t decode_cco(uint8_t      *dst_buffer,
  *
  * length is affected only by the amount of space available
  */
-static size_t decode_unknown(uint8_t      *dst_buffer,
-                             size_t       len_left,
-                             uint8_t      **usr_ops,
-                             struct iphdr *iph,
-                             uint8_t      *ops_sec)
+static size_t decode_unknown(uint8_t        *dst_buffer,
+                             size_t         len_left,
+                             uint8_t        **usr_ops,
+                             struct iphdr   *iph,
+                             uint8_t        *ops_sec,
+                             struct ops_ctx *ctx)
 {
     uint8_t option_len;
 
@@ -257,11 +261,12 @@ static size_t decode_unknown(uint8_t      *dst_buffer,
  *
  * length is affected only by the amount of space available
  */
-static size_t decode_experimental(uint8_t      *dst_buffer,
-                                  size_t       len_left,
-                                  uint8_t      **usr_ops,
-                                  struct iphdr *iph,
-                                  uint8_t      *ops_sec)
+static size_t decode_experimental(uint8_t        *dst_buffer,
+                                  size_t         len_left,
+                                  uint8_t        **usr_ops,
+                                  struct iphdr   *iph,
+                                  uint8_t        *ops_sec,
+                                  struct ops_ctx *ctx)
 {
     uint8_t option_len;
 
@@ -298,11 +303,12 @@ static size_t decode_experimental(uint8_t      *dst_buffer,
  * Asking for an unimplemented option will cause this to return 0 (error) and
  * abort the option section generation. Packet will pass unmodified.
  */
-static size_t decode_dummy(uint8_t      *dst_buffer,
-                           size_t       len_left,
-                           uint8_t      **usr_ops,
-                           struct iphdr *iph,
-                           uint8_t      *ops_sec)
+static size_t decode_dummy(uint8_t        *dst_buffer,
+                           size_t         len_left,
+                           uint8_t        **usr_ops,
+                           struct iphdr   *iph,
+                           uint8_t        *ops_sec,
+                           struct ops_ctx *ctx)
 {
     return 0;
 }
@@ -310,7 +316,7 @@ static size_t decode_dummy(uint8_t      *dst_buffer,
 
 /* individual option decoder callback array */
 size_t (*udp_decoders[0xff])(uint8_t *, size_t, uint8_t **,
-                             struct iphdr *, uint8_t *) = {
+                             struct iphdr *, uint8_t *, struct ops_ctx *) = {
     [0x00 ... 0xfe] = decode_dummy,
 
     [0x00] = decode_eool,           /* End Of Options List */
@@ -336,3 +342,10 @@ uint64_t udp_ops_prio[0xff] = {
     [0xfe] =   0,                   /* Experimental Option */
 };
 
+/* options rendered per packet; CCO covers the rest of the options area */
+uint8_t udp_ops_dyn[0xff] = {
+    [0x00 ... 0xfe] = 0,
+
+    [0x07] = 1,                     /* TimeStamp           */
+    [0x4c] = 1,                     /* Checksum Correction */
+};
@@ -0,0 +1,221 @@
+/*
+ * Copyright © 2021, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of ops-inject.
+ *
+ * ops-inject is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ops-inject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>            /* size_t                 */
+#include <stdint.h>           /* [u]int*_t              */
+#include <string.h>           /* memset                 */
+#include <time.h>             /* clock_gettime          */
+#include <sys/socket.h>       /* setsockopt, SO_MEMINFO */
+#include <linux/sock_diag.h>  /* SK_MEMINFO_*           */
+
+#include <stdbool.h>          /* fixes pktbuff.h error  */
+#include <libnetfilter_queue/libnetfilter_queue.h>
+
+#include "cli_args.h"
+#include "overload.h"
+#include "util.h"
+
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* ovl_set_rcvbuf - forces the socket receive buffer size
+ *  @ovl    : overload control state
+ *  @rcvbuf : new size in bytes
+ *
+ *  @return : 0 if everything went ok
+ *
+ * SO_RCVBUFFORCE ignores net.core.rmem_max (requires CAP_NET_ADMIN).
+ */
+static int ovl_set_rcvbuf(struct overload *ovl, uint32_t rcvbuf)
+{
+    int ans;
+
+    ans = setsockopt(ovl->fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf,
+            sizeof(rcvbuf));
+    RET(ans == -1, 1, "Unable to set socket rcvbuf (%s)", strerror(errno));
+
+    ovl->rcvbuf = rcvbuf;
+    return 0;
+}
+
+/* ovl_set_maxlen - changes the kernel queue length
+ *  @ovl    : overload control state
+ *  @maxlen : new max number of packets waiting for a verdict
+ *
+ *  @return : 0 if everything went ok
+ */
+static int ovl_set_maxlen(struct overload *ovl, uint32_t maxlen)
+{
+    int ans;
+
+    ans = nfq_set_queue_maxlen(ovl->qh, maxlen);
+    RET(ans < 0, 1, "Unable to set queue maxlen (%s)", strerror(errno));
+
+    ovl->maxlen = maxlen;
+    return 0;
+}
+
+/* ovl_backlog - checks how full the socket receive queue is
+ *  @ovl : overload control state
+ *
+ *  @return : percentage of rcvbuf that is in use or 0 on error
+ */
+static uint32_t ovl_backlog(struct overload *ovl)
+{
+    uint32_t  meminfo[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(meminfo);
+    int       ans;
+
+    ans = getsockopt(ovl->fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len);
+    RET(ans == -1 || !meminfo[SK_MEMINFO_RCVBUF], 0,
+        "Unable to get socket meminfo (%s)", strerror(errno));
+
+    return (uint64_t) meminfo[SK_MEMINFO_RMEM_ALLOC] * 100
+         / meminfo[SK_MEMINFO_RCVBUF];
+}
+
+/* ovl_adapt - resizes the kernel queue based on the measured drain rate
+ *  @ovl : overload control state
+ *  @now : current (monotonic) time
+ *
+ * The queue only needs to hold as many packets as we can drain in
+ * OVL_DRAIN_MS; anything beyond that is latency. When fail-open is set, the
+ * kernel accepts whatever does not fit instead of dropping it. The user
+ * specified maxlen is used as a lower bound.
+ */
+static void ovl_adapt(struct overload *ovl, struct timespec *now)
+{
+    uint64_t elapsed_ms;
+    uint64_t target;
+
+    elapsed_ms = (now->tv_sec  - ovl->last.tv_sec)  * 1000
+               + (now->tv_nsec - ovl->last.tv_nsec) / 1000000;
+    if (elapsed_ms < OVL_ADAPT_MS)
+        return;
+
+    ovl->rate = (ovl->processed - ovl->last_processed) * 1000 / elapsed_ms;
+    ovl->last = *now;
+    ovl->last_processed = ovl->processed;
+
+    target = ovl->rate * OVL_DRAIN_MS / 1000;
+    if (target < args.maxlen)
+        target = args.maxlen;
+    if (target > OVL_MAXLEN_CAP)
+        target = OVL_MAXLEN_CAP;
+
+    /* avoid reconfiguring the queue for small fluctuations (25%) */
+    if (target * 4 > ovl->maxlen * 5 || target * 5 < ovl->maxlen * 4)
+        ovl_set_maxlen(ovl, target);
+}
+
+/******************************************************************************
+ ****************************** PUBLIC FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* ovl_init - applies the configured buffer sizes and queue flags
+ *  @ovl : overload control state
+ *  @qh  : nfq queue
+ *  @fd  : nfq netlink socket
+ *
+ *  @return : 0 if everything went ok
+ */
+int ovl_init(struct overload *ovl, struct nfq_q_handle *qh, int32_t fd)
+{
+    int ans;
+
+    memset(ovl, 0, sizeof(*ovl));
+    ovl->qh = qh;
+    ovl->fd = fd;
+
+    ans = ovl_set_rcvbuf(ovl, args.rcvbuf);
+    RET(ans, 1, "Unable to size socket rcvbuf");
+
+    ans = ovl_set_maxlen(ovl, args.maxlen);
+    RET(ans, 1, "Unable to size kernel queue");
+
+    /* let the kernel accept packets when the queue is full */
+    if (args.fail_open) {
+        ans = nfq_set_queue_flags(qh, NFQA_CFG_F_FAIL_OPEN,
+                NFQA_CFG_F_FAIL_OPEN);
+        RET(ans < 0, 1, "Unable to set fail-open flag (%s)", strerror(errno));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ovl->last);
+    return 0;
+}
+
+/* ovl_enobufs - accounts for a socket overrun
+ *  @ovl : overload control state
+ *
+ * ENOBUFS means that at least one netlink message was lost; the kernel
+ * already dropped the packet it carried (or accepted it, w/ --fail-open), so
+ * all we can do is count it. Growing rcvbuf (up to OVL_RCVBUF_GROWTH times
+ * the initial size) makes it less likely to happen again during the next
+ * burst.
+ */
+void ovl_enobufs(struct overload *ovl)
+{
+    ovl->enobufs++;
+
+    if (ovl->rcvbuf < (uint64_t) args.rcvbuf * OVL_RCVBUF_GROWTH)
+        ovl_set_rcvbuf(ovl, ovl->rcvbuf * 2);
+}
+
+/* ovl_burst - updates overload state before processing a burst
+ *  @ovl : overload control state
+ *  @n   : number of messages in the burst
+ *
+ * Sets ovl->shedding when the socket backlog passes the high-water mark
+ * and clears it once it falls under half of that (hysteresis). Checking the
+ * backlog costs a syscall, so it is only done when the burst came back full
+ * (more messages are likely waiting) or once every OVL_BACKLOG_BURSTS bursts.
+ */
+void ovl_burst(struct overload *ovl, size_t n)
+{
+    struct timespec now;
+    uint32_t        backlog;
+
+    ovl->processed += n;
+
+    if (n >= args.batch || ++ovl->bursts >= OVL_BACKLOG_BURSTS) {
+        ovl->bursts = 0;
+
+        backlog = ovl_backlog(ovl);
+        if (backlog >= args.hwm)
+            ovl->shedding = 1;
+        else if (backlog < args.hwm / 2)
+            ovl->shedding = 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ovl_adapt(ovl, &now);
+}
+
+/* ovl_report - prints overload counters
+ *  @ovl   : overload control state
+ *  @q_num : queue number (for display)
+ */
+void ovl_report(struct overload *ovl, uint16_t q_num)
+{
+    INFO("Queue %hu: processed=%lu shed=%lu enobufs=%lu "
+         "rcvbuf=%u maxlen=%u rate=%lu/s",
+         q_num, ovl->processed, ovl->shed, ovl->enobufs,
+         ovl->rcvbuf, ovl->maxlen, ovl->rate);
+}
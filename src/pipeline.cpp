@@ -0,0 +1,571 @@
+/*
+ * Copyright © 2021, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of ops-inject.
+ *
+ * ops-inject is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ops-inject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>            /* size_t                 */
+#include <stdint.h>           /* [u]int*_t              */
+#include <stdlib.h>           /* aligned_alloc, free    */
+#include <string.h>           /* memset                 */
+#include <time.h>             /* clock_gettime          */
+#include <sched.h>            /* sched_yield, cpu_set_t */
+#include <unistd.h>           /* usleep, sysconf        */
+#include <pthread.h>          /* pthread_*              */
+#include <arpa/inet.h>        /* ntohl, ntohs           */
+#include <sys/socket.h>       /* recvmmsg               */
+
+#include <stdbool.h>          /* fixes pktbuff.h error  */
+#include <linux/netfilter.h>  /* NF_ACCEPT              */
+#include <libnetfilter_queue/libnetfilter_queue.h>
+
+#include "cli_args.h"
+#include "pipeline.h"
+#include "flow.h"
+#include "budget.h"
+#include "pmtu.h"
+#include "util.h"
+
+#define PIPE_SPIN   64      /* empty polls before yielding   */
+#define PIPE_YIELD  128     /* empty polls before sleeping   */
+#define PIPE_NAP_US 50      /* sleep between polls when idle */
+
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* pipe_idle - backs off after polling an empty ring
+ *  @spins : consecutive empty polls (reset by the caller on success)
+ *
+ * Busy polling keeps latency low under load; when the queue is idle, the
+ * threads end up sleeping instead of burning their cpus.
+ */
+static void pipe_idle(uint32_t *spins)
+{
+    if (++*spins < PIPE_SPIN)
+        return;
+
+    if (*spins < PIPE_YIELD)
+        sched_yield();
+    else
+        usleep(PIPE_NAP_US);
+}
+
+/* pipe_ring_report - prints occupancy stats of one ring
+ *  @name : ring name
+ *  @idx  : ring index (for display)
+ *  @q    : ring
+ */
+static void pipe_ring_report(const char *name, uint32_t idx, struct spsc *q)
+{
+    uint64_t pushes = __atomic_load_n(&q->pushes, __ATOMIC_RELAXED);
+    uint64_t occ    = __atomic_load_n(&q->occ_sum, __ATOMIC_RELAXED);
+
+    INFO("  %-10s[%2u]: now=%3u/%u avg=%5.1f max=%3u full=%lu", name, idx,
+         spsc_occupancy(q), SPSC_DEPTH, pushes ? (double) occ / pushes : 0.0,
+         __atomic_load_n(&q->occ_max, __ATOMIC_RELAXED),
+         __atomic_load_n(&q->full, __ATOMIC_RELAXED));
+}
+
+/* pipe_report - prints occupancy stats of every ring in the pipeline
+ *  @pl : pipeline
+ *
+ * A stage that can't keep up shows as a (nearly) full input ring while the
+ * rings after it stay empty. If the free ring is empty and rx is starved,
+ * packets are stuck further down (most likely the verdict thread).
+ */
+static void pipe_report(struct pipeline *pl)
+{
+    INFO("Queue %hu pipeline (rx starved %lu times):", pl->wk->q_num,
+         __atomic_load_n(&pl->rx_starved, __ATOMIC_RELAXED));
+
+    for (uint32_t i = 0; i < pl->n_stages; i++)
+        pipe_ring_report("rx->annot", i, &pl->to_annot[i]);
+    for (uint32_t i = 0; i < pl->n_stages; i++)
+        pipe_ring_report("annot->tx", i, &pl->to_tx[i]);
+    pipe_ring_report("tx->rx", 0, &pl->to_rx);
+}
+
+/* pipe_annotator - annotator thread routine
+ *  @data : pointer to this thread's struct pipe_stage
+ *
+ *  @return : NULL
+ *
+ * Runs the decoder, reassembler and checksum routines on every packet that
+ * rx hands it and forwards the result to the verdict thread. Packets are
+ * modified in their receive slot: ip & tcp headers grow into the headroom
+ * and udp options are appended in the tailroom. A udp tail left in this
+ * thread's ops buffer would not outlive the next packet, so such packets
+ * pass unchanged. If flows are tracked, the thread creates its own table
+ * (on its own numa node); rx sends every packet of a flow to the same
+ * annotator, so the table is never shared. So are the budget & the path
+ * mtu cache; a frag-needed error only lowers the mtu in the cache of the
+ * annotator it was sent to, until the others ask the kernel again. Budget
+ * changes are picked up once per burst, i.e.: whenever the ring was drained
+ * and at least every args.batch packets.
+ */
+static void *pipe_annotator(void *data)
+{
+    struct pipe_stage *st = (struct pipe_stage *) data;
+    struct pipeline   *pl = st->pl;
+    struct pipe_desc  *d;
+    uint8_t           *end;
+    uint32_t          spins = 0;
+    uint32_t          burst = 0;
+    uint16_t          s;
+
+    if (args.flows) {
+        st->flows = flow_create(args.flows, args.flow_timeout);
+        ALERT(!st->flows, "Annotator %u runs w/o flow tracking", st->idx);
+    }
+    if (args.budget) {
+        st->budget = budget_create("Annotator", st->idx);
+        ALERT(!st->budget, "Annotator %u runs w/o budget", st->idx);
+    }
+    if (args.pmtu) {
+        st->pmtu = pmtu_create(args.mtu, 1);
+        ALERT(!st->pmtu, "Annotator %u runs w/o path mtu checks", st->idx);
+    }
+
+    while (!pl->stop) {
+        if (spsc_pop(&pl->to_annot[st->idx], &s)) {
+            burst = 0;
+            pipe_idle(&spins);
+            continue;
+        }
+        spins = 0;
+
+        /* a burst ends when the ring is drained or after args.batch pkts */
+        if (!burst) {
+            budget_sync(st->budget);
+            burst = args.batch;
+        }
+        burst--;
+
+        d = &pl->desc[s];
+        d->changed = 0;
+        d->spent   = 0;
+
+        if (d->iph && !d->shed) {
+            end = (uint8_t *) d->iph + ntohs(d->iph->tot_len);
+
+            if (st->flows && d->tracked)
+                d->ctx.flow = flow_find(st->flows, &d->key, d->hash,
+                                  &d->ctx.now);
+
+            if (st->pmtu && d->iph->version == 4 && d->iph->ihl >= 5) {
+                pmtu_learn(st->pmtu, d->iph, &d->ctx.now);
+                if (!(d->skbinfo & NFQA_SKB_GSO))
+                    d->ctx.mtu = pmtu_get(st->pmtu, d->iph->daddr,
+                                     &d->ctx.now);
+            }
+
+            /* outside the budget; pass unchanged */
+            if (!st->budget || budget_admit(st->budget, d->iph, d->ctx.flow,
+                                   &d->ctx.now))
+                d->changed = !args.annotate(d->iph, RX_HEADROOM, d->end - end,
+                                  d->skbinfo, &d->ctx, d->head, &d->sg)
+                          && !d->sg.tail_len;
+            else
+                d->spent = budget_spent(st->budget, d->ctx.flow);
+        }
+
+        /* can't be full: every ring holds all the slots */
+        while (spsc_push(&pl->to_tx[st->idx], s) && !pl->stop)
+            ;
+    }
+
+    budget_report(st->budget);
+    budget_destroy(st->budget);
+    st->budget = NULL;
+    pmtu_report(st->pmtu, "Annotator", st->idx);
+    pmtu_destroy(st->pmtu);
+    st->pmtu = NULL;
+    flow_report(st->flows, "Annotator", st->idx);
+    flow_destroy(st->flows);
+    st->flows = NULL;
+
+    return NULL;
+}
+
+/* pipe_verdict - verdict thread routine
+ *  @data : pointer to the struct pipeline
+ *
+ *  @return : NULL
+ *
+ * Collects annotated packets from all stages and sends their verdicts in
+ * batches of up to args.batch (or whatever is available). Slots referenced
+ * by modified packets are only handed back to rx once the batch is sent.
+ * Packets complete out of order, so batch verdicts are disabled.
+ */
+static void *pipe_verdict(void *data)
+{
+    struct pipeline  *pl = (struct pipeline *) data;
+    struct worker    *wk = pl->wk;
+    struct pipe_desc *d;
+    uint16_t         done[PIPE_SLOTS];
+    uint32_t         n_done = 0;
+    uint32_t         spins  = 0;
+    uint32_t         got;
+    uint16_t         s;
+    int              ans;
+
+    while (!pl->stop) {
+        got = 0;
+
+        for (uint32_t i = 0; i < pl->n_stages; i++) {
+            while (n_done < args.batch && !spsc_pop(&pl->to_tx[i], &s)) {
+                d = &pl->desc[s];
+
+                if (!d->changed && d->spent && args.ct_mask)
+                    ans = tx_batch_accept_ct(&wk->txb, d->id, args.ct_mark,
+                            args.ct_mask);
+                else if (!d->changed)
+                    ans = tx_batch_accept(&wk->txb, d->id);
+                else if (args.redirect)
+                    ans = tx_batch_verdict_sg(&wk->txb, d->id,
+                            (args.nq_num << 16) | NF_QUEUE, &d->sg);
+                else
+                    ans = tx_batch_verdict_sg(&wk->txb, d->id, NF_ACCEPT,
+                            &d->sg);
+                ALERT(ans, "Unable to queue verdict for packet %u", d->id);
+
+                done[n_done++] = s;
+                got++;
+            }
+        }
+
+        /* send when the stages run dry or the batch is full */
+        if (n_done && (!got || n_done >= args.batch)) {
+            ans = tx_batch_flush(&wk->txb);
+            ALERT(ans, "Unable to send verdicts for queue %hu", wk->q_num);
+
+            for (uint32_t i = 0; i < n_done; i++)
+                spsc_push(&pl->to_rx, done[i]);
+            n_done = 0;
+        }
+
+        if (got)
+            spins = 0;
+        else
+            pipe_idle(&spins);
+    }
+
+    return NULL;
+}
+
+/* pipe_stop - stops & joins the stage threads, then frees the pipeline
+ *  @pl : pipeline
+ */
+static void pipe_stop(struct pipeline *pl)
+{
+    pl->stop = true;
+
+    for (uint32_t i = 0; i < pl->n_started; i++)
+        pthread_join(pl->stages[i].tid, NULL);
+    if (pl->tx_started)
+        pthread_join(pl->tx_tid, NULL);
+
+    pl->wk->pipe = NULL;
+    pool_fini(&pl->wk->pool);
+    free(pl);
+}
+
+/* pipe_unspill - gives back the jumbo buffer of a slot (if any)
+ *  @pl : pipeline
+ *  @s  : slot owned by rx
+ */
+static void pipe_unspill(struct pipeline *pl, uint16_t s)
+{
+    if (!pl->jumbo[s])
+        return;
+
+    pool_put(&pl->wk->pool, POOL_JUMBO, pl->jumbo[s]);
+    pl->jumbo[s] = NULL;
+}
+
+/* pipe_start - allocates the pipeline & starts its threads
+ *  @wk : worker (nfq queue, socket & verdict batch already set up)
+ *
+ *  @return : pipeline or NULL on error
+ *
+ * The worker thread may be pinned to its queue's cpu; the stage threads are
+ * allowed to run on any cpu instead of inheriting that.
+ */
+static struct pipeline *pipe_start(struct worker *wk)
+{
+    struct pipeline *pl;
+    pthread_attr_t  attr;
+    cpu_set_t       cpus;
+    long            n_cpus;
+    int             ans;
+
+    /* rings are cache line aligned */
+    pl = (struct pipeline *) aligned_alloc(CACHELINE,
+            (sizeof(*pl) + CACHELINE - 1) & ~(CACHELINE - 1));
+    RET(!pl, NULL, "Unable to allocate pipeline");
+    memset(pl, 0, sizeof(*pl));
+
+    ans = pool_init(&wk->pool, RX_MTU_SZ, PIPE_SLOTS, RX_JUMBO_SZ, PIPE_JUMBO);
+    GOTO(ans, cleanup_pl, "Unable to allocate receive buffers");
+
+    pl->wk       = wk;
+    pl->n_stages = args.pipeline;
+
+    /* all slots start out free */
+    for (uint16_t i = 0; i < PIPE_SLOTS; i++) {
+        pl->mtu[i] = pool_get(&wk->pool, POOL_MTU);
+        spsc_push(&pl->to_rx, i);
+    }
+
+    /* verdicts complete out of order */
+    wk->txb.ooo = 1;
+    wk->pipe    = pl;
+
+    /* don't inherit the worker's cpu pinning */
+    n_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    CPU_ZERO(&cpus);
+    for (long i = 0; i < n_cpus && i < CPU_SETSIZE; i++)
+        CPU_SET(i, &cpus);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+
+    for (; pl->n_started < pl->n_stages; pl->n_started++) {
+        pl->stages[pl->n_started].pl  = pl;
+        pl->stages[pl->n_started].idx = pl->n_started;
+
+        ans = pthread_create(&pl->stages[pl->n_started].tid, &attr,
+                pipe_annotator, &pl->stages[pl->n_started]);
+        GOTO(ans, cleanup_attr, "Unable to start annotator %u (%s)",
+            pl->n_started, strerror(ans));
+    }
+
+    ans = pthread_create(&pl->tx_tid, &attr, pipe_verdict, pl);
+    GOTO(ans, cleanup_attr, "Unable to start verdict thread (%s)",
+        strerror(ans));
+    pl->tx_started = 1;
+
+    pthread_attr_destroy(&attr);
+    return pl;
+
+cleanup_attr:
+    pthread_attr_destroy(&attr);
+    wk->txb.ooo = 0;
+    pipe_stop(pl);
+    return NULL;
+cleanup_pl:
+    free(pl);
+    return NULL;
+}
+
+/******************************************************************************
+ ****************************** PUBLIC FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* pipe_dispatch - callback routine for NetfilterQueue (pipeline mode)
+ *  @qh    : netfilter queue handle
+ *  @nfmsg : general form of address family dependent message
+ *  @nfd   : nfq related data for packet evaluation
+ *  @data  : data parameter passed unchanged by nfq_create_queue()
+ *           here, the worker that owns the queue
+ *
+ *  @return : 0 if ok, -1 on error
+ *
+ * Runs on the rx (worker) thread. Only extracts the packet metadata into the
+ * descriptor of the current slot and hands it to the next annotator. If
+ * flows are tracked, the annotator is picked by the flow's hash instead
+ * (the high bits; the low ones pick the bucket in that annotator's table).
+ */
+int32_t pipe_dispatch(struct nfq_q_handle *qh,
+                      struct nfgenmsg     *nfmsg,
+                      struct nfq_data     *nfd,
+                      void                *data)
+{
+    struct worker               *wk = (struct worker *) data;
+    struct pipeline             *pl = wk->pipe;
+    struct pipe_desc            *d  = &pl->desc[pl->cur];
+    struct nfqnl_msg_packet_hdr *ph;
+    uint32_t                    spins = 0;
+    uint32_t                    stage;
+    ssize_t                     ans;
+
+    RET(pl->dispatched, -1, "Multiple packets in one message");
+
+    ph = nfq_get_msg_packet_hdr(nfd);
+    RET(!ph, -1, "Unable to retrieve packet meta hdr (%d)", errno);
+
+    d->id      = ntohl(ph->packet_id);
+    d->skbinfo = nfq_get_skbinfo(nfd);
+    worker_ctx(wk, nfd, &d->ctx);
+
+    /* backlog is past the high-water mark; pass w/o decoding */
+    d->shed = wk->ovl.shedding;
+    if (unlikely(d->shed))
+        wk->ovl.shed++;
+
+    /* malformed packets are passed unchanged */
+    ans = nfq_get_payload(nfd, (uint8_t **) &d->iph);
+    if (ans == -1 || ans != ntohs(d->iph->tot_len)) {
+        ALERT(1, "Payload size & total len mismatch");
+        d->iph = NULL;
+    }
+
+    /* same flow, same annotator */
+    stage      = pl->next;
+    pl->next   = (pl->next + 1) % pl->n_stages;
+    d->tracked = args.flows && d->iph && d->iph->version == 4
+              && d->iph->ihl >= 5 && d->iph->ihl * 4 <= ans;
+    if (d->tracked) {
+        d->hash = flow_key(d->iph, &d->key, &d->ctx.dir);
+        stage   = (d->hash >> 32) % pl->n_stages;
+    }
+
+    /* can't be full: every ring holds all the slots */
+    while (spsc_push(&pl->to_annot[stage], pl->cur) && !bml)
+        pipe_idle(&spins);
+
+    pl->dispatched = 1;
+
+    return 0;
+}
+
+/* pipe_loop - pipeline mode main loop (rx stage)
+ *  @wk : worker (nfq queue, socket & verdict batch already set up)
+ *
+ *  @return : 0 if the loop ended because of a shutdown request
+ *
+ * Receives bursts straight into free slots and dispatches each packet to
+ * an annotator thread (round robin or by flow) via pipe_dispatch().
+ * Decoding, checksums and verdicts happen on other threads, so a slow packet
+ * does not keep the socket from being drained. Ring occupancy is reported
+ * every PIPE_REPORT_MS and on exit.
+ */
+int pipe_loop(struct worker *wk)
+{
+    struct pipeline *pl;
+    struct mmsghdr  msgs[BATCH_MAX];        /* per-message headers      */
+    struct iovec    iov[BATCH_MAX][2];      /* mtu buffer, jumbo spill  */
+    uint8_t         *jumbo[BATCH_MAX];      /* spill buffer per message */
+    uint8_t         *buf;                   /* buffer holding a message */
+    uint16_t        slot[BATCH_MAX];        /* slots owned by rx        */
+    uint32_t        n_slots = 0;            /* # of slots owned by rx   */
+    uint32_t        n_arm;                  /* # of slots w/ a spill    */
+    uint32_t        n_keep;                 /* # of slots to keep       */
+    uint32_t        n;                      /* burst size               */
+    uint32_t        spins = 0;              /* empty polls of free ring */
+    struct timespec now, last;              /* report timing            */
+    int             ret = 1;
+    ssize_t         ans;
+
+    pl = pipe_start(wk);
+    RET(!pl, 1, "Unable to start pipeline");
+
+    INFO("Queue %hu pipelined over %u annotator(s)", wk->q_num, pl->n_stages);
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    memset(msgs, 0, sizeof(msgs));
+
+    n = args.batch < BATCH_MAX ? args.batch : BATCH_MAX;
+
+    while (!bml) {
+        /* take free slots back from the verdict thread */
+        while (n_slots < n && !spsc_pop(&pl->to_rx, &slot[n_slots])) {
+            pipe_unspill(pl, slot[n_slots]);
+            n_slots++;
+        }
+
+        /* a message may only be received if it has room to spill over */
+        for (n_arm = 0; n_arm < n_slots; n_arm++) {
+            jumbo[n_arm] = pool_get(&wk->pool, POOL_JUMBO);
+            if (!jumbo[n_arm])
+                break;
+
+            rx_slot_iov(iov[n_arm], pl->mtu[slot[n_arm]], jumbo[n_arm]);
+            msgs[n_arm].msg_hdr.msg_iov    = iov[n_arm];
+            msgs[n_arm].msg_hdr.msg_iovlen = 2;
+        }
+
+        if (!n_arm) {
+            __atomic_store_n(&pl->rx_starved, pl->rx_starved + 1,
+                __ATOMIC_RELAXED);
+            pipe_idle(&spins);
+            continue;
+        }
+        spins = 0;
+
+        ans = recvmmsg(wk->fd, msgs, n_arm, MSG_WAITFORONE, NULL);
+
+        /* keep only the jumbo buffers that messages spilled into */
+        for (ssize_t i = 0; i < n_arm; i++) {
+            buf = i < ans ? rx_slot_join(pl->mtu[slot[i]], jumbo[i],
+                                msgs[i].msg_len, &pl->desc[slot[i]].end)
+                          : NULL;
+            if (buf == jumbo[i])
+                pl->jumbo[slot[i]] = jumbo[i];
+            else
+                pool_put(&wk->pool, POOL_JUMBO, jumbo[i]);
+        }
+
+        if (!ans)
+            break;
+        if (ans == -1 && errno == EINTR)
+            continue;
+        if (ans == -1 && errno == ENOBUFS) {
+            ovl_enobufs(&wk->ovl);
+            continue;
+        }
+        GOTO(ans < 0, out, "Error reading from socket (%s)", strerror(errno));
+
+        /* check backlog & adapt queue size to drain rate */
+        ovl_burst(&wk->ovl, ans);
+        clk_burst(&wk->now);
+
+        /* dispatch; slots w/o a packet (errors, unused) stay w/ rx */
+        n_keep = 0;
+        for (ssize_t i = 0; i < ans; i++) {
+            pl->cur        = slot[i];
+            pl->dispatched = 0;
+
+            buf = pl->jumbo[slot[i]] ? : pl->mtu[slot[i]];
+            nfq_handle_packet(wk->h, (char *) buf + RX_HEADROOM,
+                msgs[i].msg_len);
+
+            if (!pl->dispatched) {
+                pipe_unspill(pl, slot[i]);
+                slot[n_keep++] = slot[i];
+            }
+        }
+        for (uint32_t i = ans; i < n_slots; i++)
+            slot[n_keep++] = slot[i];
+        n_slots = n_keep;
+
+        /* periodic occupancy report */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - last.tv_sec) * 1000
+          + (now.tv_nsec - last.tv_nsec) / 1000000 >= PIPE_REPORT_MS)
+        {
+            pipe_report(pl);
+            last = now;
+        }
+    }
+
+    ret = 0;
+out:
+    pipe_report(pl);
+    pipe_stop(pl);
+    wk->txb.ooo = 0;
+    return ret;
+}
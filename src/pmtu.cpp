@@ -0,0 +1,232 @@
+/*
+ * Copyright © 2021, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of ops-inject.
+ *
+ * ops-inject is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ops-inject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>           /* calloc, free           */
+#include <string.h>           /* strerror               */
+#include <errno.h>            /* errno                  */
+#include <unistd.h>           /* close                  */
+#include <sys/socket.h>       /* socket, connect        */
+#include <netinet/in.h>       /* sockaddr_in, IP_MTU    */
+#include <netinet/ip_icmp.h>  /* icmphdr                */
+#include <arpa/inet.h>        /* htons, ntohs           */
+
+#include "pmtu.h"
+#include "util.h"
+
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* pmtu_slot - finds the cache entry of a destination
+ *  @pm    : path mtu cache
+ *  @daddr : destination (network order)
+ *
+ *  @return : its entry (which may hold another destination)
+ */
+static inline struct pmtu_entry *pmtu_slot(struct pmtu *pm, uint32_t daddr)
+{
+    return &pm->e[(daddr * 0x9e3779b1U) >> 20 & (PMTU_SLOTS - 1)];
+}
+
+/* pmtu_kernel - asks the kernel for the path mtu of a destination
+ *  @pm    : path mtu cache
+ *  @daddr : destination (network order)
+ *
+ *  @return : path mtu; pm->def if there is no route
+ *
+ * Connecting a udp socket sends nothing; it only binds it to the route.
+ * IP_MTU then reports that route's mtu, or the lower pmtu that the kernel
+ * learned for daddr (from frag-needed errors), if it has one.
+ */
+static uint16_t pmtu_kernel(struct pmtu *pm, uint32_t daddr)
+{
+    struct sockaddr_in sa = { };
+    socklen_t          len = sizeof(int);
+    int                mtu;
+
+    /* drop the previous route & the source address picked for it */
+    sa.sin_family = AF_UNSPEC;
+    connect(pm->fd, (struct sockaddr *) &sa, sizeof(sa));
+
+    sa.sin_family      = AF_INET;
+    sa.sin_port        = htons(9);
+    sa.sin_addr.s_addr = daddr;
+
+    if (connect(pm->fd, (struct sockaddr *) &sa, sizeof(sa))
+        || getsockopt(pm->fd, IPPROTO_IP, IP_MTU, &mtu, &len)) {
+        DEBUG("No path mtu for %u.%u.%u.%u (%s)",
+              (daddr >>  0) & 0xff, (daddr >>  8) & 0xff,
+              (daddr >> 16) & 0xff, (daddr >> 24) & 0xff, strerror(errno));
+        return pm->def;
+    }
+
+    /* loopback's 65536 */
+    return mtu > 0xffff ? 0xffff : mtu;
+}
+
+/******************************************************************************
+ ****************************** PUBLIC FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* pmtu_create - allocates the path mtu cache of one thread
+ *  @def    : mtu assumed when the kernel can't say (or isn't asked)
+ *  @kernel : !0 to seed entries from the kernel's routes; 0 to use def
+ *
+ *  @return : path mtu cache or NULL on error
+ */
+struct pmtu *pmtu_create(uint16_t def, uint8_t kernel)
+{
+    struct pmtu *pm;
+
+    pm = (struct pmtu *) calloc(1, sizeof(*pm));
+    RET(!pm, NULL, "Unable to allocate path mtu cache");
+
+    pm->def = def;
+    pm->fd  = -1;
+
+    if (kernel) {
+        pm->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (pm->fd == -1) {
+            free(pm);
+            RET(1, NULL, "Unable to create path mtu socket (%s)",
+                strerror(errno));
+        }
+    }
+
+    return pm;
+}
+
+/* pmtu_destroy - releases the path mtu cache of a thread
+ *  @pm : path mtu cache (may be NULL)
+ */
+void pmtu_destroy(struct pmtu *pm)
+{
+    if (!pm)
+        return;
+
+    if (pm->fd != -1)
+        close(pm->fd);
+    free(pm);
+}
+
+/* pmtu_report - prints the path mtu cache counters of a thread
+ *  @pm   : path mtu cache (may be NULL)
+ *  @name : owner (for display)
+ *  @idx  : owner index (for display)
+ */
+void pmtu_report(struct pmtu *pm, const char *name, uint32_t idx)
+{
+    if (!pm)
+        return;
+
+    INFO("%s %u pmtu: hits=%lu misses=%lu limited=%lu learned=%lu", name,
+         idx, pm->hits, pm->misses, pm->limited, pm->learned);
+}
+
+/* pmtu_get - looks up the path mtu of a destination
+ *  @pm    : path mtu cache
+ *  @daddr : destination (network order)
+ *  @now   : time of processing
+ *
+ *  @return : path mtu
+ *
+ * Misses ask the kernel, at most PMTU_LOOKUPS times a second; past that,
+ * the entry's previous mtu (if it held the same destination) or pm->def is
+ * returned w/o being cached. Entries are asked for again after PMTU_TTL,
+ * like the kernel's own pmtu (net.ipv4.route.mtu_expires) expires.
+ */
+uint16_t pmtu_get(struct pmtu *pm, uint32_t daddr, const struct timespec *now)
+{
+    struct pmtu_entry *e = pmtu_slot(pm, daddr);
+    uint32_t          sec = now->tv_sec;
+
+    if (likely(e->used && e->daddr == daddr
+               && (int32_t) (e->expires - sec) > 0)) {
+        pm->hits++;
+        return e->mtu;
+    }
+
+    if (pm->fd != -1) {
+        if (sec != pm->sec) {
+            pm->sec     = sec;
+            pm->lookups = 0;
+        }
+
+        if (pm->lookups == PMTU_LOOKUPS) {
+            pm->limited++;
+            return e->used && e->daddr == daddr ? e->mtu : pm->def;
+        }
+
+        pm->lookups++;
+    }
+
+    e->daddr   = daddr;
+    e->mtu     = pm->fd != -1 ? pmtu_kernel(pm, daddr) : pm->def;
+    e->used    = 1;
+    e->expires = sec + PMTU_TTL;
+
+    pm->misses++;
+    return e->mtu;
+}
+
+/* pmtu_learn - lowers a path mtu according to a frag-needed error
+ *  @pm  : path mtu cache
+ *  @iph : icmp packet (ip header already checked)
+ *  @now : time of processing
+ *
+ * Anything else, including frag-needed errors w/o a next-hop mtu (RFC 1191
+ * section 5; the kernel guesses a plateau for these) & ones that would
+ * raise the cached mtu, is ignored.
+ */
+void pmtu_learn(struct pmtu *pm, struct iphdr *iph, const struct timespec *now)
+{
+    struct pmtu_entry *e;
+    struct icmphdr    *icmph;
+    struct iphdr      *inner;
+    uint16_t          mtu;
+
+    if (iph->protocol != IPPROTO_ICMP || ntohs(iph->tot_len) < iph->ihl * 4
+            + sizeof(*icmph) + sizeof(*inner))
+        return;
+
+    icmph = (struct icmphdr *)(((uint8_t *) iph) + iph->ihl * 4);
+    if (icmph->type != ICMP_DEST_UNREACH || icmph->code != ICMP_FRAG_NEEDED)
+        return;
+
+    inner = (struct iphdr *)(icmph + 1);
+    mtu   = ntohs(icmph->un.frag.mtu);
+    if (inner->version != 4 || mtu < PMTU_MIN)
+        return;
+
+    e = pmtu_slot(pm, inner->daddr);
+    if (e->used && e->daddr == inner->daddr && e->mtu <= mtu
+        && (int32_t) (e->expires - (uint32_t) now->tv_sec) > 0)
+        return;
+
+    DEBUG("Path mtu of %u.%u.%u.%u is %hu",
+          (inner->daddr >>  0) & 0xff, (inner->daddr >>  8) & 0xff,
+          (inner->daddr >> 16) & 0xff, (inner->daddr >> 24) & 0xff, mtu);
+
+    e->daddr   = inner->daddr;
+    e->mtu     = mtu;
+    e->used    = 1;
+    e->expires = now->tv_sec + PMTU_TTL;
+
+    pm->learned++;
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright © 2021, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of ops-inject.
+ *
+ * ops-inject is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ops-inject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>                  /* size_t          */
+#include <stdint.h>                 /* [u]int*_t       */
+#include <stdlib.h>                 /* calloc, free    */
+#include <string.h>                 /* memset          */
+#include <sched.h>                  /* getcpu          */
+#include <unistd.h>                 /* syscall         */
+#include <sys/mman.h>               /* mmap, madvise   */
+#include <sys/syscall.h>            /* SYS_mbind       */
+#include <linux/mempolicy.h>        /* MPOL_PREFERRED  */
+
+#include "pool.h"
+#include "util.h"
+
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* pool_round - rounds a length up to a whole number of huge pages
+ *  @len : length
+ *
+ *  @return : rounded length
+ */
+static inline size_t pool_round(size_t len)
+{
+    return (len + POOL_PAGE_SZ - 1) & ~(POOL_PAGE_SZ - 1);
+}
+
+/* pool_bind - places a mapping on the numa node of the calling thread
+ *  @addr : mapping (not yet faulted in)
+ *  @len  : mapping length
+ *
+ *  @return : numa node or -1 if unknown
+ *
+ * The node is only preferred, not enforced: if it runs out of memory, the
+ * pages come from another node rather than not at all. Kernels w/o numa
+ * support refuse mbind(); the mapping is still usable then.
+ */
+static int32_t pool_bind(void *addr, size_t len)
+{
+    unsigned int  cpu, node;
+    unsigned long mask;
+    long          ans;
+
+    ans = getcpu(&cpu, &node);
+    RET(ans, -1, "Unable to get numa node (%s)", strerror(errno));
+
+    if (node >= 8 * sizeof(mask))
+        return node;
+
+    /* NOTE: the kernel reads maxnode - 1 bits */
+    mask = 1UL << node;
+    ans  = syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask,
+               8 * sizeof(mask) + 1, 0);
+    if (ans)
+        DEBUG("Unable to bind buffers to node %u (%s)", node,
+            strerror(errno));
+
+    return node;
+}
+
+/******************************************************************************
+ ****************************** PUBLIC FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* pool_map - maps prefaulted, numa-local memory for packet buffers
+ *  @len  : requested length (rounded up to POOL_PAGE_SZ)
+ *  @node : set to the numa node of the pages (or -1); may be NULL
+ *  @huge : set to !0 if backed by hugetlb pages; may be NULL
+ *
+ *  @return : POOL_PAGE_SZ aligned mapping or NULL on error
+ *
+ * Reserved huge pages (vm.nr_hugepages) are used if there are enough of
+ * them. Otherwise, the mapping is aligned to a huge page boundary and
+ * transparent huge pages are requested instead. Either way, every page is
+ * faulted in here so that the worker never stalls on a page fault (or a
+ * huge page compaction) while a burst is being processed. Release w/
+ * pool_unmap().
+ */
+void *pool_map(size_t len, int32_t *node, uint8_t *huge)
+{
+    uint8_t *addr, *aligned;
+    size_t  head;
+    int32_t nd;
+    uint8_t hp = 1;
+
+    len = pool_round(len);
+
+    /* try reserved (2MB) huge pages first */
+    addr = (uint8_t *) mmap(NULL, len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB
+               | (21 << MAP_HUGE_SHIFT), -1, 0);
+
+    /* fall back to transparent huge pages */
+    if (addr == MAP_FAILED) {
+        hp   = 0;
+        addr = (uint8_t *) mmap(NULL, len + POOL_PAGE_SZ,
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+        RET(addr == MAP_FAILED, NULL, "Unable to map %zu bytes (%s)", len,
+            strerror(errno));
+
+        /* trim to a huge page boundary */
+        aligned = (uint8_t *) pool_round((size_t) addr);
+        head    = aligned - addr;
+        if (head)
+            munmap(addr, head);
+        munmap(aligned + len, POOL_PAGE_SZ - head);
+        addr = aligned;
+
+        if (madvise(addr, len, MADV_HUGEPAGE))
+            DEBUG("Transparent huge pages unavailable (%s)", strerror(errno));
+    }
+
+    /* place on the local node, then fault everything in */
+    nd = pool_bind(addr, len);
+    for (size_t off = 0; off < len; off += 0x1000)
+        addr[off] = 0;
+
+    if (node)
+        *node = nd;
+    if (huge)
+        *huge = hp;
+
+    return addr;
+}
+
+/* pool_unmap - releases a mapping obtained from pool_map()
+ *  @addr : mapping
+ *  @len  : length that was requested from pool_map()
+ */
+void pool_unmap(void *addr, size_t len)
+{
+    if (addr)
+        munmap(addr, pool_round(len));
+}
+
+/* pool_init - carves a pool into slots of two size classes
+ *  @p        : pool
+ *  @mtu_sz   : size of POOL_MTU slots (multiple of POOL_ALIGN)
+ *  @n_mtu    : number of POOL_MTU slots
+ *  @jumbo_sz : size of POOL_JUMBO slots (multiple of POOL_ALIGN)
+ *  @n_jumbo  : number of POOL_JUMBO slots
+ *
+ *  @return : 0 if everything went ok
+ *
+ * Must be called by the thread that will use the pool (after pinning it to
+ * its cpu), so that the memory ends up on that thread's numa node. The mtu
+ * slots come first and are packed together: a burst of small packets then
+ * spans only a few huge pages (i.e.: TLB entries) instead of one slot sized
+ * for the largest packet each.
+ */
+int pool_init(struct pool *p, size_t mtu_sz, uint32_t n_mtu,
+              size_t jumbo_sz, uint32_t n_jumbo)
+{
+    size_t   sz[POOL_CLS] = { [POOL_MTU] = mtu_sz,  [POOL_JUMBO] = jumbo_sz };
+    uint32_t n[POOL_CLS]  = { [POOL_MTU] = n_mtu,   [POOL_JUMBO] = n_jumbo  };
+    size_t   off = 0;
+
+    memset(p, 0, sizeof(*p));
+
+    for (uint8_t i = 0; i < POOL_CLS; i++) {
+        RET(sz[i] % POOL_ALIGN, 1, "Unaligned slot size %zu", sz[i]);
+        p->len += sz[i] * n[i];
+    }
+
+    p->base = (uint8_t *) pool_map(p->len, &p->node, &p->huge);
+    RET(!p->base, 1, "Unable to map buffer pool");
+
+    for (uint8_t i = 0; i < POOL_CLS; i++) {
+        struct pool_class *c = &p->cls[i];
+
+        c->base  = p->base + off;
+        c->sz    = sz[i];
+        c->n     = n[i];
+        c->stack = (uint8_t **) calloc(n[i] ? : 1, sizeof(*c->stack));
+        GOTO(!c->stack, cleanup, "Unable to allocate free slot stack");
+
+        /* stacked in reverse so that slots are first handed out in order */
+        for (c->top = 0; c->top < c->n; c->top++)
+            c->stack[c->top] = c->base + (c->n - 1 - c->top) * c->sz;
+
+        off += c->sz * c->n;
+    }
+
+    DEBUG("Buffer pool: %zu KB on node %d (%s pages)", p->len >> 10, p->node,
+        p->huge ? "huge" : "transparent huge");
+    return 0;
+
+cleanup:
+    pool_fini(p);
+    return 1;
+}
+
+/* pool_fini - releases a pool
+ *  @p : pool
+ *
+ * Slots that were not given back are released as well.
+ */
+void pool_fini(struct pool *p)
+{
+    for (uint8_t i = 0; i < POOL_CLS; i++)
+        free(p->cls[i].stack);
+
+    pool_unmap(p->base, p->len);
+    memset(p, 0, sizeof(*p));
+}
@@ -21,6 +21,7 @@
 #include <stdint.h>         /* [u]int*_t    */
 #include <string.h>         /* memcpy       */
 #include <arpa/inet.h>      /* htons, ntohs */
+#include <netinet/in.h>     /* IPPROTO_*    */
 #include <netinet/ip.h>     /* iphdr        */
 #include <netinet/tcp.h>    /* tcphdr       */
 #include <netinet/udp.h>    /* udphdr       */
@@ -28,12 +29,43 @@
 #include "reassemblers.h"
 #include "util.h"
 
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* copy_l4 - copies (part of) the layer 4, summing it in the same pass
+ *  @dst  : destination
+ *  @src  : source
+ *  @len  : number of bytes
+ *  @off  : offset of dst relative to the new layer 4 header
+ *  @part : where to store the partial sum (plain copy if NULL)
+ *
+ * Saves the layer 4 checksum calculation another pass over the payload.
+ */
+static void copy_l4(uint8_t *dst, uint8_t *src, size_t len, size_t off,
+    struct csum_part *part)
+{
+    if (!part) {
+        memcpy(dst, src, len);
+        return;
+    }
+
+    part->off = off;
+    part->len = len;
+    part->sum = csum_partial_copy(0, dst, src, len);
+}
+
+/******************************************************************************
+ ****************************** PUBLIC FUNCTIONS ******************************
+ ******************************************************************************/
+
 /* reassemble_ip - creates a new packet by including generated options
  *  @iph      : ip header
  *  @mod_buff : modified buffer (should be 0xffff bytes in size)
  *  @ops      : options buffer (populated by decoder)
  *  @ops_len  : options length (padding included)
  *  @ow       : 0 if not overwriting existing options
+ *  @part     : layer 4 region summed during the copy (may be NULL)
  *
  *  @return : 0 if everything went ok
  *
@@ -43,7 +75,7 @@
  * checksum). All other fields will be properly set in this function.
  */
 int reassemble_ip(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
-    size_t ops_len, uint8_t ow)
+    size_t ops_len, uint8_t ow, struct csum_part *part)
 {
     size_t  new_len   = 0;                  /* offset in new buffer    */
     size_t  offset    = 0;                  /* offset in source buffer */
@@ -56,6 +88,10 @@ int reassemble_ip(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
     RET(!mod_buff, 1, "mod_buff is NULL");
     RET(!ops,      1, "ops is NULL");
 
+    /* gso super-packets can be close to the ip length limit */
+    aux_len = ntohs(iph->tot_len) + ops_len - (ow ? iph->ihl * 4 - 20 : 0);
+    RET(aux_len > 0xffff, 1, "Packet too large for new ops (%zu)", aux_len);
+
     /* copy base ip header */
     memcpy(mod_buff, src_buff, 20);
     new_len = 20;
@@ -72,9 +108,14 @@ int reassemble_ip(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
     memcpy(mod_buff + new_len, ops, ops_len);
     new_len += ops_len;
 
-    /* copy data */
+    /* copy data (i.e.: the whole layer 4); only sum it if its checksum *
+     * covers it (an empty region is a valid, if useless, csum_part)    */
     aux_len = ntohs(iph->tot_len) - iph->ihl * 4;
-    memcpy(mod_buff + new_len, src_buff + offset, aux_len);
+    if (part && iph->protocol != IPPROTO_TCP && iph->protocol != IPPROTO_UDP) {
+        memset(part, 0, sizeof(*part));
+        part = NULL;
+    }
+    copy_l4(mod_buff + new_len, src_buff + offset, aux_len, 0, part);
     new_len += aux_len;
 
     /* set fields for new packet */
@@ -91,6 +132,7 @@ int reassemble_ip(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
  *  @ops      : options buffer (populated by decoder)
  *  @ops_len  : options length (padding included)
  *  @ow       : 0 if not overwriting existing options
+ *  @part     : layer 4 region summed during the copy (may be NULL)
  *
  *  @return : 0 if everything went ok
  *
@@ -99,7 +141,7 @@ int reassemble_ip(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
  * case-by-case basis. All other fields will be properly set in this function.
  */
 int reassemble_tcp(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
-    size_t ops_len, uint8_t ow)
+    size_t ops_len, uint8_t ow, struct csum_part *part)
 {
     size_t        new_len   = 0;                /* offset in new buffer    */
     size_t        offset    = 0;                /* offset in source buffer */
@@ -113,6 +155,10 @@ int reassemble_tcp(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
     RET(!mod_buff, 1, "mod_buff is NULL");
     RET(!ops,      1, "ops is NULL");
 
+    /* gso super-packets can be close to the ip length limit */
+    aux_len = ntohs(iph->tot_len) + ops_len - (ow ? tcph->doff * 4 - 20 : 0);
+    RET(aux_len > 0xffff, 1, "Packet too large for new ops (%zu)", aux_len);
+
     /* copy ip header (and options, if any) */
     memcpy(mod_buff, src_buff, iph->ihl * 4);
     new_len = iph->ihl * 4;
@@ -137,7 +183,8 @@ int reassemble_tcp(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
 
     /* copy data */
     aux_len = ntohs(iph->tot_len) - (iph->ihl + tcph->doff) * 4;
-    memcpy(mod_buff + new_len, src_buff + offset, aux_len);
+    copy_l4(mod_buff + new_len, src_buff + offset, aux_len,
+        new_len - iph->ihl * 4, part);
     new_len += aux_len;
 
     /* set fields for new packet */
@@ -155,6 +202,7 @@ int reassemble_tcp(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
  *  @ops      : options buffer (populated by decoder)
  *  @ops_len  : options length (padding included)
  *  @ow       : 0 if not overwriting existing options
+ *  @part     : layer 4 region summed during the copy (may be NULL)
  *
  *  @return : 0 if everything went ok
  *
@@ -163,7 +211,7 @@ int reassemble_tcp(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
  * case-by-case basis. All other fields will be properly set in this function.
  */
 int reassemble_udp(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
-    size_t ops_len, uint8_t ow)
+    size_t ops_len, uint8_t ow, struct csum_part *part)
 {
     size_t        new_len   = 0;                /* offset in new buffer    */
     size_t        offset    = 0;                /* offset in source buffer */
@@ -189,13 +237,13 @@ int reassemble_udp(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
 
     /* copy data */
     aux_len = ntohs(udph->len) - 8;
-    memcpy(mod_buff + new_len, src_buff + offset, aux_len);
+    copy_l4(mod_buff + new_len, src_buff + offset, aux_len, 8, part);
     new_len += aux_len;
     offset  += aux_len;
 
     /* copy existing udp options (if any) */
     if (!ow) {
-        aux_len = ntohs(iph->tot_len) - ntohs(udph->len);
+        aux_len = ntohs(iph->tot_len) - iph->ihl * 4 - ntohs(udph->len);
         memcpy(mod_buff + new_len, src_buff + offset, aux_len);
         new_len += aux_len;
     }
@@ -211,3 +259,449 @@ int reassemble_udp(struct iphdr *iph, uint8_t *mod_buff, uint8_t *ops,
     return 0;
 }
 
+/* reassemble_ip_sg - describes the new packet as [head][body] w/o copying
+ *  @iph      : ip header
+ *  @room     : writable bytes before iph (0 to leave the packet intact)
+ *  @tailroom : unused (ip options are inserted before the body)
+ *  @head     : scratch buffer for rewritten headers (SG_HEAD_MAX bytes)
+ *  @ops      : options buffer (populated by decoder)
+ *  @ops_len  : options length (padding included)
+ *  @OW       : overwrite existing options
+ *  @sg       : scatter-gather description of the new packet
+ *
+ *  @return : 0 if everything went ok
+ *
+ * Only the ip header (w/ old and new options) is rewritten. If room allows
+ * it, the header is moved so that it ends right where the body starts and
+ * the packet stays contiguous (this overwrites the original header and up
+ * to room bytes before it). Otherwise, it is written to head. Either way,
+ * the body references the layer 4 header and payload in the original buffer;
+ * it must stay valid until the packet is sent. Same caveats as
+ * reassemble_ip().
+ */
+template <bool OW>
+int reassemble_ip_sg(struct iphdr *iph, size_t room, size_t tailroom,
+    uint8_t *head, uint8_t *ops, size_t ops_len, struct pkt_sg *sg)
+{
+    size_t       old_len;                   /* length of old headers   */
+    size_t       new_len;                   /* length of new headers   */
+    size_t       keep_len;                  /* old headers that stay   */
+    uint8_t      *src_buff = (uint8_t *) iph;
+    struct iphdr *new_iph;
+
+    /* sanity checks */
+    RET(!iph,  1, "iph is NULL");
+    RET(!head, 1, "head is NULL");
+    RET(!ops,  1, "ops is NULL");
+    RET(!sg,   1, "sg is NULL");
+
+    old_len  = iph->ihl * 4;
+    keep_len = OW ? 20 : old_len;
+    new_len  = keep_len + ops_len;
+    RET(new_len > 60, 1, "Too many ip ops (%zu)", ops_len);
+
+    /* reference the untouched part */
+    sg->body     = src_buff + old_len;
+    sg->body_len = ntohs(iph->tot_len) - old_len;
+    sg->tail     = NULL;
+    sg->tail_len = 0;
+
+    /* gso super-packets can be close to the ip length limit */
+    RET(new_len + sg->body_len > 0xffff, 1, "Packet too large for new ops");
+
+    /* the old header may be overwritten below; sum it first */
+    sg->delta.l3_old = csum_partial(0, (uint16_t *) iph, old_len);
+
+    /* grow in place or in the scratch buffer; then add new options */
+    sg->head     = room && new_len <= old_len + room
+                 ? sg->body - new_len : head;
+    sg->head_len = new_len;
+
+    memmove(sg->head, src_buff, keep_len);
+    memcpy(sg->head + keep_len, ops, ops_len);
+
+    /* set fields for new packet */
+    new_iph = (struct iphdr *) sg->head;
+    new_iph->tot_len = htons((uint32_t)(new_len + sg->body_len));
+    new_iph->ihl     = new_len / 4;
+
+    /* the ip header is all that changed; tcp/udp pseudo header lengths *
+     * are derived from tot_len - ihl * 4, which is left intact         */
+    sg->delta.l3_new = csum_partial(0, (uint16_t *) sg->head, new_len);
+    sg->delta.l4_old = 0;
+    sg->delta.l4_new = 0;
+
+    return 0;
+}
+
+/* reassemble_tcp_sg - describes the new packet as [head][body] w/o copying
+ *  @iph      : ip header
+ *  @room     : writable bytes before iph (0 to leave the packet intact)
+ *  @tailroom : unused (tcp options are inserted before the body)
+ *  @head     : scratch buffer for rewritten headers (SG_HEAD_MAX bytes)
+ *  @ops      : options buffer (populated by decoder)
+ *  @ops_len  : options length (padding included)
+ *  @OW       : overwrite existing options
+ *  @sg       : scatter-gather description of the new packet
+ *
+ *  @return : 0 if everything went ok
+ *
+ * The ip and tcp headers (w/ old and new tcp options) are rewritten, in
+ * place if room allows it (see reassemble_ip_sg()). The body references the
+ * payload in the original buffer. Same caveats as reassemble_tcp().
+ */
+template <bool OW>
+int reassemble_tcp_sg(struct iphdr *iph, size_t room, size_t tailroom,
+    uint8_t *head, uint8_t *ops, size_t ops_len, struct pkt_sg *sg)
+{
+    size_t        ip_len;                   /* length of ip header     */
+    size_t        old_len;                  /* length of old headers   */
+    size_t        new_len;                  /* length of new headers   */
+    size_t        keep_len;                 /* old headers that stay   */
+    uint16_t      old_tot;                  /* old ip tot_len          */
+    uint8_t       *src_buff = (uint8_t *) iph;
+    struct tcphdr *tcph     = (struct tcphdr *)(src_buff + iph->ihl * 4);
+    struct tcphdr *new_tcph;
+
+    /* sanity checks */
+    RET(!iph,  1, "iph is NULL");
+    RET(!head, 1, "head is NULL");
+    RET(!ops,  1, "ops is NULL");
+    RET(!sg,   1, "sg is NULL");
+
+    /* ip header (and options, if any), base tcp header and existing tcp *
+     * options (if any) are contiguous in the source packet              */
+    ip_len   = iph->ihl * 4;
+    old_len  = ip_len + tcph->doff * 4;
+    keep_len = ip_len + (OW ? 20 : tcph->doff * 4);
+    new_len  = keep_len + ops_len;
+    old_tot  = iph->tot_len;
+    RET(new_len > SG_HEAD_MAX, 1, "Too many tcp ops (%zu)", ops_len);
+
+    /* reference the untouched part */
+    sg->body     = src_buff + old_len;
+    sg->body_len = ntohs(old_tot) - old_len;
+    sg->tail     = NULL;
+    sg->tail_len = 0;
+
+    /* gso super-packets can be close to the ip length limit */
+    RET(new_len + sg->body_len > 0xffff, 1, "Packet too large for new ops");
+
+    /* the old tcp header may be overwritten below; sum it first */
+    sg->delta.l4_old = csum_partial(htons((uint16_t)(ntohs(old_tot) - ip_len)),
+                           (uint16_t *) tcph, old_len - ip_len);
+
+    /* grow in place or in the scratch buffer; then add new options */
+    sg->head     = room && new_len <= old_len + room
+                 ? sg->body - new_len : head;
+    sg->head_len = new_len;
+
+    memmove(sg->head, src_buff, keep_len);
+    memcpy(sg->head + keep_len, ops, ops_len);
+
+    /* set fields for new packet */
+    new_tcph = (struct tcphdr *)(sg->head + ip_len);
+    ((struct iphdr *) sg->head)->tot_len =
+        htons((uint32_t)(new_len + sg->body_len));
+    new_tcph->doff = (new_len - ip_len) / 4;
+
+    /* ip tot_len, the tcp header and the pseudo header's tcp length changed */
+    sg->delta.l3_old = old_tot;
+    sg->delta.l3_new = ((struct iphdr *) sg->head)->tot_len;
+    sg->delta.l4_new = csum_partial(
+        htons((uint16_t)(new_len + sg->body_len - ip_len)),
+        (uint16_t *) new_tcph, new_len - ip_len);
+
+    return 0;
+}
+
+/* reassemble_udp_sg - describes the new packet as [head][body][tail]
+ *  @iph      : ip header
+ *  @room     : unused (udp options are appended, headers don't grow)
+ *  @tailroom : writable bytes after the packet (0 to leave it intact)
+ *  @head     : scratch buffer for rewritten headers (SG_HEAD_MAX bytes)
+ *  @ops      : options buffer (populated by decoder)
+ *  @ops_len  : options length
+ *  @OW       : overwrite existing options
+ *  @sg       : scatter-gather description of the new packet
+ *
+ *  @return : 0 if everything went ok
+ *
+ * If tailroom allows it, the new options are appended in place, right after
+ * the datagram (and existing options, unless overwritten), and only tot_len
+ * is rewritten in the ip header; the whole packet is then described by
+ * [head][body] w/o any copies in between. Otherwise, the ip and udp headers
+ * are written to head, the body references the payload (and existing
+ * options) in the original buffer and the tail references the new options.
+ * Same caveats as reassemble_udp().
+ */
+template <bool OW>
+int reassemble_udp_sg(struct iphdr *iph, size_t room, size_t tailroom,
+    uint8_t *head, uint8_t *ops, size_t ops_len, struct pkt_sg *sg)
+{
+    size_t        new_len   = 0;                /* length of new headers   */
+    size_t        old_tot;                      /* old ip tot_len          */
+    size_t        end;                          /* where new ops are added */
+    uint8_t       *src_buff = (uint8_t *) iph;  /* easier access           */
+    struct udphdr *udph     = (struct udphdr *)(src_buff + iph->ihl * 4);
+
+    /* sanity checks */
+    RET(!iph,  1, "iph is NULL");
+    RET(!head, 1, "head is NULL");
+    RET(!ops,  1, "ops is NULL");
+    RET(!sg,   1, "sg is NULL");
+
+    /* ip header (and options, if any) and udp header (has no options) */
+    new_len = iph->ihl * 4 + 8;
+    old_tot = ntohs(iph->tot_len);
+    end     = OW ? ntohs(udph->len) + iph->ihl * 4 : old_tot;
+
+    RET(end + ops_len > 0xffff, 1, "Packet too large for new ops");
+
+    /* only ip tot_len changes; udp csum stops at udph->len */
+    sg->delta.l3_old = iph->tot_len;
+    sg->delta.l4_old = 0;
+    sg->delta.l4_new = 0;
+
+    /* append new options in place; the packet stays contiguous */
+    if (tailroom && end + ops_len <= old_tot + tailroom) {
+        memcpy(src_buff + end, ops, ops_len);
+        iph->tot_len = htons((uint32_t)(end + ops_len));
+
+        sg->head     = src_buff;
+        sg->head_len = new_len;
+        sg->body     = src_buff + new_len;
+        sg->body_len = end + ops_len - new_len;
+        sg->tail     = NULL;
+        sg->tail_len = 0;
+
+        sg->delta.l3_new = iph->tot_len;
+        return 0;
+    }
+
+    /* copy headers; reference payload (and existing options) & new options */
+    memcpy(head, src_buff, new_len);
+
+    sg->head     = head;
+    sg->head_len = new_len;
+    sg->body     = src_buff + new_len;
+    sg->body_len = end - new_len;
+    sg->tail     = ops;
+    sg->tail_len = ops_len;
+
+    /* set fields for new packet */
+    ((struct iphdr *) head)->tot_len = htons((uint32_t)(end + ops_len));
+    sg->delta.l3_new = ((struct iphdr *) head)->tot_len;
+
+    return 0;
+}
+
+/* reassemble_multi_sg - adds ip & layer 4 options in one pass
+ *  @iph        : ip header
+ *  @room       : writable bytes before iph (0 to leave the packet intact)
+ *  @tailroom   : writable bytes after the packet (0 to leave it intact)
+ *  @head       : scratch buffer for rewritten headers (SG_HEAD_MAX bytes)
+ *  @ip_ops     : ip options buffer (NULL to leave the ip options alone)
+ *  @ip_ops_len : ip options length (padding included)
+ *  @l4_ops     : tcp or udp options buffer (NULL to leave layer 4 alone)
+ *  @l4_ops_len : layer 4 options length (padding included for tcp)
+ *  @OW         : overwrite existing options (of the layers that get new ones)
+ *  @sg         : scatter-gather description of the new packet
+ *
+ *  @return : 0 if everything went ok
+ *
+ * Same as reassemble_ip_sg() followed by reassemble_tcp_sg() (or by
+ * reassemble_udp_sg()), w/o the intermediate packet. Both headers are built
+ * in head, since either of them may move over the other's old bytes, and
+ * moved in front of the body if room allows it. udp options are appended in
+ * place if tailroom allows it; otherwise, they are the tail. delta covers
+ * the whole ip header and, for tcp, the whole tcp header.
+ */
+template <bool OW>
+int reassemble_multi_sg(struct iphdr *iph, size_t room, size_t tailroom,
+    uint8_t *head, uint8_t *ip_ops, size_t ip_ops_len, uint8_t *l4_ops,
+    size_t l4_ops_len, struct pkt_sg *sg)
+{
+    size_t        ip_len;                       /* length of old ip header */
+    size_t        ip_keep;                      /* ... that stays          */
+    size_t        new_ip;                       /* length of new ip header */
+    size_t        l4_old  = 0;                  /* length of old l4 header */
+    size_t        l4_keep = 0;                  /* ... that stays          */
+    size_t        new_l4  = 0;                  /* length of new l4 header */
+    size_t        old_tot;                      /* old ip tot_len          */
+    size_t        end;                          /* end of the kept bytes   */
+    size_t        new_tot;                      /* new ip tot_len          */
+    uint8_t       *src_buff = (uint8_t *) iph;  /* easier access           */
+    uint8_t       *l4;                          /* old layer 4 header      */
+    uint8_t       tcp, udp;                     /* layer 4 gets ops        */
+    struct tcphdr *new_tcph;
+
+    /* sanity checks */
+    RET(!iph,  1, "iph is NULL");
+    RET(!head, 1, "head is NULL");
+    RET(!sg,   1, "sg is NULL");
+    RET(!ip_ops && !l4_ops, 1, "No ops to add");
+
+    ip_len  = iph->ihl * 4;
+    ip_keep = ip_ops && OW ? 20 : ip_len;
+    new_ip  = ip_keep + (ip_ops ? ip_ops_len : 0);
+    old_tot = ntohs(iph->tot_len);
+    end     = old_tot;
+    l4      = src_buff + ip_len;
+    tcp     = l4_ops && iph->protocol == IPPROTO_TCP;
+    udp     = l4_ops && iph->protocol == IPPROTO_UDP;
+    RET(new_ip > 60, 1, "Too many ip ops (%zu)", ip_ops_len);
+    RET(l4_ops && !tcp && !udp, 1, "Layer 4 protocol mismatch");
+
+    if (tcp) {
+        l4_old  = ((struct tcphdr *) l4)->doff * 4;
+        l4_keep = OW ? 20 : l4_old;
+        new_l4  = l4_keep + l4_ops_len;
+        RET(new_l4 > 60, 1, "Too many tcp ops (%zu)", l4_ops_len);
+    } else if (udp) {
+        l4_old  = l4_keep = new_l4 = 8;
+        end     = OW ? ip_len + ntohs(((struct udphdr *) l4)->len) : old_tot;
+    }
+
+    /* reference the untouched part (& the new udp options) */
+    sg->body     = l4 + l4_old;
+    sg->body_len = end - ip_len - l4_old;
+    sg->tail     = udp ? l4_ops : NULL;
+    sg->tail_len = udp ? l4_ops_len : 0;
+    sg->head_len = new_ip + new_l4;
+
+    RET(sg->head_len + sg->body_len + sg->tail_len > 0xffff, 1,
+        "Packet too large for new ops");
+
+    /* the old headers may be overwritten below; sum them first */
+    sg->delta.l3_old = csum_partial(0, (uint16_t *) iph, ip_len);
+    sg->delta.l4_old = tcp ? csum_partial(htons((uint16_t)(old_tot - ip_len)),
+                                 (uint16_t *) l4, l4_old) : 0;
+
+    /* append udp options in place; they become part of the body */
+    if (udp && tailroom && end + l4_ops_len <= old_tot + tailroom) {
+        memcpy(src_buff + end, l4_ops, l4_ops_len);
+
+        sg->body_len += l4_ops_len;
+        sg->tail      = NULL;
+        sg->tail_len  = 0;
+    }
+
+    /* build the new headers */
+    memcpy(head, src_buff, ip_keep);
+    if (ip_ops)
+        memcpy(head + ip_keep, ip_ops, ip_ops_len);
+    memcpy(head + new_ip, l4, l4_keep);
+    if (tcp)
+        memcpy(head + new_ip + l4_keep, l4_ops, l4_ops_len);
+
+    /* set fields for new packet */
+    new_tot = sg->head_len + sg->body_len + sg->tail_len;
+    ((struct iphdr *) head)->tot_len = htons((uint32_t) new_tot);
+    ((struct iphdr *) head)->ihl     = new_ip / 4;
+
+    sg->delta.l3_new = csum_partial(0, (uint16_t *) head, new_ip);
+    sg->delta.l4_new = 0;
+    if (tcp) {
+        new_tcph       = (struct tcphdr *)(head + new_ip);
+        new_tcph->doff = new_l4 / 4;
+
+        sg->delta.l4_new = csum_partial(htons((uint16_t)(new_tot - new_ip)),
+                               (uint16_t *) new_tcph, new_l4);
+    }
+
+    /* grow in place or keep them in the scratch buffer */
+    sg->head = head;
+    if (room && sg->head_len <= ip_len + l4_old + room) {
+        sg->head = sg->body - sg->head_len;
+        memcpy(sg->head, head, sg->head_len);
+    }
+
+    return 0;
+}
+
+template int reassemble_ip_sg<false>(struct iphdr *, size_t, size_t,
+    uint8_t *, uint8_t *, size_t, struct pkt_sg *);
+template int reassemble_ip_sg<true>(struct iphdr *, size_t, size_t,
+    uint8_t *, uint8_t *, size_t, struct pkt_sg *);
+template int reassemble_tcp_sg<false>(struct iphdr *, size_t, size_t,
+    uint8_t *, uint8_t *, size_t, struct pkt_sg *);
+template int reassemble_tcp_sg<true>(struct iphdr *, size_t, size_t,
+    uint8_t *, uint8_t *, size_t, struct pkt_sg *);
+template int reassemble_udp_sg<false>(struct iphdr *, size_t, size_t,
+    uint8_t *, uint8_t *, size_t, struct pkt_sg *);
+template int reassemble_udp_sg<true>(struct iphdr *, size_t, size_t,
+    uint8_t *, uint8_t *, size_t, struct pkt_sg *);
+template int reassemble_multi_sg<false>(struct iphdr *, size_t, size_t,
+    uint8_t *, uint8_t *, size_t, uint8_t *, size_t, struct pkt_sg *);
+template int reassemble_multi_sg<true>(struct iphdr *, size_t, size_t,
+    uint8_t *, uint8_t *, size_t, uint8_t *, size_t, struct pkt_sg *);
+
+/* reassemble_{ip,tcp,udp}_sg - same as above, w/ ow chosen at runtime
+ *  @ow : 0 if not overwriting existing options
+ *
+ *  @return : 0 if everything went ok
+ */
+int reassemble_ip_sg(struct iphdr *iph, size_t room, size_t tailroom,
+    uint8_t *head, uint8_t *ops, size_t ops_len, uint8_t ow,
+    struct pkt_sg *sg)
+{
+    return ow ? reassemble_ip_sg<true>(iph, room, tailroom, head, ops,
+                    ops_len, sg)
+              : reassemble_ip_sg<false>(iph, room, tailroom, head, ops,
+                    ops_len, sg);
+}
+
+int reassemble_tcp_sg(struct iphdr *iph, size_t room, size_t tailroom,
+    uint8_t *head, uint8_t *ops, size_t ops_len, uint8_t ow,
+    struct pkt_sg *sg)
+{
+    return ow ? reassemble_tcp_sg<true>(iph, room, tailroom, head, ops,
+                    ops_len, sg)
+              : reassemble_tcp_sg<false>(iph, room, tailroom, head, ops,
+                    ops_len, sg);
+}
+
+int reassemble_udp_sg(struct iphdr *iph, size_t room, size_t tailroom,
+    uint8_t *head, uint8_t *ops, size_t ops_len, uint8_t ow,
+    struct pkt_sg *sg)
+{
+    return ow ? reassemble_udp_sg<true>(iph, room, tailroom, head, ops,
+                    ops_len, sg)
+              : reassemble_udp_sg<false>(iph, room, tailroom, head, ops,
+                    ops_len, sg);
+}
+
+/* pkt_sg_l4 - lists the fragments of a scatter-gather packet's layer 4
+ *  @sg  : scatter-gather packet (head must start w/ the ip header)
+ *  @iov : output fragments (room for 3 entries)
+ *
+ *  @return : number of fragments; iov[0] starts w/ the layer 4 header
+ */
+size_t pkt_sg_l4(struct pkt_sg *sg, struct iovec *iov)
+{
+    size_t offset = ((struct iphdr *) sg->head)->ihl * 4;
+    size_t cnt    = 0;
+
+    /* layer 4 header was rewritten (i.e.: is in head) */
+    if (offset < sg->head_len) {
+        iov[cnt].iov_base = sg->head + offset;
+        iov[cnt].iov_len  = sg->head_len - offset;
+        cnt++;
+
+        offset = 0;
+    } else
+        offset -= sg->head_len;
+
+    iov[cnt].iov_base = sg->body + offset;
+    iov[cnt].iov_len  = sg->body_len - offset;
+    cnt++;
+
+    if (sg->tail_len) {
+        iov[cnt].iov_base = sg->tail;
+        iov[cnt].iov_len  = sg->tail_len;
+        cnt++;
+    }
+
+    return cnt;
+}
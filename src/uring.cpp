@@ -0,0 +1,443 @@
+/*
+ * Copyright © 2021, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of ops-inject.
+ *
+ * ops-inject is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ops-inject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>            /* size_t                    */
+#include <stdint.h>           /* [u]int*_t                 */
+#include <stdlib.h>           /* calloc, free              */
+#include <string.h>           /* memset, memmove           */
+#include <signal.h>           /* sigset_t, pthread_sigmask */
+#include <unistd.h>           /* close                     */
+#include <sys/signalfd.h>     /* signalfd                  */
+#include <linux/netlink.h>    /* sockaddr_nl               */
+#include <liburing.h>         /* io_uring_*                */
+
+#include <stdbool.h>          /* fixes pktbuff.h error     */
+#include <libnetfilter_queue/libnetfilter_queue.h>
+
+#include "cli_args.h"
+#include "uring.h"
+#include "pool.h"
+#include "util.h"
+
+/* size of one provided buffer: headroom (see batch.h), recvmsg header, *
+ * sender address, message                                              */
+#define UR_BUF_SZ (RX_HEADROOM                          \
+                 + sizeof(struct io_uring_recvmsg_out) \
+                 + sizeof(struct sockaddr_nl)           \
+                 + RX_SLOT_SZ)
+
+/* completion tags (user_data) */
+enum {
+    UR_RECV = 1,    /* multishot recvmsg on the nfq socket */
+    UR_SEND,        /* verdict batch                       */
+    UR_SIGNAL,      /* read on signalfd                    */
+};
+
+/* received message waiting to be processed */
+struct ur_pending {
+    uint16_t bid;                   /* provided buffer id      */
+    int32_t  len;                   /* bytes written to buffer */
+};
+
+/* per-worker io_uring state */
+struct uring {
+    struct io_uring          ring;              /* submission & completion */
+    struct io_uring_buf_ring *br;               /* provided buffer ring    */
+    uint8_t                  *bufs;             /* UR_BUFS * UR_BUF_SZ     */
+    struct msghdr            rx_msg;            /* multishot layout        */
+    int32_t                  sfd;               /* signalfd (SIGUSR1)      */
+    struct signalfd_siginfo  ssi;               /* signalfd read target    */
+
+    struct ur_pending        pend[UR_BUFS];     /* received, unprocessed   */
+    uint32_t                 n_pend;
+    uint16_t                 held[UR_BUFS];     /* referenced by verdicts  */
+    uint32_t                 n_held;
+    uint32_t                 n_out;             /* buffers not in the ring */
+
+    uint8_t                  tx_busy;           /* verdict send in flight  */
+    uint8_t                  rearm;             /* recv must be resubmitted */
+};
+
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* ur_recycle - gives buffers back to the kernel
+ *  @ur  : io_uring state
+ *  @bid : buffer ids
+ *  @n   : number of buffers
+ */
+static void ur_recycle(struct uring *ur, uint16_t *bid, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        io_uring_buf_ring_add(ur->br,
+            ur->bufs + (size_t) bid[i] * UR_BUF_SZ + RX_HEADROOM,
+            UR_BUF_SZ - RX_HEADROOM, bid[i], io_uring_buf_ring_mask(UR_BUFS),
+            i);
+
+    io_uring_buf_ring_advance(ur->br, n);
+    ur->n_out -= n;
+}
+
+/* ur_arm_recv - queues a multishot recvmsg on the nfq socket
+ *  @ur   : io_uring state
+ *  @fd   : nfq netlink socket
+ *
+ *  @return : 0 if everything went ok
+ *
+ * Each message is placed in a buffer picked by the kernel from the provided
+ * buffer ring. The request stays active until an error occurs or the ring
+ * runs dry; the final completion lacks IORING_CQE_F_MORE.
+ */
+static int ur_arm_recv(struct uring *ur, int32_t fd)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = io_uring_get_sqe(&ur->ring);
+    RET(!sqe, 1, "Submission queue full");
+
+    io_uring_prep_recvmsg_multishot(sqe, fd, &ur->rx_msg, 0);
+    sqe->flags     |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group  = UR_BGID;
+    io_uring_sqe_set_data64(sqe, UR_RECV);
+
+    ur->rearm = 0;
+    return 0;
+}
+
+/* ur_arm_signal - queues a read on the signalfd
+ *  @ur : io_uring state
+ *
+ *  @return : 0 if everything went ok
+ */
+static int ur_arm_signal(struct uring *ur)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = io_uring_get_sqe(&ur->ring);
+    RET(!sqe, 1, "Submission queue full");
+
+    io_uring_prep_read(sqe, ur->sfd, &ur->ssi, sizeof(ur->ssi), 0);
+    io_uring_sqe_set_data64(sqe, UR_SIGNAL);
+
+    return 0;
+}
+
+/* ur_send - queues the sealed verdict batch
+ *  @ur  : io_uring state
+ *  @wk  : worker
+ *  @msg : sealed datagram (see tx_batch_seal())
+ *
+ *  @return : 0 if everything went ok
+ *
+ * If the multishot receive has terminated, it is resubmitted as a linked
+ * request so that the kernel only starts handing out packets again after
+ * the verdicts (and thus the buffers they reference) are on their way.
+ *
+ * Both requests are reserved up front: on failure nothing was queued and
+ * the caller may send the batch itself. Once the send is queued, the batch
+ * and its buffers belong to it until it completes.
+ */
+static int ur_send(struct uring *ur, struct worker *wk, struct msghdr *msg)
+{
+    struct io_uring_sqe *sqe;
+    int                 ans;
+
+    RET(io_uring_sq_space_left(&ur->ring) < 1U + ur->rearm, 1,
+        "Submission queue full");
+
+    sqe = io_uring_get_sqe(&ur->ring);
+    io_uring_prep_sendmsg(sqe, wk->fd, msg, 0);
+    io_uring_sqe_set_data64(sqe, UR_SEND);
+    ur->tx_busy = 1;
+
+    /* can't fail (space was reserved); otherwise, uring_loop() rearms *
+     * the receive once the send completes                             */
+    if (ur->rearm) {
+        sqe->flags |= IOSQE_IO_LINK;
+
+        ans = ur_arm_recv(ur, wk->fd);
+        ALERT(ans, "Unable to rearm receive for queue %hu", wk->q_num);
+    }
+
+    return 0;
+}
+
+/* ur_reap - handles all available completions
+ *  @ur : io_uring state
+ *  @wk : worker
+ *
+ * Received messages are only recorded here; they are processed in bursts
+ * once no verdict send is in flight (see uring_loop()).
+ */
+static void ur_reap(struct uring *ur, struct worker *wk)
+{
+    struct io_uring_cqe *cqes[UR_ENTRIES];
+    uint32_t            n;
+    int32_t             res;
+
+    n = io_uring_peek_batch_cqe(&ur->ring, cqes, UR_ENTRIES);
+
+    for (uint32_t i = 0; i < n; i++) {
+        res = cqes[i]->res;
+
+        switch (io_uring_cqe_get_data64(cqes[i])) {
+            case UR_RECV:
+                if (!(cqes[i]->flags & IORING_CQE_F_MORE))
+                    ur->rearm = 1;
+
+                if (cqes[i]->flags & IORING_CQE_F_BUFFER) {
+                    ur->pend[ur->n_pend].bid =
+                        cqes[i]->flags >> IORING_CQE_BUFFER_SHIFT;
+                    ur->pend[ur->n_pend].len = res;
+                    ur->n_pend++;
+                    ur->n_out++;
+                    break;
+                }
+
+                /* out of provided buffers: wait for verdicts to return *
+                 * some; anything else is a socket overrun              */
+                if (res == -ENOBUFS && ur->n_out < UR_BUFS)
+                    ovl_enobufs(&wk->ovl);
+                else if (res < 0 && res != -ENOBUFS && res != -ECANCELED)
+                    ALERT(1, "Receive failed on queue %hu (%s)",
+                        wk->q_num, strerror(-res));
+                break;
+            case UR_SEND:
+                ALERT(res < 0, "Unable to send verdicts for queue %hu (%s)",
+                    wk->q_num, strerror(-res));
+
+                tx_batch_reset(&wk->txb);
+                ur_recycle(ur, ur->held, ur->n_held);
+                ur->n_held  = 0;
+                ur->tx_busy = 0;
+                break;
+            case UR_SIGNAL:
+                bml = true;
+                break;
+        }
+    }
+
+    io_uring_cq_advance(&ur->ring, n);
+}
+
+/* ur_burst - processes up to args.batch received messages
+ *  @ur : io_uring state
+ *  @wk : worker
+ *
+ *  @return : 0 if everything went ok
+ *
+ * Modified packets reference their payload inside the provided buffers, so
+ * those are held until the verdict send completes.
+ */
+static int ur_burst(struct uring *ur, struct worker *wk)
+{
+    struct io_uring_recvmsg_out *out;
+    struct msghdr               *msg;
+    uint8_t                     *buf;
+    uint32_t                    n;
+    int                         ans;
+
+    n = ur->n_pend < args.batch ? ur->n_pend : args.batch;
+
+    /* check backlog & adapt queue size to drain rate */
+    ovl_burst(&wk->ovl, n);
+    clk_burst(&wk->now);
+
+    for (uint32_t i = 0; i < n; i++) {
+        buf = ur->bufs + (size_t) ur->pend[i].bid * UR_BUF_SZ + RX_HEADROOM;
+        ur->held[ur->n_held++] = ur->pend[i].bid;
+        wk->rx_end = buf - RX_HEADROOM + UR_BUF_SZ;
+
+        out = io_uring_recvmsg_validate(buf, ur->pend[i].len, &ur->rx_msg);
+        CONT(!out, "Malformed receive buffer");
+        CONT(out->flags & MSG_TRUNC, "Truncated netlink message");
+
+        nfq_handle_packet(wk->h, (char *) io_uring_recvmsg_payload(out,
+            &ur->rx_msg), io_uring_recvmsg_payload_length(out,
+            ur->pend[i].len, &ur->rx_msg));
+    }
+
+    ur->n_pend -= n;
+    memmove(ur->pend, ur->pend + n, ur->n_pend * sizeof(*ur->pend));
+
+    /* annotate the burst & queue its verdicts */
+    ans = worker_burst(wk);
+    ALERT(ans, "Unable to queue verdicts for queue %hu", wk->q_num);
+
+    /* send back all verdicts for this burst at once */
+    ans = tx_batch_seal(&wk->txb, &msg);
+    RET(ans, 1, "Unable to seal verdict batch");
+
+    /* fall back to a blocking send if the request can't be queued *
+     * (ur_send() only fails before queuing anything)               */
+    if (msg && ur_send(ur, wk, msg)) {
+        ans = tx_batch_flush(&wk->txb);
+        msg = NULL;
+    }
+
+    if (!msg) {
+        ur_recycle(ur, ur->held, ur->n_held);
+        ur->n_held = 0;
+    }
+
+    return ans;
+}
+
+/* ur_init - sets up the ring, provided buffers and signalfd
+ *  @ur : io_uring state
+ *  @wk : worker
+ *
+ *  @return : 0 if everything went ok
+ */
+static int ur_init(struct uring *ur, struct worker *wk)
+{
+    struct io_uring_params params;
+    sigset_t               mask;
+    uint16_t               bids[UR_BUFS];
+    int                    ans;
+
+    /* only this thread submits & completions are reaped when we wait */
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+
+    ans = io_uring_queue_init_params(UR_ENTRIES, &ur->ring, &params);
+    if (ans == -EINVAL) {
+        memset(&params, 0, sizeof(params));
+        ans = io_uring_queue_init_params(UR_ENTRIES, &ur->ring, &params);
+    }
+    RET(ans < 0, 1, "Unable to set up io_uring (%s)", strerror(-ans));
+
+    /* register provided buffer ring                                   *
+     * NOTE: the kernel picks any buffer for any message, so they can't *
+     *       be split into size classes; they are still numa-local and  *
+     *       on huge pages, though (see pool_map())                     */
+    ur->bufs = (uint8_t *) pool_map(UR_BUFS * UR_BUF_SZ, NULL, NULL);
+    GOTO(!ur->bufs, cleanup_ring, "Unable to allocate receive buffers");
+
+    ur->br = io_uring_setup_buf_ring(&ur->ring, UR_BUFS, UR_BGID, 0, &ans);
+    GOTO(!ur->br, cleanup_bufs, "Unable to register buffer ring (%s)",
+        strerror(-ans));
+
+    for (uint16_t i = 0; i < UR_BUFS; i++)
+        bids[i] = i;
+    ur->n_out = UR_BUFS;
+    ur_recycle(ur, bids, UR_BUFS);
+
+    /* every buffer starts w/ the sender's address; no ancillary data */
+    ur->rx_msg.msg_namelen    = sizeof(struct sockaddr_nl);
+    ur->rx_msg.msg_controllen = 0;
+
+    /* SIGUSR1 (sent by main thread on exit) is read from a signalfd */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+
+    ans = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    GOTO(ans, cleanup_br, "Unable to block SIGUSR1 (%s)", strerror(ans));
+
+    ur->sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    GOTO(ur->sfd == -1, cleanup_br, "Unable to create signalfd (%s)",
+        strerror(errno));
+
+    return 0;
+
+cleanup_br:
+    io_uring_free_buf_ring(&ur->ring, ur->br, UR_BUFS, UR_BGID);
+cleanup_bufs:
+    pool_unmap(ur->bufs, UR_BUFS * UR_BUF_SZ);
+cleanup_ring:
+    io_uring_queue_exit(&ur->ring);
+    return 1;
+}
+
+/* ur_fini - releases everything set up by ur_init()
+ *  @ur : io_uring state
+ */
+static void ur_fini(struct uring *ur)
+{
+    close(ur->sfd);
+    io_uring_free_buf_ring(&ur->ring, ur->br, UR_BUFS, UR_BGID);
+    io_uring_queue_exit(&ur->ring);
+    pool_unmap(ur->bufs, UR_BUFS * UR_BUF_SZ);
+}
+
+/******************************************************************************
+ ****************************** PUBLIC FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* uring_loop - io_uring based alternative to the recvmmsg() main loop
+ *  @wk : worker (nfq queue, socket & verdict batch already set up)
+ *
+ *  @return : 0 if the loop ended because of a shutdown request
+ *
+ * Packets are received by a multishot recvmsg into a ring of buffers
+ * provided by us, so there is no receive syscall per burst. While one burst
+ * is processed, the kernel keeps filling buffers; verdicts are sent by a
+ * sendmsg request on the same ring and the buffers referenced by them are
+ * recycled when it completes. Shutdown requests (SIGUSR1) arrive through a
+ * signalfd read, so the ring is the only thing this thread ever waits on.
+ */
+int uring_loop(struct worker *wk)
+{
+    struct uring *ur;
+    int          ret = 1;
+    int          ans;
+
+    ur = (struct uring *) calloc(1, sizeof(*ur));
+    RET(!ur, 1, "Unable to allocate io_uring state");
+
+    ans = ur_init(ur, wk);
+    GOTO(ans, out, "Unable to initialize io_uring");
+
+    ans = ur_arm_signal(ur);
+    GOTO(ans, cleanup, "Unable to queue signalfd read");
+
+    ans = ur_arm_recv(ur, wk->fd);
+    GOTO(ans, cleanup, "Unable to queue receive");
+
+    INFO("Queue %hu serviced via io_uring", wk->q_num);
+
+    while (!bml) {
+        /* a verdict send in flight will rearm the receive once done */
+        if (ur->rearm && !ur->tx_busy) {
+            ans = ur_arm_recv(ur, wk->fd);
+            GOTO(ans, cleanup, "Unable to rearm receive");
+        }
+
+        ans = io_uring_submit_and_wait(&ur->ring, 1);
+        GOTO(ans < 0 && ans != -EINTR, cleanup, "io_uring wait failed (%s)",
+            strerror(-ans));
+
+        ur_reap(ur, wk);
+
+        /* the verdict batch can't be reused before its send completes */
+        if (!ur->n_pend || ur->tx_busy)
+            continue;
+
+        ans = ur_burst(ur, wk);
+        ALERT(ans, "Unable to send verdicts for queue %hu", wk->q_num);
+    }
+
+    ret = 0;
+cleanup:
+    ur_fini(ur);
+out:
+    free(ur);
+    return ret;
+}
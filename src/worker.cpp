@@ -0,0 +1,363 @@
+/*
+ * Copyright © 2021, Radu-Alexandru Mantu <andru.mantu@gmail.com>
+ *
+ * This file is part of ops-inject.
+ *
+ * ops-inject is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ops-inject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ops-inject. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>            /* size_t                 */
+#include <stdint.h>           /* [u]int*_t              */
+#include <sched.h>            /* cpu_set_t              */
+#include <pthread.h>          /* pthread_setaffinity_np */
+#include <arpa/inet.h>        /* ntohl, ...             */
+#include <netinet/ip.h>       /* iphdr                  */
+#include <netinet/in.h>       /* IPPROTO_*              */
+
+#include <stdbool.h>          /* fixes pktbuff.h error  */
+#include <linux/netfilter.h>  /* NF_ACCEPT              */
+#include <libnetfilter_queue/libnetfilter_queue.h>
+
+#include "cli_args.h"
+#include "reassemblers.h"
+#include "worker.h"
+#include "pipeline.h"
+#include "flow.h"
+#include "budget.h"
+#include "pmtu.h"
+#include "util.h"
+#ifdef HAVE_URING
+#include "uring.h"
+#endif
+
+/******************************************************************************
+ **************************** IMPORTANT VARIABLES *****************************
+ ******************************************************************************/
+
+volatile bool bml = false;  /* break main loop */
+
+/******************************************************************************
+ ****************************** LOCAL FUNCTIONS *******************************
+ ******************************************************************************/
+
+/* annotator - callback routine for NetfilterQueue
+ *  @qh    : netfilter queue handle
+ *  @nfmsg : general form of address family dependent message
+ *  @nfd   : nfq related data for packet evaluation
+ *  @data  : data parameter passed unchanged by nfq_create_queue()
+ *           here, the worker that owns the queue
+ *
+ *  @return : 0 if ok, -1 on error
+ *
+ * Packets are not annotated from here; they are added to the worker's burst
+ * and annotated together once the whole receive burst has been parsed (see
+ * worker_burst()).
+ */
+static int32_t annotator(struct nfq_q_handle *qh,
+                         struct nfgenmsg     *nfmsg,
+                         struct nfq_data     *nfd,
+                         void                *data)
+{
+    struct worker               *wk = (struct worker *) data;
+    struct burst                *b  = &wk->burst;
+    struct nfqnl_msg_packet_hdr *ph;                /* nfq meta header     */
+    struct iphdr                *iph;               /* ip header           */
+    uint32_t                    i  = wk->n_burst;   /* index in burst      */
+    ssize_t                     ans;                /* answer              */
+
+    RET(i == BURST_MAX, -1, "Burst overflow");
+
+    /* get nfq packet header (w/ metadata)                               *
+     * NOTE: ph may be overwritten when headers are grown in place; keep *
+     *       everything needed for the verdict before annotating         */
+    ph = nfq_get_msg_packet_hdr(nfd);
+    RET(!ph, -1, "Unable to retrieve packet meta hdr (%d)", errno);
+    wk->ids[i] = ntohl(ph->packet_id);
+    b->iph[i]  = NULL;
+
+    /* backlog is past the high-water mark; pass w/o decoding */
+    if (unlikely(wk->ovl.shedding)) {
+        wk->ovl.shed++;
+        goto out;
+    }
+
+    /* extract raw packet */
+    ans = nfq_get_payload(nfd, (uint8_t **) &iph);
+    RET(ans == -1, -1, "Unable to retrieve packet data (%d)", errno);
+    RET(ans != ntohs(iph->tot_len), -1, "Payload size & total len mismatch");
+
+    /* headers are rewritten in the receive slot's headroom (which also *
+     * spans the nfq metadata before the packet) or in the burst; udp    *
+     * options are appended in the slot's tailroom                       */
+    b->iph[i]      = iph;
+    b->tailroom[i] = wk->rx_end - ((uint8_t *) iph + ans);
+    b->skbinfo[i]  = nfq_get_skbinfo(nfd);
+    worker_ctx(wk, nfd, &b->ctx[i]);
+
+out:
+    wk->n_burst++;
+    return 0;
+}
+
+/* mmsg_loop - main loop based on recvmmsg() & sendmsg()
+ *  @wk : worker (nfq queue, socket & verdict batch already set up)
+ *
+ *  @return : 0 if the loop ended because of a shutdown request
+ *
+ * Each iteration receives a burst of up to args.batch netlink messages with
+ * a single recvmmsg(), collects their packets, annotates them as one burst
+ * and then sends every verdict back with a single sendmsg(). The loop ends
+ * when bml is set and the blocking receive is interrupted (the main thread
+ * delivers SIGUSR1 to each worker for this purpose). Socket overruns
+ * (ENOBUFS) are accounted for and survived; see overload.cpp. The receive
+ * buffers come from a pool on this thread's numa node (see pool.cpp).
+ */
+static int mmsg_loop(struct worker *wk)
+{
+    int     ret = 1;
+    ssize_t ans;
+
+    /* one mtu & one jumbo slot per message */
+    ans = pool_init(&wk->pool, RX_MTU_SZ, BATCH_MAX, RX_JUMBO_SZ, BATCH_MAX);
+    RET(ans, 1, "Unable to allocate receive buffers");
+
+    ans = rx_batch_init(&wk->rxb, &wk->pool);
+    GOTO(ans, out, "Unable to set up receive batch");
+
+    while (!bml) {
+        ans = rx_batch_recv(&wk->rxb, wk->fd, args.batch);
+        if (!ans)
+            break;
+        if (ans == -1 && errno == EINTR)
+            continue;
+        if (ans == -1 && errno == ENOBUFS) {
+            ovl_enobufs(&wk->ovl);
+            continue;
+        }
+        GOTO(ans < 0, out, "Error reading from socket (%s)", strerror(errno));
+
+        /* check backlog & adapt queue size to drain rate */
+        ovl_burst(&wk->ovl, ans);
+        clk_burst(&wk->now);
+
+        for (ssize_t i = 0; i < ans; i++) {
+            wk->rx_end = wk->rxb.end[i];
+            nfq_handle_packet(wk->h, (char *) wk->rxb.slot[i] + RX_HEADROOM,
+                wk->rxb.msgs[i].msg_len);
+        }
+
+        /* annotate the burst & queue its verdicts */
+        ans = worker_burst(wk);
+        ALERT(ans, "Unable to queue verdicts for queue %hu", wk->q_num);
+
+        /* send back all verdicts for this burst at once */
+        ans = tx_batch_flush(&wk->txb);
+        ALERT(ans, "Unable to send verdicts for queue %hu", wk->q_num);
+    }
+
+    ret = 0;
+out:
+    pool_fini(&wk->pool);
+    return ret;
+}
+
+/******************************************************************************
+ ****************************** PUBLIC FUNCTIONS ******************************
+ ******************************************************************************/
+
+/* worker_ctx - fills in the decoder context of one packet
+ *  @wk  : worker that received the packet
+ *  @nfd : nfq related data of the packet
+ *  @ctx : decoder context
+ *
+ * The time of processing is the burst clock, sampled once per receive burst
+ * (see clk_burst()). W/ --clock=packet, the kernel's receive timestamp is
+ * used instead, if the packet has one.
+ */
+void worker_ctx(struct worker *wk, struct nfq_data *nfd, struct ops_ctx *ctx)
+{
+    struct timeval tv;
+
+    ctx->flow = NULL;
+    ctx->mtu  = 0;
+
+    if (args.clock == CLK_PACKET && !nfq_get_timestamp(nfd, &tv)) {
+        ctx->now.tv_sec  = tv.tv_sec;
+        ctx->now.tv_nsec = tv.tv_usec * 1000;
+        return;
+    }
+
+    ctx->now = wk->now;
+}
+
+/* worker_burst - annotates the packets collected by annotator()
+ *  @wk : worker
+ *
+ *  @return : 0 if every verdict was queued
+ *
+ * Verdicts are queued in the order the packets were received, so that runs
+ * of unchanged packets still collapse into batch verdicts. W/ --ct-mark, the
+ * first packet of a flow that is out of budget for good marks its connection
+ * instead. Modified packets reference the burst (headers) and the receive
+ * buffers (payload), so the verdicts must be sent before the next burst is
+ * received.
+ */
+int worker_burst(struct worker *wk)
+{
+    struct burst *b = &wk->burst;
+    int          ret = 0;
+    int          ans;
+
+    b->room = RX_HEADROOM;
+    b->ft   = wk->flows;
+    b->bg   = wk->budget;
+    b->pm   = wk->pmtu;
+    args.annotate_burst(b, wk->n_burst, wk->changed);
+
+    for (uint32_t i = 0; i < wk->n_burst; i++) {
+        if (!wk->changed[i] && b->spent[i] && args.ct_mask)
+            ans = tx_batch_accept_ct(&wk->txb, wk->ids[i], args.ct_mark,
+                    args.ct_mask);
+        else if (!wk->changed[i])
+            ans = tx_batch_accept(&wk->txb, wk->ids[i]);
+        else if (args.redirect)
+            ans = tx_batch_verdict_sg(&wk->txb, wk->ids[i],
+                    (args.nq_num << 16) | NF_QUEUE, &b->sg[i]);
+        else
+            ans = tx_batch_verdict_sg(&wk->txb, wk->ids[i], NF_ACCEPT,
+                    &b->sg[i]);
+        ret |= ans;
+    }
+
+    wk->n_burst = 0;
+    return ret;
+}
+
+/* worker_main - worker thread routine; services exactly one queue
+ *  @data : pointer to this thread's struct worker
+ *
+ *  @return : NULL
+ *
+ * The worker opens its own nfq handle (and thus its own netlink socket) so
+ * that multiple queues can be drained in parallel without any locking. If
+ * wk->cpu is not negative, the thread first pins itself to that cpu; this
+ * should match the cpu that feeds the queue (iptables --queue-cpu-fanout).
+ *
+ * The queue is then serviced by one of three main loops: mmsg_loop()
+ * (default), pipe_loop() (pipeline mode) or uring_loop() (if built w/
+ * io_uring support and requested).
+ */
+void *worker_main(void *data)
+{
+    struct worker *wk = (struct worker *) data;
+    cpu_set_t     cpus;             /* affinity mask */
+    ssize_t       ans;              /* answer        */
+
+    /* pin thread to its queue's cpu */
+    if (wk->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(wk->cpu, &cpus);
+
+        ans = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        ALERT(ans, "Unable to pin queue %hu worker to cpu %d (%s)",
+            wk->q_num, wk->cpu, strerror(ans));
+    }
+
+    /* open nfq handle */
+    wk->h = nfq_open();
+    GOTO(!wk->h, out, "Unable to open nfq handle (%s)", strerror(errno));
+
+    /* bind nfq handle to queue */
+    wk->qh = nfq_create_queue(wk->h, wk->q_num,
+                args.pipeline ? pipe_dispatch : annotator, wk);
+    GOTO(!wk->qh, cleanup_handle, "Unable to create queue %hu (%s)",
+        wk->q_num, strerror(errno));
+
+    /* set the amount of data to be copied to userspace (max ip packet size) */
+    ans = nfq_set_mode(wk->qh, NFQNL_COPY_PACKET, 0xffff);
+    GOTO(ans < 0, cleanup_queue, "Unable to set mode (%s)", strerror(errno));
+
+    /* receive unsegmented gso packets w/o checksums computed by the kernel *
+     * NOTE: any packet we modify is given a full checksum in userspace     */
+    if (args.gso) {
+        ans = nfq_set_queue_flags(wk->qh, NFQA_CFG_F_GSO, NFQA_CFG_F_GSO);
+        GOTO(ans < 0, cleanup_queue, "Unable to set GSO flag (%s)",
+            strerror(errno));
+    }
+
+    /* have the kernel load its conntrack glue, so that verdicts can set *
+     * connmarks (--ct-mark; see tx_batch_accept_ct())                   */
+    if (args.ct_mask) {
+        ans = nfq_set_queue_flags(wk->qh, NFQA_CFG_F_CONNTRACK,
+                NFQA_CFG_F_CONNTRACK);
+        GOTO(ans < 0, cleanup_queue, "Unable to set conntrack flag (%s)",
+            strerror(errno));
+    }
+
+    /* obtain fd of queue handle's associated socket */
+    wk->fd = nfq_fd(wk->h);
+
+    /* size socket & kernel queue, set fail-open */
+    ans = ovl_init(&wk->ovl, wk->qh, wk->fd);
+    GOTO(ans, cleanup_queue, "Unable to set up overload control");
+
+    /* prepare batched verdicts */
+    ans = tx_batch_init(&wk->txb, wk->fd, wk->q_num);
+    GOTO(ans, cleanup_queue, "Unable to initialize verdict batch");
+
+    /* track flows, budget & path mtus here (pipeline stages keep their own) */
+    if (args.flows && !args.pipeline) {
+        wk->flows = flow_create(args.flows, args.flow_timeout);
+        GOTO(!wk->flows, cleanup_queue, "Unable to create flow table");
+    }
+    if (args.budget && !args.pipeline) {
+        wk->budget = budget_create("Queue", wk->q_num);
+        GOTO(!wk->budget, cleanup_queue, "Unable to create budget");
+    }
+    if (args.pmtu && !args.pipeline) {
+        wk->pmtu = pmtu_create(args.mtu, 1);
+        GOTO(!wk->pmtu, cleanup_queue, "Unable to create path mtu cache");
+    }
+
+    INFO("Worker bound to queue %hu (cpu %d)", wk->q_num, wk->cpu);
+
+    /* read packet bursts into userspace buffers & invoke callback */
+    if (args.pipeline)
+        ans = pipe_loop(wk);
+#ifdef HAVE_URING
+    else if (args.uring)
+        ans = uring_loop(wk);
+#endif
+    else
+        ans = mmsg_loop(wk);
+    ALERT(ans, "Queue %hu main loop failed", wk->q_num);
+
+cleanup_queue:
+    ovl_report(&wk->ovl, wk->q_num);
+    flow_report(wk->flows, "Queue", wk->q_num);
+    flow_destroy(wk->flows);
+    wk->flows = NULL;
+    budget_report(wk->budget);
+    budget_destroy(wk->budget);
+    wk->budget = NULL;
+    pmtu_report(wk->pmtu, "Queue", wk->q_num);
+    pmtu_destroy(wk->pmtu);
+    wk->pmtu = NULL;
+    nfq_destroy_queue(wk->qh);
+cleanup_handle:
+    nfq_close(wk->h);
+out:
+    INFO("Worker for queue %hu exiting", wk->q_num);
+    return NULL;
+}